@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "aesni.h"
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AESNI_X86
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,ssse3")))
+#endif
+
+// number of blocks kept in flight per iteration
+#define AESNI_LANES 8
+
+
+int aesni_supported( void )
+{
+#ifdef AESNI_X86
+	static int supported = -1;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (supported < 0)
+	{
+		supported = 0;
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+			supported = (ecx & bit_AES) && (ecx & bit_SSSE3);
+	}
+
+	return supported;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Import the round keys from a polarssl key schedule. polarssl stores each
+ * 32-bit word little endian, which is the byte order AESENC/AESDEC expect,
+ * and its decryption schedule is already in equivalent inverse cipher form.
+ */
+void aesni_setkey( aesni_context* ctx,
+				   const aes_context* aes )
+{
+	int i;
+
+	ctx->valid = 0;
+
+	if (!aesni_supported() || aes->nr > AESNI_MAX_ROUNDS)
+		return;
+
+	ctx->nr = aes->nr;
+	for(i=0; i<(ctx->nr+1)*4; i++)
+		putle32(ctx->rk + i*4, (u32)aes->rk[i]);
+
+	ctx->valid = 1;
+}
+
+#ifdef AESNI_X86
+AESNI_TARGET
+void aesni_crypt_ctr( aesni_context* ctx,
+					  u8 ctr[16],
+					  const u8* input,
+					  u8* output,
+					  u32 blocks )
+{
+	const __m128i bswap = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+	__m128i rk[AESNI_MAX_ROUNDS+1];
+	__m128i b[AESNI_LANES];
+	u64 hi = getbe64(ctr);
+	u64 lo = getbe64(ctr + 8);
+	int nr = ctx->nr;
+	int i, r;
+
+	for(r=0; r<=nr; r++)
+		rk[r] = _mm_loadu_si128((const __m128i*)(ctx->rk + r*16));
+
+	while(blocks >= AESNI_LANES)
+	{
+		for(i=0; i<AESNI_LANES; i++)
+		{
+			b[i] = _mm_shuffle_epi8(_mm_set_epi64x((long long)lo, (long long)hi), bswap);
+			b[i] = _mm_xor_si128(b[i], rk[0]);
+			if (++lo == 0)
+				hi++;
+		}
+
+		for(r=1; r<nr; r++)
+		{
+			for(i=0; i<AESNI_LANES; i++)
+				b[i] = _mm_aesenc_si128(b[i], rk[r]);
+		}
+
+		for(i=0; i<AESNI_LANES; i++)
+		{
+			b[i] = _mm_aesenclast_si128(b[i], rk[nr]);
+			b[i] = _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i*)(input + i*16)));
+			_mm_storeu_si128((__m128i*)(output + i*16), b[i]);
+		}
+
+		input += AESNI_LANES*16;
+		output += AESNI_LANES*16;
+		blocks -= AESNI_LANES;
+	}
+
+	while(blocks)
+	{
+		b[0] = _mm_shuffle_epi8(_mm_set_epi64x((long long)lo, (long long)hi), bswap);
+		if (++lo == 0)
+			hi++;
+
+		b[0] = _mm_xor_si128(b[0], rk[0]);
+		for(r=1; r<nr; r++)
+			b[0] = _mm_aesenc_si128(b[0], rk[r]);
+		b[0] = _mm_aesenclast_si128(b[0], rk[nr]);
+		b[0] = _mm_xor_si128(b[0], _mm_loadu_si128((const __m128i*)input));
+		_mm_storeu_si128((__m128i*)output, b[0]);
+
+		input += 16;
+		output += 16;
+		blocks--;
+	}
+
+	putbe64(ctr, hi);
+	putbe64(ctr + 8, lo);
+}
+
+/*
+ * CBC decryption has no serial dependency: every plaintext block only needs
+ * its own ciphertext and the previous one, so eight blocks are decrypted at
+ * once. All ciphertext of an iteration is loaded before anything is stored,
+ * which keeps in-place operation safe. Expects a decryption key schedule.
+ */
+AESNI_TARGET
+void aesni_decrypt_cbc( aesni_context* ctx,
+						u8 iv[16],
+						const u8* input,
+						u8* output,
+						u32 blocks )
+{
+	__m128i rk[AESNI_MAX_ROUNDS+1];
+	__m128i c[AESNI_LANES];
+	__m128i b[AESNI_LANES];
+	__m128i prev = _mm_loadu_si128((const __m128i*)iv);
+	int nr = ctx->nr;
+	int i, r;
+
+	for(r=0; r<=nr; r++)
+		rk[r] = _mm_loadu_si128((const __m128i*)(ctx->rk + r*16));
+
+	while(blocks >= AESNI_LANES)
+	{
+		for(i=0; i<AESNI_LANES; i++)
+		{
+			c[i] = _mm_loadu_si128((const __m128i*)(input + i*16));
+			b[i] = _mm_xor_si128(c[i], rk[0]);
+		}
+
+		for(r=1; r<nr; r++)
+		{
+			for(i=0; i<AESNI_LANES; i++)
+				b[i] = _mm_aesdec_si128(b[i], rk[r]);
+		}
+
+		for(i=0; i<AESNI_LANES; i++)
+			b[i] = _mm_aesdeclast_si128(b[i], rk[nr]);
+
+		b[0] = _mm_xor_si128(b[0], prev);
+		for(i=1; i<AESNI_LANES; i++)
+			b[i] = _mm_xor_si128(b[i], c[i-1]);
+		prev = c[AESNI_LANES-1];
+
+		for(i=0; i<AESNI_LANES; i++)
+			_mm_storeu_si128((__m128i*)(output + i*16), b[i]);
+
+		input += AESNI_LANES*16;
+		output += AESNI_LANES*16;
+		blocks -= AESNI_LANES;
+	}
+
+	while(blocks)
+	{
+		c[0] = _mm_loadu_si128((const __m128i*)input);
+
+		b[0] = _mm_xor_si128(c[0], rk[0]);
+		for(r=1; r<nr; r++)
+			b[0] = _mm_aesdec_si128(b[0], rk[r]);
+		b[0] = _mm_aesdeclast_si128(b[0], rk[nr]);
+		b[0] = _mm_xor_si128(b[0], prev);
+		prev = c[0];
+		_mm_storeu_si128((__m128i*)output, b[0]);
+
+		input += 16;
+		output += 16;
+		blocks--;
+	}
+
+	_mm_storeu_si128((__m128i*)iv, prev);
+}
+#else
+void aesni_crypt_ctr( aesni_context* ctx,
+					  u8 ctr[16],
+					  const u8* input,
+					  u8* output,
+					  u32 blocks )
+{
+}
+
+void aesni_decrypt_cbc( aesni_context* ctx,
+						u8 iv[16],
+						const u8* input,
+						u8* output,
+						u32 blocks )
+{
+}
+#endif
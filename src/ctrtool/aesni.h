@@ -0,0 +1,41 @@
+#ifndef _AESNI_H_
+#define _AESNI_H_
+
+#include "types.h"
+#include "polarssl/aes.h"
+
+#define AESNI_MAX_ROUNDS 14
+
+typedef struct
+{
+	u8 rk[(AESNI_MAX_ROUNDS+1)*16];
+	int nr;
+	int valid;
+} aesni_context;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int			aesni_supported( void );
+
+void		aesni_setkey( aesni_context* ctx,
+						  const aes_context* aes );
+
+void		aesni_crypt_ctr( aesni_context* ctx,
+							 u8 ctr[16],
+							 const u8* input,
+							 u8* output,
+							 u32 blocks );
+
+void		aesni_decrypt_cbc( aesni_context* ctx,
+							   u8 iv[16],
+							   const u8* input,
+							   u8* output,
+							   u32 blocks );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _AESNI_H_
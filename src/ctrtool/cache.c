@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "types.h"
+#include "cache.h"
+#include "ctr.h"
+
+#define CACHE_NONE (~0u)
+
+typedef struct
+{
+	u64 device;
+	u64 inode;
+	u64 offset;
+	u64 extent;
+	u32 crypto;
+	u8 key[16];
+	u8 iv[16];
+} cache_tag;
+
+typedef struct
+{
+	cache_tag tag;
+	u32 size;
+	u32 filling;
+	u32 hashnext;
+	u32 prev;
+	u32 next;
+	u8* data;
+} cache_slot;
+
+/*
+ * Slots form one LRU list (head is most recently used) and hang off a
+ * bucket array by tag hash. All state is guarded by a single lock, but
+ * a miss decrypts without holding it: the slot is hashed and marked
+ * filling first, so other threads wanting the same extent wait on
+ * filled instead of decrypting it again, and never evict it meanwhile.
+ */
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	u32 fillcount;
+	u64 budget;
+	cache_slot* slots;
+	u32 slotcount;
+	u32 usedcount;
+	u32* buckets;
+	u32 bucketcount;
+	u32 head;
+	u32 tail;
+	u64 hits;
+	u64 misses;
+} cache = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, CACHE_DEFAULT_BUDGET };
+
+
+void cache_region_init(cache_region* region, const reader_context* reader, u64 offset, u64 size, u32 crypto, const u8 key[16], const u8 iv[16])
+{
+	memset(region, 0, sizeof(cache_region));
+	region->reader = reader;
+	region->offset = offset;
+	region->size = size;
+	region->crypto = crypto;
+	if (key)
+		memcpy(region->key, key, 16);
+	if (iv)
+		memcpy(region->iv, iv, 16);
+}
+
+static u32 cache_hash(const cache_tag* tag)
+{
+	const u8* bytes = (const u8*) tag;
+	u32 hash = 2166136261u;
+	u32 i;
+
+	for(i=0; i<sizeof(cache_tag); i++)
+		hash = (hash ^ bytes[i]) * 16777619u;
+
+	return hash;
+}
+
+static int cache_setup(void)
+{
+	u32 i;
+
+	if (cache.slots)
+		return 1;
+
+	cache.slotcount = (u32)(cache.budget / CACHE_EXTENT_SIZE);
+	if (cache.slotcount == 0)
+		return 0;
+
+	cache.bucketcount = cache.slotcount * 2;
+	cache.slots = calloc(cache.slotcount, sizeof(cache_slot));
+	cache.buckets = malloc(cache.bucketcount * sizeof(u32));
+	if (cache.slots == NULL || cache.buckets == NULL)
+	{
+		free(cache.slots);
+		free(cache.buckets);
+		cache.slots = NULL;
+		cache.buckets = NULL;
+		cache.slotcount = 0;
+		return 0;
+	}
+
+	for(i=0; i<cache.bucketcount; i++)
+		cache.buckets[i] = CACHE_NONE;
+	cache.head = cache.tail = CACHE_NONE;
+	cache.usedcount = 0;
+	return 1;
+}
+
+static void cache_unlink(u32 index)
+{
+	cache_slot* slot = cache.slots + index;
+
+	if (slot->prev != CACHE_NONE)
+		cache.slots[slot->prev].next = slot->next;
+	else
+		cache.head = slot->next;
+
+	if (slot->next != CACHE_NONE)
+		cache.slots[slot->next].prev = slot->prev;
+	else
+		cache.tail = slot->prev;
+}
+
+static void cache_push_front(u32 index)
+{
+	cache_slot* slot = cache.slots + index;
+
+	slot->prev = CACHE_NONE;
+	slot->next = cache.head;
+	if (cache.head != CACHE_NONE)
+		cache.slots[cache.head].prev = index;
+	cache.head = index;
+	if (cache.tail == CACHE_NONE)
+		cache.tail = index;
+}
+
+static void cache_unhash(u32 index)
+{
+	u32* link = cache.buckets + cache_hash(&cache.slots[index].tag) % cache.bucketcount;
+
+	while(*link != CACHE_NONE && *link != index)
+		link = &cache.slots[*link].hashnext;
+	if (*link == index)
+		*link = cache.slots[index].hashnext;
+}
+
+static cache_slot* cache_lookup(const cache_tag* tag, u32 hash)
+{
+	u32 index = cache.buckets[hash % cache.bucketcount];
+
+	while(index != CACHE_NONE)
+	{
+		if (memcmp(&cache.slots[index].tag, tag, sizeof(cache_tag)) == 0)
+		{
+			cache_unlink(index);
+			cache_push_front(index);
+			return cache.slots + index;
+		}
+		index = cache.slots[index].hashnext;
+	}
+
+	return NULL;
+}
+
+/*
+ * Hand out a free slot, or evict the least recently used one that is not
+ * being filled. The slot is unhashed and owns a data buffer on return.
+ */
+static cache_slot* cache_claim(void)
+{
+	u32 index;
+
+	if (cache.usedcount < cache.slotcount)
+	{
+		index = cache.usedcount;
+		cache.slots[index].data = malloc(CACHE_EXTENT_SIZE);
+		if (cache.slots[index].data == NULL)
+			return NULL;
+		cache.usedcount++;
+	}
+	else
+	{
+		index = cache.tail;
+		while(index != CACHE_NONE && cache.slots[index].filling)
+			index = cache.slots[index].prev;
+		if (index == CACHE_NONE)
+			return NULL;
+
+		cache_unlink(index);
+		cache_unhash(index);
+	}
+
+	cache_push_front(index);
+	return cache.slots + index;
+}
+
+static void cache_insert(cache_slot* slot, const cache_tag* tag, u32 hash)
+{
+	u32 index = (u32)(slot - cache.slots);
+	u32* bucket = cache.buckets + hash % cache.bucketcount;
+
+	slot->tag = *tag;
+	slot->hashnext = *bucket;
+	*bucket = index;
+}
+
+static void cache_drop(cache_slot* slot)
+{
+	u32 index = (u32)(slot - cache.slots);
+
+	// move to the tail so the slot is reused first, it is not in a bucket
+	cache_unlink(index);
+	slot->next = CACHE_NONE;
+	slot->prev = cache.tail;
+	if (cache.tail != CACHE_NONE)
+		cache.slots[cache.tail].next = index;
+	cache.tail = index;
+	if (cache.head == CACHE_NONE)
+		cache.head = index;
+}
+
+static int cache_fill(const cache_region* region, u64 extent, u8* data, u32* size)
+{
+	u64 start = extent * CACHE_EXTENT_SIZE;
+	u64 position = region->offset + start;
+	const u8* src;
+	ctr_aes_context aes;
+	u8 iv[16];
+
+	*size = CACHE_EXTENT_SIZE;
+	if (*size > region->size - start)
+		*size = (u32)(region->size - start);
+
+	src = reader_get(region->reader, position, *size);
+	if (src == NULL)
+	{
+		if (*size != reader_read_at(region->reader, position, data, *size))
+			return 0;
+		src = data;
+	}
+
+	if (region->crypto == CACHE_CRYPTO_CTR)
+	{
+		ctr_init_key(&aes, (u8*)region->key);
+		ctr_init_counter(&aes, (u8*)region->iv);
+		ctr_add_counter(&aes, (u32)(start / 0x10));
+		ctr_crypt_counter(&aes, (u8*)src, data, *size);
+	}
+	else
+	{
+		// CBC chains from the last ciphertext block of the previous extent
+		if (start == 0)
+			memcpy(iv, region->iv, 16);
+		else if (16 != reader_read_at(region->reader, position - 16, iv, 16))
+			return 0;
+
+		ctr_init_cbc_decrypt(&aes, (u8*)region->key, iv);
+		ctr_decrypt_cbc(&aes, (u8*)src, data, *size & ~15);
+	}
+
+	return 1;
+}
+
+/*
+ * Read size bytes at position (relative to the region offset), decrypted.
+ * Returns 1 on success. Every extent touched is decrypted at most once
+ * while it stays in the cache.
+ */
+int cache_read(const cache_region* region, u64 position, void* buffer, u64 size)
+{
+	u8* output = (u8*) buffer;
+	u8* scratch = NULL;
+	cache_tag tag;
+	int result = 0;
+
+	if (position > region->size || size > region->size - position)
+		return 0;
+
+	if (region->crypto == CACHE_CRYPTO_NONE)
+		return size == reader_read_at(region->reader, region->offset + position, buffer, (size_t) size);
+
+	memset(&tag, 0, sizeof(cache_tag));
+	tag.device = region->reader->device;
+	tag.inode = region->reader->inode;
+	tag.offset = region->offset;
+	tag.crypto = region->crypto;
+	memcpy(tag.key, region->key, 16);
+	memcpy(tag.iv, region->iv, 16);
+
+	pthread_mutex_lock(&cache.lock);
+
+	while(size)
+	{
+		u32 within = (u32)(position % CACHE_EXTENT_SIZE);
+		cache_slot* slot = NULL;
+		const u8* data;
+		u32 datasize;
+		u32 hash;
+		u32 max;
+		int filled;
+
+		tag.extent = position / CACHE_EXTENT_SIZE;
+		hash = cache_hash(&tag);
+
+		if (cache_setup())
+			slot = cache_lookup(&tag, hash);
+
+		if (slot && slot->filling)
+		{
+			// another thread is decrypting this extent, look again once it is done
+			pthread_cond_wait(&cache.filled, &cache.lock);
+			continue;
+		}
+
+		if (slot)
+		{
+			cache.hits++;
+		}
+		else
+		{
+			cache.misses++;
+
+			if (cache.slots)
+				slot = cache_claim();
+
+			if (slot)
+			{
+				slot->filling = 1;
+				cache_insert(slot, &tag, hash);
+				cache.fillcount++;
+
+				pthread_mutex_unlock(&cache.lock);
+				filled = cache_fill(region, tag.extent, slot->data, &datasize);
+				pthread_mutex_lock(&cache.lock);
+
+				slot->filling = 0;
+				slot->size = datasize;
+				cache.fillcount--;
+				pthread_cond_broadcast(&cache.filled);
+				if (!filled)
+				{
+					cache_unhash((u32)(slot - cache.slots));
+					cache_drop(slot);
+					goto clean;
+				}
+			}
+			else
+			{
+				// caching disabled, out of memory or every slot in flight:
+				// decrypt without keeping it
+				if (scratch == NULL)
+					scratch = malloc(CACHE_EXTENT_SIZE);
+				if (scratch == NULL)
+					goto clean;
+
+				pthread_mutex_unlock(&cache.lock);
+				filled = cache_fill(region, tag.extent, scratch, &datasize);
+				pthread_mutex_lock(&cache.lock);
+				if (!filled)
+					goto clean;
+			}
+		}
+
+		data = slot? slot->data : scratch;
+		datasize = slot? slot->size : datasize;
+		if (within >= datasize)
+			goto clean;
+
+		max = datasize - within;
+		if (max > size)
+			max = (u32) size;
+		memcpy(output, data + within, max);
+
+		output += max;
+		position += max;
+		size -= max;
+	}
+	result = 1;
+
+clean:
+	pthread_mutex_unlock(&cache.lock);
+	free(scratch);
+	return result;
+}
+
+static void cache_release(void)
+{
+	u32 i;
+
+	// fills write into slot buffers without the lock
+	while(cache.fillcount)
+		pthread_cond_wait(&cache.filled, &cache.lock);
+
+	for(i=0; i<cache.usedcount; i++)
+		free(cache.slots[i].data);
+	free(cache.slots);
+	free(cache.buckets);
+	cache.slots = NULL;
+	cache.buckets = NULL;
+	cache.slotcount = 0;
+	cache.usedcount = 0;
+}
+
+/*
+ * Set the memory budget in bytes for decrypted extents. A budget smaller
+ * than one extent disables caching. Drops everything cached so far.
+ */
+void cache_set_budget(u64 budget)
+{
+	pthread_mutex_lock(&cache.lock);
+	cache_release();
+	cache.budget = budget;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+u64 cache_get_budget(void)
+{
+	return cache.budget;
+}
+
+void cache_get_stats(u64* hits, u64* misses)
+{
+	pthread_mutex_lock(&cache.lock);
+	*hits = cache.hits;
+	*misses = cache.misses;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+void cache_print(FILE* out)
+{
+	u64 hits;
+	u64 misses;
+
+	cache_get_stats(&hits, &misses);
+	fprintf(out, "Block cache:            %"PRIu64" hits, %"PRIu64" misses, %"PRIu64" KiB budget\n", hits, misses, cache.budget / 1024);
+}
+
+void cache_free(void)
+{
+	pthread_mutex_lock(&cache.lock);
+	cache_release();
+	pthread_mutex_unlock(&cache.lock);
+}
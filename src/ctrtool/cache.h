@@ -0,0 +1,50 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdio.h>
+#include "types.h"
+#include "reader.h"
+
+#define CACHE_EXTENT_SIZE	(64 * 1024)			// decryption and caching granularity
+#define CACHE_DEFAULT_BUDGET	(16 * 1024 * 1024)	// used until cache_set_budget is called
+
+typedef enum
+{
+	CACHE_CRYPTO_NONE = 0,
+	CACHE_CRYPTO_CTR,
+	CACHE_CRYPTO_CBC,
+} cache_crypto;
+
+/*
+ * An encrypted range of an image. offset is where the counter or IV
+ * starts, extents are aligned relative to it. Extents are shared by
+ * every region with the same file, offset, key and counter, so e.g. the
+ * IVFC and RomFS readers of one NCCH hit the same entries.
+ */
+typedef struct
+{
+	const reader_context* reader;
+	u64 offset;
+	u64 size;
+	u32 crypto;
+	u8 key[16];
+	u8 iv[16];
+} cache_region;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void cache_region_init(cache_region* region, const reader_context* reader, u64 offset, u64 size, u32 crypto, const u8 key[16], const u8 iv[16]);
+int  cache_read(const cache_region* region, u64 position, void* buffer, u64 size);
+void cache_set_budget(u64 budget);
+u64  cache_get_budget(void);
+void cache_get_stats(u64* hits, u64* misses);
+void cache_print(FILE* out);
+void cache_free(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CACHE_H_
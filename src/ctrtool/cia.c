@@ -4,6 +4,7 @@
 #include "types.h"
 #include "utils.h"
 #include "cia.h"
+#include "pipeline.h"
 #include <inttypes.h>
 
 
@@ -15,9 +16,9 @@ void cia_init(cia_context* ctx)
 	tmd_init(&ctx->tmd);
 }
 
-void cia_set_file(cia_context* ctx, FILE* file)
+void cia_set_reader(cia_context* ctx, const reader_context* reader)
 {
-	ctx->file = file;
+	ctx->reader = reader;
 }
 
 void cia_set_offset(cia_context* ctx, u64 offset)
@@ -94,9 +95,9 @@ void cia_save(cia_context* ctx, u32 type, u32 flags)
 
 	switch(type)
 	{
-		case CIATYPE_CERTS: fprintf(stdout, "Saving certs to %s\n", path->pathname); break;
-		case CIATYPE_TIK: fprintf(stdout, "Saving tik to %s\n", path->pathname); break;
-		case CIATYPE_TMD: fprintf(stdout, "Saving tmd to %s\n", path->pathname); break;
+		case CIATYPE_CERTS: fprintf(settings_get_message_file(ctx->usersettings), "Saving certs to %s\n", path->pathname); break;
+		case CIATYPE_TIK: fprintf(settings_get_message_file(ctx->usersettings), "Saving tik to %s\n", path->pathname); break;
+		case CIATYPE_TMD: fprintf(settings_get_message_file(ctx->usersettings), "Saving tmd to %s\n", path->pathname); break;
 		case CIATYPE_CONTENT:
 
 			body  = tmd_get_body(&ctx->tmd);
@@ -109,7 +110,7 @@ void cia_save(cia_context* ctx, u32 type, u32 flags)
 
 				if(ctx->header.contentindex[contentindex >> 3] & (0x80 >> (contentindex & 7))) {
 					sprintf(tmpname, "%s.%04x.%08x", path->pathname, contentindex, getbe32(chunk->id));
-					fprintf(stdout, "Saving content #%04x to %s\n", contentindex, tmpname);
+					fprintf(settings_get_message_file(ctx->usersettings), "Saving content #%04x to %s\n", contentindex, tmpname);
 					
 					if(docrypto) // Decrypt if needed
 					{
@@ -131,49 +132,34 @@ void cia_save(cia_context* ctx, u32 type, u32 flags)
 			return;
 		break;
 
-		case CIATYPE_META: fprintf(stdout, "Saving meta to %s\n", path->pathname); break;
+		case CIATYPE_META: fprintf(settings_get_message_file(ctx->usersettings), "Saving meta to %s\n", path->pathname); break;
 	}
 
 	cia_save_blob(ctx, path->pathname, offset, size, 0);
 }
 
+static void cia_pipeline_decrypt(void* arg, const u8* input, u8* output, u32 size)
+{
+	cia_context* ctx = (cia_context*) arg;
+
+	ctr_decrypt_cbc_parallel(&ctx->aes, (u8*)input, output, size, settings_get_thread_count(ctx->usersettings));
+}
+
 void cia_save_blob(cia_context *ctx, char *out_path, u64 offset, u64 size, int do_cbc) 
 {
 	FILE *fout = 0;
-	u8 buffer[16*1024];
 
-	fseeko64(ctx->file, ctx->offset + offset, SEEK_SET);
+	offset += ctx->offset;
+	reader_advise(ctx->reader, offset, size, MAPFILE_SEQUENTIAL);
 
 	fout = fopen(out_path, "wb");
 	if (fout == NULL)
 	{
-		fprintf(stdout, "Error opening out file %s\n", out_path);
+		fprintf(stderr, "Error opening out file %s\n", out_path);
 		goto clean;
 	}
 
-	while(size)
-	{
-		u32 max = sizeof(buffer);
-		if (max > size)
-			max = (u32) size;
-
-		if (max != fread(buffer, 1, max, ctx->file))
-		{
-			fprintf(stdout, "Error reading file\n");
-			goto clean;
-		}
-
-		if (do_cbc == 1)
-			ctr_decrypt_cbc(&ctx->aes, buffer, buffer, max);
-
-		if (max != fwrite(buffer, 1, max, fout))
-		{
-			fprintf(stdout, "Error writing file\n");
-			goto clean;
-		}
-
-		size -= max;
-	}
+	pipeline_copy(ctx->reader, offset, size, fout, (do_cbc == 1)? cia_pipeline_decrypt : NULL, ctx);
 
 clean:
 	if (fout)
@@ -181,14 +167,16 @@ clean:
 }
 
 
-void cia_process(cia_context* ctx, u32 actions)
-{	
-	fseeko64(ctx->file, 0, SEEK_SET);
-
-	if (fread(&ctx->header, 1, sizeof(ctr_ciaheader), ctx->file) != sizeof(ctr_ciaheader))
+/*
+ * Read the CIA header and lay out the sections that follow it. Nothing
+ * past the header is touched. Returns 1 on success.
+ */
+int cia_read_header(cia_context* ctx)
+{
+	if (reader_read_at(ctx->reader, 0, &ctx->header, sizeof(ctr_ciaheader)) != sizeof(ctr_ciaheader))
 	{
 		fprintf(stderr, "Error reading CIA header\n");
-		goto clean;
+		return 0;
 	}
 
 	ctx->sizeheader = getle32(ctx->header.headersize);
@@ -204,11 +192,19 @@ void cia_process(cia_context* ctx, u32 actions)
 	ctx->offsetcontent = align((u32) (ctx->offsettmd + ctx->sizetmd), 64);
 	ctx->offsetmeta = align64(ctx->offsetcontent + ctx->sizecontent, 64);
 
+	return 1;
+}
+
+void cia_process(cia_context* ctx, u32 actions)
+{	
+	if (!cia_read_header(ctx))
+		goto clean;
+
 	if (actions & InfoFlag)
 		cia_print(ctx);
 
 
-	tik_set_file(&ctx->tik, ctx->file);
+	tik_set_file(&ctx->tik, ctx->reader->file);
 	tik_set_offset(&ctx->tik, ctx->offsettik);
 	tik_set_size(&ctx->tik, ctx->sizetik);
 	tik_set_usersettings(&ctx->tik, ctx->usersettings);
@@ -221,7 +217,7 @@ void cia_process(cia_context* ctx, u32 actions)
 	else if (settings_get_title_key(ctx->usersettings))
 		memcpy(ctx->titlekey, settings_get_title_key(ctx->usersettings), 16);
 
-	tmd_set_file(&ctx->tmd, ctx->file);
+	tmd_set_file(&ctx->tmd, ctx->reader->file);
 	tmd_set_offset(&ctx->tmd, ctx->offsettmd);
 	tmd_set_size(&ctx->tmd, ctx->sizetmd);
 	tmd_set_usersettings(&ctx->tmd, ctx->usersettings);
@@ -255,14 +251,16 @@ void cia_verify_contents(cia_context *ctx, u32 actions)
 	ctr_tmd_body *body;
 	ctr_tmd_contentchunk *chunk;
 	u8 *verify_buf;
+	const u8 *src;
 	u32 content_size=0;
+	u64 offset;
 	unsigned i;
 
 	// verify TMD content hashes, requires decryption ..
 	body  = tmd_get_body(&ctx->tmd);
 	chunk = (ctr_tmd_contentchunk*)(body->contentinfo + (sizeof(ctr_tmd_contentinfo) * TMD_MAX_CONTENTS));
 
-	fseeko64(ctx->file, ctx->offset + ctx->offsetcontent, SEEK_SET);
+	offset = ctx->offset + ctx->offsetcontent;
 	for(i = 0; i < getbe16(body->contentcount); i++) 
 	{
 		contentindex = getbe16(chunk->index);
@@ -273,25 +271,44 @@ void cia_verify_contents(cia_context *ctx, u32 actions)
 
 			contentflags = getbe16(chunk->type);
 
-			verify_buf = malloc(content_size);
-			fread(verify_buf, content_size, 1, ctx->file);
+			src = reader_get(ctx->reader, offset, content_size);
 
 			if(contentflags & 1 && !(actions & PlainFlag)) // Decrypt if needed
 			{
+				verify_buf = malloc(content_size);
+				if (src == NULL)
+				{
+					reader_read_at(ctx->reader, offset, verify_buf, content_size);
+					src = verify_buf;
+				}
+
 				ctx->iv[0] = (contentindex >> 8) & 0xff;
 				ctx->iv[1] = contentindex & 0xff;
 
 				ctr_init_cbc_decrypt(&ctx->aes, ctx->titlekey, ctx->iv);
 			
-				ctr_decrypt_cbc(&ctx->aes, verify_buf, verify_buf, content_size);
+				ctr_decrypt_cbc_parallel(&ctx->aes, (u8*)src, verify_buf, content_size, settings_get_thread_count(ctx->usersettings));
+				src = verify_buf;
+			}
+			else if (src)
+			{
+				// plain content is hashed straight from the mapping
+				verify_buf = NULL;
+			}
+			else
+			{
+				verify_buf = malloc(content_size);
+				reader_read_at(ctx->reader, offset, verify_buf, content_size);
+				src = verify_buf;
 			}
 
-			if (ctr_sha_256_verify(verify_buf, content_size, chunk->hash) == Good)
+			if (ctr_sha_256_verify(src, content_size, chunk->hash) == Good)
 				ctx->tmd.content_hash_stat[i] = 1;
 			else
 				ctx->tmd.content_hash_stat[i] = 2;
 
 			free(verify_buf);
+			offset += content_size;
 		}
 		chunk++;
 	}
@@ -7,6 +7,7 @@
 #include "tmd.h"
 #include "ctr.h"
 #include "settings.h"
+#include "reader.h"
 
 typedef enum
 {
@@ -17,6 +18,8 @@ typedef enum
 	CIATYPE_META,
 } cia_types;
 
+#define CIA_META_ICON_OFFSET	0x400	// after the dependency list and core version
+
 typedef struct
 {
 	u8 headersize[4];
@@ -32,7 +35,7 @@ typedef struct
 
 typedef struct
 {
-	FILE* file;
+	const reader_context* reader;
 	u64 offset;
 	u64 size;
 	u8 titlekey[16];
@@ -59,10 +62,11 @@ typedef struct
 } cia_context;
 
 void cia_init(cia_context* ctx);
-void cia_set_file(cia_context* ctx, FILE* file);
+void cia_set_reader(cia_context* ctx, const reader_context* reader);
 void cia_set_offset(cia_context* ctx, u64 offset);
 void cia_set_size(cia_context* ctx, u64 size);
 void cia_set_usersettings(cia_context* ctx, settings* usersettings);
+int cia_read_header(cia_context* ctx);
 void cia_print(cia_context* ctx);
 void cia_save(cia_context* ctx, u32 type, u32 flags);
 void cia_process(cia_context* ctx, u32 actions);
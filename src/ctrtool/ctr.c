@@ -5,6 +5,31 @@
 
 #include "ctr.h"
 #include "utils.h"
+#include "worker.h"
+#include "sha256simd.h"
+
+// smallest slice of data handed to a single worker
+#define CTR_PARALLEL_MIN_CHUNK (64 * 1024)
+#define CBC_PARALLEL_MIN_CHUNK (64 * 1024)
+
+typedef struct
+{
+	ctr_aes_context* ctx;
+	u8* input;
+	u8* output;
+	u32 chunksize;
+	u32 size;
+} ctr_counter_job;
+
+typedef struct
+{
+	ctr_aes_context* ctx;
+	u8* input;
+	u8* output;
+	u8* ivs;
+	u32 chunksize;
+	u32 size;
+} ctr_cbc_job;
 
 
 void ctr_set_iv( ctr_aes_context* ctx,
@@ -23,7 +48,7 @@ void ctr_add_counter( ctr_aes_context* ctx,
 	ctr[0] = getbe32(&ctx->ctr[12]);
 
 	for (u32 i = 0; i < 4; i++) {
-		u64 total = ctr[i] + block_num;
+		u64 total = (u64)ctr[i] + block_num;
 		// if there wasn't a wrap around, add the two together and exit
 		if (total <= 0xffffffff) {
 			ctr[i] += block_num;
@@ -53,6 +78,7 @@ void ctr_init_key(ctr_aes_context* ctx,
 				       u8 key[16])
 {
 	aes_setkey_enc(&ctx->aes, key, 128);
+	aesni_setkey(&ctx->aesni, &ctx->aes);
 }
 
 void ctr_init_counter( ctr_aes_context* ctx,
@@ -98,6 +124,17 @@ void ctr_crypt_counter( ctr_aes_context* ctx,
 	u8 stream[16];
 	u32 i;
 
+	// bulk of the data goes through the pipelined AES-NI path when available
+	if (ctx->aesni.valid && input && output && size >= 16)
+	{
+		u32 blocks = size / 16;
+
+		aesni_crypt_ctr(&ctx->aesni, ctx->ctr, input, output, blocks);
+		input += blocks * 16;
+		output += blocks * 16;
+		size -= blocks * 16;
+	}
+
 	while(size >= 16)
 	{
 		ctr_crypt_counter_block(ctx, input, output);
@@ -127,11 +164,60 @@ void ctr_crypt_counter( ctr_aes_context* ctx,
 	}
 }
 
+static void ctr_crypt_counter_job(void* arg, u32 index)
+{
+	ctr_counter_job* job = (ctr_counter_job*) arg;
+	ctr_aes_context ctx = *job->ctx;
+	u32 offset = index * job->chunksize;
+	u32 size = job->size - offset;
+
+	if (size > job->chunksize)
+		size = job->chunksize;
+
+	ctr_add_counter(&ctx, offset / 16);
+	ctr_crypt_counter(&ctx, job->input + offset, job->output + offset, size);
+}
+
+/*
+ * Same as ctr_crypt_counter, but the buffer is cut into block aligned ranges
+ * that each start from their own counter and are processed by a worker pool.
+ */
+void ctr_crypt_counter_parallel( ctr_aes_context* ctx, 
+								 u8* input, 
+								 u8* output,
+								 u32 size,
+								 u32 threadcount )
+{
+	ctr_counter_job job;
+	u32 jobcount;
+
+	if (threadcount <= 1 || input == 0 || size < 2 * CTR_PARALLEL_MIN_CHUNK)
+	{
+		ctr_crypt_counter(ctx, input, output, size);
+		return;
+	}
+
+	job.chunksize = align(size / threadcount, 16);
+	if (job.chunksize < CTR_PARALLEL_MIN_CHUNK)
+		job.chunksize = CTR_PARALLEL_MIN_CHUNK;
+	jobcount = (size + job.chunksize - 1) / job.chunksize;
+
+	job.ctx = ctx;
+	job.input = input;
+	job.output = output;
+	job.size = size;
+
+	worker_run(threadcount, jobcount, ctr_crypt_counter_job, &job);
+
+	ctr_add_counter(ctx, (size + 15) / 16);
+}
+
 void ctr_init_cbc_encrypt( ctr_aes_context* ctx,
 						   u8 key[16],
 						   u8 iv[16] )
 {
 	aes_setkey_enc(&ctx->aes, key, 128);
+	aesni_setkey(&ctx->aesni, &ctx->aes);
 	ctr_set_iv(ctx, iv);
 }
 
@@ -140,6 +226,7 @@ void ctr_init_cbc_decrypt( ctr_aes_context* ctx,
 						   u8 iv[16] )
 {
 	aes_setkey_dec(&ctx->aes, key, 128);
+	aesni_setkey(&ctx->aesni, &ctx->aes);
 	ctr_set_iv(ctx, iv);
 }
 
@@ -156,14 +243,85 @@ void ctr_decrypt_cbc( ctr_aes_context* ctx,
 					  u8* output,
 					  u32 size )
 {
-	aes_crypt_cbc(&ctx->aes, AES_DECRYPT, size, ctx->iv, input, output);
+	if (ctx->aesni.valid && (size % 16) == 0)
+		aesni_decrypt_cbc(&ctx->aesni, ctx->iv, input, output, size / 16);
+	else
+		aes_crypt_cbc(&ctx->aes, AES_DECRYPT, size, ctx->iv, input, output);
+}
+
+static void ctr_decrypt_cbc_job(void* arg, u32 index)
+{
+	ctr_cbc_job* job = (ctr_cbc_job*) arg;
+	ctr_aes_context ctx = *job->ctx;
+	u32 offset = index * job->chunksize;
+	u32 size = job->size - offset;
+
+	if (size > job->chunksize)
+		size = job->chunksize;
+
+	memcpy(ctx.iv, job->ivs + index * 16, 16);
+	ctr_decrypt_cbc(&ctx, job->input + offset, job->output + offset, size);
+}
+
+/*
+ * Decrypt a CBC stream split over several threads. The IV of every slice is
+ * the last ciphertext block of the slice before it, so all of them are saved
+ * up front, which keeps in-place decryption (input == output) working.
+ */
+void ctr_decrypt_cbc_parallel( ctr_aes_context* ctx, 
+							   u8* input,
+							   u8* output,
+							   u32 size,
+							   u32 threadcount )
+{
+	ctr_cbc_job job;
+	u32 jobcount;
+	u32 i;
+	u8 lastblock[16];
+
+	if (threadcount <= 1 || (size % 16) != 0 || size < 2 * CBC_PARALLEL_MIN_CHUNK)
+	{
+		ctr_decrypt_cbc(ctx, input, output, size);
+		return;
+	}
+
+	job.chunksize = align(size / threadcount, 16);
+	if (job.chunksize < CBC_PARALLEL_MIN_CHUNK)
+		job.chunksize = CBC_PARALLEL_MIN_CHUNK;
+	jobcount = (size + job.chunksize - 1) / job.chunksize;
+
+	job.ivs = malloc(jobcount * 16);
+	if (job.ivs == 0)
+	{
+		ctr_decrypt_cbc(ctx, input, output, size);
+		return;
+	}
+
+	memcpy(job.ivs, ctx->iv, 16);
+	for(i=1; i<jobcount; i++)
+		memcpy(job.ivs + i * 16, input + i * job.chunksize - 16, 16);
+	memcpy(lastblock, input + size - 16, 16);
+
+	job.ctx = ctx;
+	job.input = input;
+	job.output = output;
+	job.size = size;
+
+	worker_run(threadcount, jobcount, ctr_decrypt_cbc_job, &job);
+
+	memcpy(ctx->iv, lastblock, 16);
+	free(job.ivs);
 }
 
 void ctr_sha_256( const u8* data, 
 				  u32 size, 
 				  u8 hash[0x20] )
 {
-	sha2(data, size, hash, 0);
+	ctr_sha256_context ctx;
+
+	ctr_sha_256_init(&ctx);
+	ctr_sha_256_update(&ctx, data, size);
+	ctr_sha_256_finish(&ctx, hash);
 }
 
 int ctr_sha_256_verify( const u8* data, 
@@ -172,7 +330,7 @@ int ctr_sha_256_verify( const u8* data,
 {
 	u8 hash[0x20];
 
-	sha2(data, size, hash, 0);
+	ctr_sha_256(data, size, hash);
 
 	if (memcmp(hash, checkhash, 0x20) == 0)
 		return Good;
@@ -180,16 +338,91 @@ int ctr_sha_256_verify( const u8* data,
 		return Fail;
 }
 
+void ctr_sha_256_many( const u8* blocks,
+					   u32 count,
+					   u32 blocksize,
+					   u8* hashes )
+{
+	u32 i = sha256simd_many(blocks, count, blocksize, hashes);
+
+	for(; i<count; i++)
+		ctr_sha_256(blocks + (u64)i * blocksize, blocksize, hashes + i * 0x20);
+}
+
 void ctr_sha_256_init( ctr_sha256_context* ctx )
 {
 	sha2_starts(&ctx->sha, 0);
 }
 
+static void ctr_sha_256_blocks( sha2_context* sha,
+							    const u8* data,
+								u32 blocks )
+{
+	u32 state[8];
+	int i;
+
+	for(i=0; i<8; i++)
+		state[i] = (u32)sha->state[i];
+
+	sha256simd_process(state, data, blocks);
+
+	for(i=0; i<8; i++)
+		sha->state[i] = state[i];
+}
+
+/*
+ * Mirrors sha2_update, except that whole blocks go to the SHA-NI/AVX2
+ * compression function when the CPU has one. The polarssl context layout
+ * is kept, so sha2_finish still produces the digest.
+ */
 void ctr_sha_256_update( ctr_sha256_context* ctx, 
 							    const u8* data,
 								u32 size )
 {
-	sha2_update(&ctx->sha, data, size);
+	sha2_context* sha = &ctx->sha;
+	u32 left;
+	u32 fill;
+
+	if (!sha256simd_supported())
+	{
+		while(size > 0x40000000)
+		{
+			sha2_update(sha, data, 0x40000000);
+			data += 0x40000000;
+			size -= 0x40000000;
+		}
+		sha2_update(sha, data, size);
+		return;
+	}
+
+	if (size == 0)
+		return;
+
+	left = sha->total[0] & 0x3F;
+	fill = 64 - left;
+
+	sha->total[0] = (sha->total[0] + size) & 0xFFFFFFFF;
+	if (sha->total[0] < size)
+		sha->total[1]++;
+
+	if (left && size >= fill)
+	{
+		memcpy(sha->buffer + left, data, fill);
+		ctr_sha_256_blocks(sha, sha->buffer, 1);
+		data += fill;
+		size -= fill;
+		left = 0;
+	}
+
+	if (size >= 64)
+	{
+		ctr_sha_256_blocks(sha, data, size / 64);
+		data += size & ~0x3F;
+		size &= 0x3F;
+	}
+
+	if (size)
+		memcpy(sha->buffer + left, data, size);
 }
 
 
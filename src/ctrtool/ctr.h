@@ -4,6 +4,7 @@
 #include "polarssl/aes.h"
 #include "polarssl/rsa.h"
 #include "polarssl/sha2.h"
+#include "aesni.h"
 #include "types.h"
 #include "keyset.h"
 
@@ -35,6 +36,7 @@ typedef struct
 	u8 ctr[16];
 	u8 iv[16];
 	aes_context aes;
+	aesni_context aesni;
 } ctr_aes_context;
 
 typedef struct
@@ -80,6 +82,13 @@ void		ctr_crypt_counter( ctr_aes_context* ctx,
 							   u32 size );
 
 
+void		ctr_crypt_counter_parallel( ctr_aes_context* ctx, 
+										u8* input, 
+										u8* output,
+										u32 size,
+										u32 threadcount );
+
+
 void		ctr_init_cbc_encrypt( ctr_aes_context* ctx,
 							   u8 key[16],
 							   u8 iv[16] );
@@ -98,6 +107,12 @@ void		ctr_decrypt_cbc( ctr_aes_context* ctx,
 							  u8* output,
 							  u32 size );
 
+void		ctr_decrypt_cbc_parallel( ctr_aes_context* ctx, 
+									   u8* input,
+									   u8* output,
+									   u32 size,
+									   u32 threadcount );
+
 void		ctr_rsa_init_key_pubmodulus( rsakey2048* key, 
 											u8 modulus[0x100] );
 
@@ -132,6 +147,12 @@ int			ctr_sha_256_verify( const u8* data,
 								const u8 checkhash[0x20] );
 
 
+void		ctr_sha_256_many( const u8* blocks,
+							  u32 count,
+							  u32 blocksize,
+							  u8* hashes );
+
+
 void		ctr_sha_256_init( ctr_sha256_context* ctx );
 
 void		ctr_sha_256_update( ctr_sha256_context* ctx, 
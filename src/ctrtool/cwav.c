@@ -32,9 +32,9 @@ void cwav_init(cwav_context* ctx)
 	memset(ctx, 0, sizeof(cwav_context));
 }
 
-void cwav_set_file(cwav_context* ctx, FILE* file)
+void cwav_set_reader(cwav_context* ctx, const reader_context* reader)
 {
-	ctx->file = file;
+	ctx->reader = reader;
 }
 
 void cwav_set_offset(cwav_context* ctx, u64 offset)
@@ -57,13 +57,11 @@ void cwav_process(cwav_context* ctx, u32 actions)
 	u32 i;
 	u32 infoheaderoffset;
 
-	fseeko64(ctx->file, ctx->offset, SEEK_SET);
-	fread(&ctx->header, 1, sizeof(cwav_header), ctx->file);
+	reader_read_at(ctx->reader, ctx->offset, &ctx->header, sizeof(cwav_header));
 
 	infoheaderoffset = getle32(ctx->header.infoblockref.offset);
 
-	fseeko64(ctx->file, ctx->offset + infoheaderoffset, SEEK_SET);
-	fread(&ctx->infoheader, 1, sizeof(cwav_infoheader), ctx->file);
+	reader_read_at(ctx->reader, ctx->offset + infoheaderoffset, &ctx->infoheader, sizeof(cwav_infoheader));
 
 	ctx->channelcount = getle32(ctx->infoheader.channelcount);
 	if (ctx->channelcount)
@@ -72,15 +70,16 @@ void cwav_process(cwav_context* ctx, u32 actions)
 
 		for(i=0; i<ctx->channelcount; i++)
 		{
-			fread(&ctx->channel[i].inforef, sizeof(cwav_reference), 1, ctx->file);
+			u64 refoffset = ctx->offset + infoheaderoffset + sizeof(cwav_infoheader) + i * sizeof(cwav_reference);
+
+			reader_read_at(ctx->reader, refoffset, &ctx->channel[i].inforef, sizeof(cwav_reference));
 		}
 
 		for(i=0; i<ctx->channelcount; i++)
 		{
 			u32 channeloffset = infoheaderoffset + 0x1C + getle32(ctx->channel[i].inforef.offset);
 
-			fseeko64(ctx->file, ctx->offset + channeloffset, SEEK_SET);
-			fread(&ctx->channel[i].info, sizeof(cwav_channelinfo), 1, ctx->file);
+			reader_read_at(ctx->reader, ctx->offset + channeloffset, &ctx->channel[i].info, sizeof(cwav_channelinfo));
 
 			if (ctx->infoheader.encoding == CWAV_ENCODING_DSPADPCM)
 			{
@@ -88,8 +87,7 @@ void cwav_process(cwav_context* ctx, u32 actions)
 				{
 					u32 codecoffset = channeloffset + getle32(ctx->channel[i].info.codecref.offset);
 
-					fseeko64(ctx->file, ctx->offset + codecoffset, SEEK_SET);
-					fread(&ctx->channel[i].infodspadpcm, sizeof(cwav_dspadpcminfo), 1, ctx->file);
+					reader_read_at(ctx->reader, ctx->offset + codecoffset, &ctx->channel[i].infodspadpcm, sizeof(cwav_dspadpcminfo));
 				}
 			}
 			else if (ctx->infoheader.encoding == CWAV_ENCODING_IMAADPCM)
@@ -98,8 +96,7 @@ void cwav_process(cwav_context* ctx, u32 actions)
 				{
 					u32 codecoffset = channeloffset + getle32(ctx->channel[i].info.codecref.offset);
 
-					fseeko64(ctx->file, ctx->offset + codecoffset, SEEK_SET);
-					fread(&ctx->channel[i].infoimaadpcm, sizeof(cwav_imaadpcminfo), 1, ctx->file);
+					reader_read_at(ctx->reader, ctx->offset + codecoffset, &ctx->channel[i].infoimaadpcm, sizeof(cwav_imaadpcminfo));
 				}
 			}
 		}
@@ -440,7 +437,7 @@ int cwav_dspadpcm_setup(cwav_dspadpcmstate* state, cwav_context* ctx, int isloop
 			state->channelstate[i].yn1 = getle16(adpcminfo->yn1);
 			state->channelstate[i].yn2 = getle16(adpcminfo->yn2);
 		}
-		stream_in_allocate(&state->channelstate[i].instreamctx, BUFFERSIZE, ctx->file);
+		stream_in_allocate(&state->channelstate[i].instreamctx, BUFFERSIZE, ctx->reader);
 		stream_in_seek(&state->channelstate[i].instreamctx, state->channelstate[i].sampleoffset);
 	}
 
@@ -495,8 +492,6 @@ int cwav_dspadpcm_decode(cwav_dspadpcmstate* state, cwav_context* ctx)
 			u32 shift;
 			s16 table[14];
 
-			stream_in_reseek(instreamctx);
-
 
 			if (0 == stream_in_byte(instreamctx, &data))
 			{
@@ -638,7 +633,7 @@ int cwav_imaadpcm_setup(cwav_imaadpcmstate* state, cwav_context* ctx, int isloop
 			state->channelstate[i].data = getle16(adpcminfo->data);
 			state->channelstate[i].tableindex = adpcminfo->tableindex;
 		}
-		stream_in_allocate(&state->channelstate[i].instreamctx, BUFFERSIZE, ctx->file);
+		stream_in_allocate(&state->channelstate[i].instreamctx, BUFFERSIZE, ctx->reader);
 		stream_in_seek(&state->channelstate[i].instreamctx, state->channelstate[i].sampleoffset);
 	}
 
@@ -699,8 +694,6 @@ int cwav_imaadpcm_decode(cwav_imaadpcmstate* state, cwav_context* ctx)
 			u8 data;
 
 
-			stream_in_reseek(instreamctx);
-
 
 			if (0 == stream_in_byte(instreamctx, &data))
 			{
@@ -829,7 +822,7 @@ int cwav_pcm_setup(cwav_pcmstate* state, cwav_context* ctx, int isloop)
 
 		state->channelstate[i].samplebuffer = state->samplebuffer + SAMPLECOUNT * i;
 		state->channelstate[i].sampleoffset = (u32) (ctx->offset + getle32(pcmchannel->info.sampleref.offset) + getle32(ctx->header.datablockref.offset) + 8 + startoffset);
-		stream_in_allocate(&state->channelstate[i].instreamctx, BUFFERSIZE, ctx->file);
+		stream_in_allocate(&state->channelstate[i].instreamctx, BUFFERSIZE, ctx->reader);
 		stream_in_seek(&state->channelstate[i].instreamctx, state->channelstate[i].sampleoffset);
 	}
 
@@ -874,8 +867,6 @@ int cwav_pcm_decode(cwav_pcmstate* state, cwav_context* ctx)
 			cwav_channel* pcmchannel = &ctx->channel[c];
 			
 
-			stream_in_reseek(instreamctx);
-
 			for(i=0; i<maxsamplecount; i++)
 			{
 				u8 datalo, datahi;
@@ -163,7 +163,7 @@ typedef struct
 
 typedef struct
 {
-	FILE* file;
+	const reader_context* reader;
 	settings* usersettings;
 	u64 offset;
 	u64 size;
@@ -174,7 +174,7 @@ typedef struct
 } cwav_context;
 
 void cwav_init(cwav_context* ctx);
-void cwav_set_file(cwav_context* ctx, FILE* file);
+void cwav_set_reader(cwav_context* ctx, const reader_context* reader);
 void cwav_set_offset(cwav_context* ctx, u64 offset);
 void cwav_set_size(cwav_context* ctx, u64 size);
 void cwav_set_usersettings(cwav_context* ctx, settings* usersettings);
@@ -7,15 +7,17 @@
 #include "utils.h"
 #include "ncch.h"
 #include "lzss.h"
+#include "pipeline.h"
+#include "cache.h"
 
 void exefs_init(exefs_context* ctx)
 {
 	memset(ctx, 0, sizeof(exefs_context));
 }
 
-void exefs_set_file(exefs_context* ctx, FILE* file)
+void exefs_set_reader(exefs_context* ctx, const reader_context* reader)
 {
-	ctx->file = file;
+	ctx->reader = reader;
 }
 
 void exefs_set_offset(exefs_context* ctx, u64 offset)
@@ -59,6 +61,122 @@ void exefs_set_counter(exefs_context* ctx, u8 counter[16])
 	memcpy(ctx->counter, counter, 16);
 }
 
+/*
+ * Encrypted sections are read through the shared block cache, so verifying
+ * and then saving a section decrypts it only once.
+ */
+static void exefs_cache_region(exefs_context* ctx, u32 keyslot, cache_region* region)
+{
+	cache_region_init(region, ctx->reader, ctx->offset, ctx->size, CACHE_CRYPTO_CTR, ctx->key[keyslot], ctx->counter);
+}
+
+static u32 exefs_section_keyslot(exefs_sectionheader* section)
+{
+	if (strncmp((const char*)section->name, "icon", 8) == 0 || strncmp((const char*)section->name, "banner", 8) == 0)
+		return 0;
+	else
+		return 1;
+}
+
+static int exefs_copy_cached(exefs_context* ctx, exefs_sectionheader* section, u32 offset, u32 size, FILE* fout)
+{
+	cache_region region;
+	u8* buffer = malloc(CACHE_EXTENT_SIZE);
+	int result = 0;
+
+	if (buffer == NULL)
+		return 0;
+
+	exefs_cache_region(ctx, exefs_section_keyslot(section), &region);
+	while(size)
+	{
+		u32 max = CACHE_EXTENT_SIZE;
+		if (max > size)
+			max = size;
+
+		if (!cache_read(&region, offset, buffer, max) || max != fwrite(buffer, 1, max, fout))
+			goto clean;
+
+		offset += max;
+		size -= max;
+	}
+	result = 1;
+
+clean:
+	free(buffer);
+	return result;
+}
+
+/*
+ * Decrypt just the 16-byte blocks covering a small read, without filling
+ * cache extents. Used for the header and for one-off section reads.
+ */
+static int exefs_read_direct(exefs_context* ctx, u32 keyslot, u64 position, void* buffer, u32 size)
+{
+	u64 start = position & ~15ULL;
+	u32 length = (u32)(((position + size + 15) & ~15ULL) - start);
+	ctr_aes_context aes;
+	u8* data;
+	int result = 0;
+
+	if (!ctx->encrypted)
+		return size == reader_read_at(ctx->reader, ctx->offset + position, buffer, size);
+
+	if (start + length > ctx->size)
+		return 0;
+
+	data = malloc(length);
+	if (data == NULL)
+		return 0;
+
+	if (length == reader_read_at(ctx->reader, ctx->offset + start, data, length))
+	{
+		ctr_init_key(&aes, ctx->key[keyslot]);
+		ctr_init_counter(&aes, ctx->counter);
+		ctr_add_counter(&aes, (u32)(start / 0x10));
+		ctr_crypt_counter(&aes, data, data, length);
+		memcpy(buffer, data + (position - start), size);
+		result = 1;
+	}
+
+	free(data);
+	return result;
+}
+
+/*
+ * Index of the non-empty section called name, or -1.
+ */
+int exefs_find_section(exefs_context* ctx, const char* name)
+{
+	u32 i;
+
+	for(i=0; i<EXEFS_SECTION_NUM; i++)
+	{
+		exefs_sectionheader* section = ctx->header.section + i;
+
+		if (getle32(section->size) && strncmp((const char*)section->name, name, 8) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Read size bytes at position within a section, decrypted with the key the
+ * section uses. Returns 1 on success.
+ */
+int exefs_read_section(exefs_context* ctx, u32 index, u32 position, void* buffer, u32 size)
+{
+	exefs_sectionheader* section = ctx->header.section + index;
+	u64 offset = getle32(section->offset) + sizeof(exefs_header);
+	u32 sectionsize = getle32(section->size);
+
+	if (position > sectionsize || size > sectionsize - position || offset + position + size > ctx->size)
+		return 0;
+
+	return exefs_read_direct(ctx, exefs_section_keyslot(section), offset + position, buffer, size);
+}
+
 void exefs_save(exefs_context* ctx, u32 index, u32 flags)
 {
 	exefs_sectionheader* section = (exefs_sectionheader*)(ctx->header.section + index);
@@ -66,19 +184,23 @@ void exefs_save(exefs_context* ctx, u32 index, u32 flags)
 	char name[64];
 	u32 offset;
 	u32 size;
-	FILE* fout;
+	FILE* fout = NULL;
 	u32 compressedsize = 0;
 	u32 decompressedsize = 0;
-	u8* compressedbuffer = 0;
 	u8* decompressedbuffer = 0;
+	u8 footer[LZSS_FOOTER_SIZE];
+	const u8* src;
+	u64 position;
 	filepath* dirpath = 0;
+	cache_region region;
+	oschar_t* tarname = 0;
 	
 	// determine offset/size of target
 	offset = getle32(section->offset) + sizeof(exefs_header);
 	size = getle32(section->size);
 	dirpath = settings_get_exefs_dir_path(ctx->usersettings);
 
-	if (size == 0 || dirpath == 0 || dirpath->valid == 0)
+	if (size == 0 || (ctx->tar == 0 && (dirpath == 0 || dirpath->valid == 0)))
 		return;
 
 	if (size >= ctx->size)
@@ -92,8 +214,13 @@ void exefs_save(exefs_context* ctx, u32 index, u32 flags)
 	memcpy(name, section->name, 8);
 
 	
-	memcpy(outfname, dirpath->pathname, MAX_PATH);
-	strcat(outfname, "/");
+	// archive entries are named like the files in --exefsdir, without the directory
+	outfname[0] = 0;
+	if (ctx->tar == 0)
+	{
+		memcpy(outfname, dirpath->pathname, MAX_PATH);
+		strcat(outfname, "/");
+	}
 
 	if (name[0] == '.')
 		strcat(outfname, name+1);
@@ -101,7 +228,20 @@ void exefs_save(exefs_context* ctx, u32 index, u32 flags)
 		strcat(outfname, name);
 	strcat(outfname, ".bin");
 
-	fout = fopen(outfname, "wb");
+	if (ctx->tar)
+	{
+		fout = ctx->tar->file;
+		tarname = (oschar_t*)os_CopyConvertCharStr(outfname);
+		if (tarname == 0)
+		{
+			fprintf(stderr, "Error allocating memory\n");
+			goto clean;
+		}
+	}
+	else
+	{
+		fout = fopen(outfname, "wb");
+	}
 
 	if (fout == 0)
 	{
@@ -109,114 +249,112 @@ void exefs_save(exefs_context* ctx, u32 index, u32 flags)
 		goto clean;
 	}
 
-	// seek in source file to location of target data
-	fseeko64(ctx->file, ctx->offset + offset, SEEK_SET);
-
-	// do decryption prep
-	if (ctx->encrypted)
-	{
-		// setup aes counter
-		ctr_init_counter(&ctx->aes, ctx->counter);
-		ctr_add_counter(&ctx->aes, offset / 0x10);
-
-		// setup key
-		if (strncmp((const char*)section->name, "icon", 8) == 0 || strncmp((const char*)section->name, "banner", 8) == 0)
-			ctr_init_key(&ctx->aes, ctx->key[0]);
-		else
-			ctr_init_key(&ctx->aes, ctx->key[1]);
-	}
+	position = ctx->offset + offset;
+	src = reader_get(ctx->reader, position, size);
 
 	// if this is file0, and compression is set or forced: decompress section
 	if (index == 0 && (ctx->compressedflag || (flags & DecompressCodeFlag)) && ((flags & RawFlag) == 0))
 	{
-		fprintf(stdout, "Decompressing section %s to %s...\n", name, outfname);
+		if (ctx->tar == 0)
+			fprintf(settings_get_message_file(ctx->usersettings), "Decompressing section %s to %s...\n", name, outfname);
 
 		compressedsize = size;
-		compressedbuffer = malloc(compressedsize);
-
-		if (compressedbuffer == 0)
+		if (compressedsize < LZSS_FOOTER_SIZE || !exefs_read_section(ctx, index, compressedsize - LZSS_FOOTER_SIZE, footer, LZSS_FOOTER_SIZE))
 		{
-			fprintf(stdout, "Error allocating memory\n");
+			fprintf(stderr, "Error reading input file\n");
 			goto clean;
 		}
-		if (compressedsize != fread(compressedbuffer, 1, compressedsize, ctx->file))
+
+		decompressedsize = lzss_get_footer_decompressed_size(footer, compressedsize);
+		if (decompressedsize < compressedsize)
 		{
-			fprintf(stdout, "Error reading input file\n");
+			fprintf(stderr, "Error, compression out of bounds\n");
 			goto clean;
 		}
 
-		// decrypt if required
-		if (ctx->encrypted)
-			ctr_crypt_counter(&ctx->aes, compressedbuffer, compressedbuffer, compressedsize);
-
-
-		decompressedsize = lzss_get_decompressed_size(compressedbuffer, compressedsize);
 		decompressedbuffer = malloc(decompressedsize);
 		if (decompressedbuffer == 0)
 		{
-			fprintf(stdout, "Error allocating memory\n");
+			fprintf(stderr, "Error allocating memory\n");
 			goto clean;
 		}
 
-		if (0 == lzss_decompress(compressedbuffer, compressedsize, decompressedbuffer, decompressedsize))
+		// a plain mapped section is decompressed straight from the mapping,
+		// anything else is read into the head of the output and decompressed in place
+		if (src && !ctx->encrypted)
+		{
+			if (0 == lzss_decompress((u8*)src, compressedsize, decompressedbuffer, decompressedsize))
+				goto clean;
+		}
+		else
+		{
+			if (ctx->encrypted)
+			{
+				exefs_cache_region(ctx, exefs_section_keyslot(section), &region);
+				if (!cache_read(&region, offset, decompressedbuffer, compressedsize))
+				{
+					fprintf(stderr, "Error reading input file\n");
+					goto clean;
+				}
+			}
+			else if (compressedsize != reader_read_at(ctx->reader, position, decompressedbuffer, compressedsize))
+			{
+				fprintf(stderr, "Error reading input file\n");
+				goto clean;
+			}
+
+			if (0 == lzss_decompress_inplace(decompressedbuffer, compressedsize, decompressedsize))
+				goto clean;
+		}
+
+		// the archive header needs the size, so it is written once decompression succeeded
+		if (ctx->tar && !tar_begin_file(ctx->tar, tarname, decompressedsize))
 			goto clean;
 
 		if (decompressedsize != fwrite(decompressedbuffer, 1, decompressedsize, fout))
 		{
-			fprintf(stdout, "Error writing output file\n");
+			fprintf(stderr, "Error writing output file\n");
+			if (ctx->tar)
+				ctx->tar->error = 1;
 			goto clean;
 		}		
 	}
 	else
 	{
-		u8 buffer[16 * 1024];
-
-		fprintf(stdout, "Saving section %s to %s...\n", name, outfname);
-
-		while(size)
-		{
-			u32 max = sizeof(buffer);
-			if (max > size)
-				max = size;
-
-			if (max != fread(buffer, 1, max, ctx->file))
-			{
-				fprintf(stdout, "Error reading input file\n");
-				goto clean;
-			}
+		int copied;
 
-			if (ctx->encrypted)
-				ctr_crypt_counter(&ctx->aes, buffer, buffer, max);
+		if (ctx->tar == 0)
+			fprintf(settings_get_message_file(ctx->usersettings), "Saving section %s to %s...\n", name, outfname);
+		else if (!tar_begin_file(ctx->tar, tarname, size))
+			goto clean;
 
-			if (max != fwrite(buffer, 1, max, fout))
-			{
-				fprintf(stdout, "Error writing output file\n");
-				goto clean;
-			}
+		if (ctx->encrypted)
+			copied = exefs_copy_cached(ctx, section, offset, size, fout);
+		else
+			copied = pipeline_copy(ctx->reader, position, size, fout, NULL, NULL);
 
-			size -= max;
+		// a short entry would shift every header after it
+		if (!copied && ctx->tar)
+		{
+			ctx->tar->error = 1;
+			goto clean;
 		}
 	}
 
+	if (ctx->tar)
+		tar_end_file(ctx->tar);
+
 clean:
-	if (fout)
+	if (fout && ctx->tar == 0)
 		fclose(fout);
-	free(compressedbuffer);
+	free(tarname);
 	free(decompressedbuffer);
 	return;
 }
 
 void exefs_read_header(exefs_context* ctx, u32 flags)
 {
-	fseeko64(ctx->file, ctx->offset, SEEK_SET);
-	fread(&ctx->header, 1, sizeof(exefs_header), ctx->file);
-
-	if (ctx->encrypted) {
-		ctr_init_key(&ctx->aes, ctx->key[0]);
-		ctr_init_counter(&ctx->aes, ctx->counter);
-		ctr_crypt_counter(&ctx->aes, (u8*)&ctx->header, (u8*)&ctx->header, sizeof(exefs_header));
-	}
-		
+	exefs_read_direct(ctx, 0, 0, &ctx->header, sizeof(exefs_header));
 }
 
 void exefs_calculate_hash(exefs_context* ctx, u8 hash[32])
@@ -244,6 +382,7 @@ void exefs_process(exefs_context* ctx, u32 actions)
 	if (actions & ExtractFlag)
 	{
 		filepath* dirpath = settings_get_exefs_dir_path(ctx->usersettings);
+		filepath* tarpath = settings_get_exefs_tar_path(ctx->usersettings);
 
 		if (dirpath && dirpath->valid)
 		{
@@ -251,6 +390,23 @@ void exefs_process(exefs_context* ctx, u32 actions)
 			for(i=0; i<8; i++)
 				exefs_save(ctx, i, actions);
 		}
+
+		if (tarpath && tarpath->valid)
+		{
+			tar_context tar;
+			struct stat imagestat;
+
+			memset(&imagestat, 0, sizeof(imagestat));
+			fstat(fileno(ctx->reader->file), &imagestat);
+			if (tar_open(&tar, tarpath->pathname, imagestat.st_mtime))
+			{
+				ctx->tar = &tar;
+				for(i=0; i<8; i++)
+					exefs_save(ctx, i, actions);
+				ctx->tar = NULL;
+				tar_close(&tar);
+			}
+		}
 	}
 }
 
@@ -261,6 +417,9 @@ int exefs_verify(exefs_context* ctx, u32 index, u32 flags)
 	u32 size;
 	u8 buffer[16 * 1024];
 	u8 hash[0x20];
+	const u8* src;
+	u64 position;
+	cache_region region;
 	
 
 	offset = getle32(section->offset) + sizeof(exefs_header);
@@ -269,30 +428,39 @@ int exefs_verify(exefs_context* ctx, u32 index, u32 flags)
 	if (size == 0)
 		return 0;
 
-	fseeko64(ctx->file, ctx->offset + offset, SEEK_SET);
-	if (strncmp((const char*)section->name, "icon", 8) == 0 || strncmp((const char*)section->name, "banner", 8) == 0)
-		ctr_init_key(&ctx->aes, ctx->key[0]);
-	else
-		ctr_init_key(&ctx->aes, ctx->key[1]);
-	ctr_init_counter(&ctx->aes, ctx->counter);
-	ctr_add_counter(&ctx->aes, offset / 0x10);
+	position = ctx->offset + offset;
+	src = ctx->encrypted? NULL : reader_get(ctx->reader, position, size);
+	exefs_cache_region(ctx, exefs_section_keyslot(section), &region);
 
 	ctr_sha_256_init(&ctx->sha);
 
+	// a plain mapped section is hashed in place
+	if (src && !ctx->encrypted)
+	{
+		ctr_sha_256_update(&ctx->sha, src, size);
+		size = 0;
+	}
+
 	while(size)
 	{
 		u32 max = sizeof(buffer);
 		if (max > size)
 			max = size;
 
-		if (max != fread(buffer, 1, max, ctx->file))
+		if (ctx->encrypted)
+		{
+			if (!cache_read(&region, position - ctx->offset, buffer, max))
+			{
+				fprintf(stderr, "Error reading input file\n");
+				goto clean;
+			}
+		}
+		else if (max != reader_read_at(ctx->reader, position, buffer, max))
 		{
-			fprintf(stdout, "Error reading input file\n");
+			fprintf(stderr, "Error reading input file\n");
 			goto clean;
 		}
-
-		if (ctx->encrypted)
-			ctr_crypt_counter(&ctx->aes, buffer, buffer, max);
+		position += max;
 
 		ctr_sha_256_update(&ctx->sha, buffer, max);
 
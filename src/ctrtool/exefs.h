@@ -6,6 +6,8 @@
 #include "ctr.h"
 #include "filepath.h"
 #include "settings.h"
+#include "reader.h"
+#include "tar.h"
 
 #define EXEFS_SECTION_NUM 8
 
@@ -26,7 +28,7 @@ typedef struct
 
 typedef struct
 {
-	FILE* file;
+	const reader_context* reader;
 	settings* usersettings;
 	u8 titleid[8];
 	u8 counter[16];
@@ -39,10 +41,11 @@ typedef struct
 	int hashcheck[EXEFS_SECTION_NUM];
 	int compressedflag;
 	int encrypted;
+	tar_context* tar;
 } exefs_context;
 
 void exefs_init(exefs_context* ctx);
-void exefs_set_file(exefs_context* ctx, FILE* file);
+void exefs_set_reader(exefs_context* ctx, const reader_context* reader);
 void exefs_set_offset(exefs_context* ctx, u64 offset);
 void exefs_set_size(exefs_context* ctx, u64 size);
 void exefs_set_usersettings(exefs_context* ctx, settings* usersettings);
@@ -56,6 +59,8 @@ void exefs_calculate_hash(exefs_context* ctx, u8 hash[32]);
 void exefs_process(exefs_context* ctx, u32 actions);
 void exefs_print(exefs_context* ctx);
 void exefs_save(exefs_context* ctx, u32 index, u32 flags);
+int exefs_find_section(exefs_context* ctx, const char* name);
+int exefs_read_section(exefs_context* ctx, u32 index, u32 position, void* buffer, u32 size);
 int exefs_verify(exefs_context* ctx, u32 index, u32 flags);
 void exefs_determine_key(exefs_context* ctx, u32 actions);
 #endif // _EXEFS_H_
@@ -11,9 +11,9 @@ void firm_init(firm_context* ctx)
 	memset(ctx, 0, sizeof(firm_context));
 }
 
-void firm_set_file(firm_context* ctx, FILE* file)
+void firm_set_reader(firm_context* ctx, const reader_context* reader)
 {
-	ctx->file = file;
+	ctx->reader = reader;
 }
 
 void firm_set_offset(firm_context* ctx, u64 offset)
@@ -40,6 +40,8 @@ void firm_save(firm_context* ctx, u32 index, u32 flags)
 	FILE* fout;
 	filepath outpath;
 	u8 buffer[16 * 1024];
+	const u8* src;
+	u64 position;
 	
 	
 	offset = getle32(section->offset);
@@ -66,27 +68,35 @@ void firm_save(firm_context* ctx, u32 index, u32 flags)
 	
 	
 
-	fseeko64(ctx->file, ctx->offset + offset, SEEK_SET);
+	position = ctx->offset + offset;
+	src = reader_get(ctx->reader, position, size);
 	fprintf(stdout, "Saving section %d to %s...\n", index, outpath.pathname);
 
 	while(size)
 	{
+		const u8* data = buffer;
 		u32 max = sizeof(buffer);
 		if (max > size)
 			max = size;
 
-		if (max != fread(buffer, 1, max, ctx->file))
+		if (src)
+		{
+			data = src;
+			src += max;
+		}
+		else if (max != reader_read_at(ctx->reader, position, buffer, max))
 		{
 			fprintf(stdout, "Error reading input file\n");
 			goto clean;
 		}
 
-		if (max != fwrite(buffer, 1, max, fout))
+		if (max != fwrite(data, 1, max, fout))
 		{
 			fprintf(stdout, "Error writing output file\n");
 			goto clean;
 		}
 
+		position += max;
 		size -= max;
 	}
 
@@ -100,8 +110,7 @@ void firm_process(firm_context* ctx, u32 actions)
 {
 	u32 i;
 
-	fseeko64(ctx->file, ctx->offset, SEEK_SET);
-	fread(&ctx->header, 1, sizeof(firm_header), ctx->file);
+	reader_read_at(ctx->reader, ctx->offset, &ctx->header, sizeof(firm_header));
 
 	if (getle32(ctx->header.magic) != MAGIC_FIRM)
 	{
@@ -141,6 +150,8 @@ int firm_verify(firm_context* ctx, u32 flags)
 	u32 size;
 	u8 buffer[16 * 1024];
 	u8 hash[0x20];
+	const u8* src;
+	u64 position;
 
 
 	for(i=0; i<4; i++)
@@ -154,17 +165,24 @@ int firm_verify(firm_context* ctx, u32 flags)
 		if (size == 0)
 			return 0;
 
-		fseeko64(ctx->file, ctx->offset + offset, SEEK_SET);
+		position = ctx->offset + offset;
+		src = reader_get(ctx->reader, position, size);
 
 		ctr_sha_256_init(&ctx->sha);
 
+		if (src)
+		{
+			ctr_sha_256_update(&ctx->sha, src, size);
+			size = 0;
+		}
+
 		while(size)
 		{
 			u32 max = sizeof(buffer);
 			if (max > size)
 				max = size;
 
-			if (max != fread(buffer, 1, max, ctx->file))
+			if (max != reader_read_at(ctx->reader, position, buffer, max))
 			{
 				fprintf(stdout, "Error reading input file\n");
 				goto clean;
@@ -172,6 +190,7 @@ int firm_verify(firm_context* ctx, u32 flags)
 
 			ctr_sha_256_update(&ctx->sha, buffer, max);
 
+			position += max;
 			size -= max;
 		}	
 
@@ -6,6 +6,7 @@
 #include "ctr.h"
 #include "filepath.h"
 #include "settings.h"
+#include "reader.h"
 
 
 typedef struct
@@ -33,7 +34,7 @@ typedef struct
 
 typedef struct
 {
-	FILE* file;
+	const reader_context* reader;
 	settings* usersettings;
 	u64 offset;
 	u32 size;
@@ -44,7 +45,7 @@ typedef struct
 } firm_context;
 
 void firm_init(firm_context* ctx);
-void firm_set_file(firm_context* ctx, FILE* file);
+void firm_set_reader(firm_context* ctx, const reader_context* reader);
 void firm_set_offset(firm_context* ctx, u64 offset);
 void firm_set_size(firm_context* ctx, u32 size);
 void firm_set_usersettings(firm_context* ctx, settings* usersettings);
@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "utils.h"
+#include "index.h"
+#include "worker.h"
+
+#define INDEX_HASH_CHUNK_SIZE (1024 * 1024)
+
+typedef struct
+{
+	romfs_context* romfs;
+	index_filehash* records;
+	u64* dataoffset;
+	u64* datasize;
+	int failed;
+} index_hash_job;
+
+
+void index_init(index_context* ctx)
+{
+	memset(ctx, 0, sizeof(index_context));
+}
+
+void index_set_reader(index_context* ctx, const reader_context* reader)
+{
+	ctx->reader = reader;
+}
+
+void index_set_usersettings(index_context* ctx, settings* usersettings)
+{
+	ctx->usersettings = usersettings;
+}
+
+static u64 index_align(u64 value)
+{
+	return (value + 7) & ~(u64)7;
+}
+
+/*
+ * Hash the raw bytes at the start of the RomFS region (or the ExeFS, for
+ * titles without one), so a loaded index can cheaply tell whether it
+ * belongs to the input image.
+ */
+static int index_image_check(const reader_context* reader, u64 offset, u8 hash[0x20])
+{
+	u8 buffer[INDEX_CHECK_SIZE];
+	size_t size = reader_read_at(reader, offset, buffer, sizeof(buffer));
+
+	if (size == 0)
+		return 0;
+
+	ctr_sha_256(buffer, (u32)size, hash);
+	return 1;
+}
+
+/*
+ * Hash the decrypted data of one file, reading positionally with a
+ * private AES context so any number of files can be hashed at once.
+ */
+static void index_hash_file(void* arg, u32 index)
+{
+	index_hash_job* job = (index_hash_job*) arg;
+	romfs_context* romfs = job->romfs;
+	u64 position = romfs->datablockoffset + job->dataoffset[index];
+	u64 size = job->datasize[index];
+	ctr_sha256_context sha;
+	ctr_aes_context aes;
+	u8* buffer = NULL;
+
+
+	if (romfs->encrypted)
+	{
+		ctr_init_key(&aes, romfs->key);
+		ctr_init_counter(&aes, romfs->counter);
+		ctr_add_counter(&aes, (u32)((position - romfs->offset) / 0x10));
+	}
+
+	ctr_sha_256_init(&sha);
+
+	while(size)
+	{
+		u32 max = INDEX_HASH_CHUNK_SIZE;
+		const u8* src;
+
+		if (max > size)
+			max = (u32) size;
+
+		src = reader_get(romfs->reader, position, max);
+		if (src == NULL || romfs->encrypted)
+		{
+			if (buffer == NULL)
+				buffer = malloc(INDEX_HASH_CHUNK_SIZE);
+			if (buffer == NULL)
+			{
+				job->failed = 1;
+				goto clean;
+			}
+
+			if (src)
+			{
+				ctr_crypt_counter(&aes, (u8*)src, buffer, max);
+			}
+			else
+			{
+				if (max != reader_read_at(romfs->reader, position, buffer, max))
+				{
+					job->failed = 1;
+					goto clean;
+				}
+
+				if (romfs->encrypted)
+					ctr_crypt_counter(&aes, buffer, buffer, max);
+			}
+			src = buffer;
+		}
+
+		ctr_sha_256_update(&sha, src, max);
+
+		position += max;
+		size -= max;
+	}
+
+	ctr_sha_256_finish(&sha, job->records[index].hash);
+
+clean:
+	free(buffer);
+}
+
+/*
+ * Collect every file entry of the metadata block in storage order and
+ * hash the files on the worker pool. Returns the number of records, or
+ * -1 on failure.
+ */
+static int index_hash_files(romfs_context* romfs, u32 threadcount, index_filehash** records)
+{
+	index_hash_job job;
+	romfs_fileentry entry;
+	u32 size_without_name = sizeof(romfs_fileentry) - ROMFS_MAXNAMESIZE;
+	u32 capacity = romfs->fileblocksize / size_without_name;
+	u32 count = 0;
+	u32 offset = 0;
+
+
+	memset(&job, 0, sizeof(index_hash_job));
+	job.romfs = romfs;
+	job.records = malloc(capacity * sizeof(index_filehash) + 1);
+	job.dataoffset = malloc(capacity * sizeof(u64) + 1);
+	job.datasize = malloc(capacity * sizeof(u64) + 1);
+	if (job.records == NULL || job.dataoffset == NULL || job.datasize == NULL)
+		goto fail;
+
+	while(offset + size_without_name <= romfs->fileblocksize && count < capacity)
+	{
+		if (!romfs_fileblock_readentry(romfs, offset, &entry))
+			break;
+
+		putle32(job.records[count].entryoffset, offset);
+		job.dataoffset[count] = getle64(entry.dataoffset);
+		job.datasize[count] = getle64(entry.datasize);
+		count++;
+
+		offset += size_without_name + ((getle32(entry.namesize) + 3) & ~3);
+	}
+
+	worker_run(threadcount, count, index_hash_file, &job);
+	if (job.failed)
+		goto fail;
+
+	free(job.dataoffset);
+	free(job.datasize);
+	*records = job.records;
+	return (int)count;
+
+fail:
+	fprintf(stderr, "Error, could not hash RomFS files for index\n");
+	free(job.records);
+	free(job.dataoffset);
+	free(job.datasize);
+	return -1;
+}
+
+static int index_write_section(FILE* fout, index_header* header, index_sectiontype type, u64* offset, const void* data, u64 size)
+{
+	static const u8 padding[8];
+	u64 aligned = index_align(*offset);
+
+	if (aligned != *offset && (aligned - *offset) != fwrite(padding, 1, (size_t)(aligned - *offset), fout))
+		return 0;
+
+	putle64(header->section[type].offset, aligned);
+	putle64(header->section[type].size, size);
+
+	if (size && size != fwrite(data, 1, (size_t)size, fout))
+		return 0;
+
+	*offset = aligned + size;
+	return 1;
+}
+
+/*
+ * Write an index for the given ExeFS and/or RomFS (either may be NULL).
+ * The RomFS must have been processed, so its metadata blocks are loaded.
+ * For an NCCH only the location of its header is stored, not its keys.
+ */
+int index_write(const char* path, const ncch_context* ncch, romfs_context* romfs, exefs_context* exefs, int hashes, u32 threadcount)
+{
+	index_header header;
+	index_filehash* records = NULL;
+	int recordcount = 0;
+	u32 flags = 0;
+	u64 offset;
+	FILE* fout = NULL;
+	int result = 0;
+
+
+	if (romfs && (romfs->dirblock == NULL || romfs->fileblock == NULL || romfs->dirhashtable == NULL || romfs->filehashtable == NULL))
+		romfs = NULL;
+	if (exefs && exefs->size == 0)
+		exefs = NULL;
+
+	if (romfs == NULL && exefs == NULL)
+	{
+		fprintf(stderr, "Error, nothing to index\n");
+		return 0;
+	}
+
+	memset(&header, 0, sizeof(index_header));
+	putle32(header.magic, MAGIC_INDEX);
+	putle32(header.version, INDEX_VERSION);
+	putle32(header.headersize, sizeof(index_header));
+
+	if (exefs)
+	{
+		flags |= INDEX_FLAG_EXEFS;
+		putle32(header.encrypted, exefs->encrypted);
+		putle32(header.exefscompressed, exefs->compressedflag);
+		memcpy(header.exefscounter, exefs->counter, 16);
+		putle64(header.exefs.offset, exefs->offset);
+		putle64(header.exefs.size, exefs->size);
+	}
+
+	if (romfs)
+	{
+		flags |= INDEX_FLAG_ROMFS;
+		putle32(header.encrypted, romfs->encrypted);
+		memcpy(header.romfscounter, romfs->counter, 16);
+		putle64(header.romfs.offset, romfs->offset);
+		putle64(header.romfs.size, romfs->size);
+		putle64(header.datablockoffset, romfs->datablockoffset);
+		memcpy(&header.infoheader, &romfs->infoheader, sizeof(romfs_infoheader));
+
+		if (hashes)
+		{
+			recordcount = index_hash_files(romfs, threadcount, &records);
+			if (recordcount < 0)
+				goto clean;
+			flags |= INDEX_FLAG_HASHES;
+		}
+	}
+
+	if (ncch)
+	{
+		flags |= INDEX_FLAG_NCCH;
+		putle64(header.ncchoffset, ncch->offset);
+	}
+
+	putle32(header.flags, flags);
+
+	if (!index_image_check(romfs? romfs->reader : exefs->reader, romfs? romfs->offset : exefs->offset, header.imagecheck))
+	{
+		fprintf(stderr, "Error reading input file\n");
+		goto clean;
+	}
+
+	fout = fopen(path, "wb");
+	if (fout == NULL)
+	{
+		fprintf(stderr, "Error, failed to create file %s\n", path);
+		goto clean;
+	}
+
+	fprintf(settings_get_message_file(romfs? romfs->usersettings : exefs->usersettings), "Saving index to %s...\n", path);
+
+	// the header is rewritten once the section table is known
+	offset = sizeof(index_header);
+	if (sizeof(index_header) != fwrite(&header, 1, sizeof(index_header), fout))
+		goto writeerror;
+
+	if (romfs)
+	{
+		if (!index_write_section(fout, &header, INDEX_DIRHASHTABLE, &offset, romfs->dirhashtable, romfs->dirhashcount * 4) ||
+			!index_write_section(fout, &header, INDEX_DIRMETA, &offset, romfs->dirblock, romfs->dirblocksize) ||
+			!index_write_section(fout, &header, INDEX_FILEHASHTABLE, &offset, romfs->filehashtable, romfs->filehashcount * 4) ||
+			!index_write_section(fout, &header, INDEX_FILEMETA, &offset, romfs->fileblock, romfs->fileblocksize) ||
+			!index_write_section(fout, &header, INDEX_FILEHASHES, &offset, records, (u64)recordcount * sizeof(index_filehash)))
+			goto writeerror;
+	}
+
+	if (fseeko64(fout, 0, SEEK_SET) != 0 || sizeof(index_header) != fwrite(&header, 1, sizeof(index_header), fout))
+		goto writeerror;
+
+	result = 1;
+	goto clean;
+
+writeerror:
+	fprintf(stderr, "Error writing output file\n");
+clean:
+	if (fout)
+		fclose(fout);
+	free(records);
+	return result;
+}
+
+static int index_check_region(const index_context* ctx, const index_region* region)
+{
+	u64 offset = getle64(region->offset);
+	u64 size = getle64(region->size);
+
+	return offset <= ctx->size && size <= ctx->size - offset;
+}
+
+/*
+ * Derive the keys the same way processing the NCCH would, from its
+ * header in the input image and the current keyset. Returns 1 on success.
+ */
+static int index_derive_keys(index_context* ctx, const index_header* header)
+{
+	ncch_context* ncch;
+	int result = 0;
+
+	ctx->encrypted = getle32(header->encrypted);
+	memset(ctx->key, 0, sizeof(ctx->key));
+	if (!(getle32(header->flags) & INDEX_FLAG_NCCH) || ctx->encrypted == NCCHCRYPTO_NONE)
+		return 1;
+
+	ncch = malloc(sizeof(ncch_context));
+	if (ncch == NULL)
+		return 0;
+
+	ncch_init(ncch);
+	ncch_set_reader(ncch, ctx->reader);
+	ncch_set_offset(ncch, getle64(header->ncchoffset));
+	ncch_set_usersettings(ncch, ctx->usersettings);
+	if (sizeof(ctr_ncchheader) == reader_read_at(ctx->reader, ncch->offset, &ncch->header, sizeof(ctr_ncchheader)) &&
+		getle32(ncch->header.magic) == MAGIC_NCCH)
+	{
+		ncch_determine_key(ncch, 0);
+		if (ncch->encrypted != NCCHCRYPTO_BROKEN)
+		{
+			ctx->encrypted = ncch->encrypted;
+			memcpy(ctx->key, ncch->key, sizeof(ctx->key));
+			result = 1;
+		}
+	}
+
+	free(ncch);
+	return result;
+}
+
+/*
+ * Map an index and make sure it is well formed and belongs to the input.
+ * Nothing from the image itself is parsed.
+ */
+int index_load(index_context* ctx, const char* path)
+{
+	const index_header* header;
+	u8 hash[0x20];
+	u32 flags;
+	u32 i;
+
+
+	ctx->file = fopen(path, "rb");
+	if (ctx->file == NULL)
+	{
+		fprintf(stderr, "Error, could not open index %s\n", path);
+		return 0;
+	}
+
+	ctx->size = _fsize(path);
+	if (mapfile_open(&ctx->map, ctx->file, ctx->size))
+	{
+		ctx->data = ctx->map.data;
+	}
+	else
+	{
+		ctx->buffer = malloc(ctx->size + 1);
+		if (ctx->buffer == NULL || ctx->size != fread(ctx->buffer, 1, ctx->size, ctx->file))
+		{
+			fprintf(stderr, "Error, could not read index %s\n", path);
+			return 0;
+		}
+		ctx->data = ctx->buffer;
+	}
+
+	header = (const index_header*) ctx->data;
+	if (ctx->size < sizeof(index_header) || getle32(header->magic) != MAGIC_INDEX ||
+		getle32(header->version) != INDEX_VERSION || getle32(header->headersize) != sizeof(index_header))
+	{
+		fprintf(stderr, "Error, %s is not a valid index\n", path);
+		return 0;
+	}
+
+	flags = getle32(header->flags);
+	for(i=0; i<INDEX_SECTION_NUM; i++)
+	{
+		if (!index_check_region(ctx, header->section + i))
+		{
+			fprintf(stderr, "Error, index %s is corrupted\n", path);
+			return 0;
+		}
+	}
+
+	if (!index_image_check(ctx->reader, getle64((flags & INDEX_FLAG_ROMFS)? header->romfs.offset : header->exefs.offset), hash) ||
+		memcmp(hash, header->imagecheck, 0x20) != 0)
+	{
+		fprintf(stderr, "Error, index %s does not match the input file\n", path);
+		return 0;
+	}
+
+	if (!index_derive_keys(ctx, header))
+	{
+		fprintf(stderr, "Error, could not derive the keys for index %s\n", path);
+		return 0;
+	}
+
+	ctx->header = header;
+	return 1;
+}
+
+/*
+ * Set up the ExeFS and RomFS contexts straight from the index and run
+ * the requested actions on them. Returns 0 if a requested RomFS file
+ * could not be extracted.
+ */
+int index_process(index_context* ctx, u32 actions)
+{
+	const index_header* header = ctx->header;
+	u32 flags = getle32(header->flags);
+	u8 counter[16];
+
+
+	if (flags & INDEX_FLAG_EXEFS)
+	{
+		exefs_init(&ctx->exefs);
+		memcpy(counter, header->exefscounter, 16);
+		exefs_set_reader(&ctx->exefs, ctx->reader);
+		exefs_set_offset(&ctx->exefs, getle64(header->exefs.offset));
+		exefs_set_size(&ctx->exefs, getle64(header->exefs.size));
+		exefs_set_usersettings(&ctx->exefs, ctx->usersettings);
+		exefs_set_counter(&ctx->exefs, counter);
+		exefs_set_keys(&ctx->exefs, ctx->key[0], ctx->key[1]);
+		exefs_set_encrypted(&ctx->exefs, ctx->encrypted);
+		exefs_set_compressedflag(&ctx->exefs, getle32(header->exefscompressed));
+		exefs_process(&ctx->exefs, actions);
+	}
+
+	if (flags & INDEX_FLAG_ROMFS)
+	{
+		romfs_context* romfs = &ctx->romfs;
+
+		romfs_init(romfs);
+		memcpy(counter, header->romfscounter, 16);
+		romfs_set_reader(romfs, ctx->reader);
+		romfs_set_offset(romfs, getle64(header->romfs.offset));
+		romfs_set_size(romfs, getle64(header->romfs.size));
+		romfs_set_usersettings(romfs, ctx->usersettings);
+		romfs_set_counter(romfs, counter);
+		romfs_set_key(romfs, ctx->key[1]);
+		romfs_set_encrypted(romfs, ctx->encrypted);
+
+		// the metadata blocks are only ever read, so they can point into the index
+		memcpy(&romfs->infoheader, &header->infoheader, sizeof(romfs_infoheader));
+		romfs->dirhashtable = (u8*)ctx->data + getle64(header->section[INDEX_DIRHASHTABLE].offset);
+		romfs->dirhashcount = (u32)(getle64(header->section[INDEX_DIRHASHTABLE].size) / 4);
+		romfs->dirblock = (u8*)ctx->data + getle64(header->section[INDEX_DIRMETA].offset);
+		romfs->dirblocksize = (u32)getle64(header->section[INDEX_DIRMETA].size);
+		romfs->filehashtable = (u8*)ctx->data + getle64(header->section[INDEX_FILEHASHTABLE].offset);
+		romfs->filehashcount = (u32)(getle64(header->section[INDEX_FILEHASHTABLE].size) / 4);
+		romfs->fileblock = (u8*)ctx->data + getle64(header->section[INDEX_FILEMETA].offset);
+		romfs->fileblocksize = (u32)getle64(header->section[INDEX_FILEMETA].size);
+		romfs->infoblockoffset = (u32)(romfs->offset + 0x1000);
+		romfs->datablockoffset = (u32)getle64(header->datablockoffset);
+
+		return romfs_process_tree(romfs, actions);
+	}
+
+	return 1;
+}
+
+void index_free(index_context* ctx)
+{
+	mapfile_close(&ctx->map);
+	free(ctx->buffer);
+	if (ctx->file)
+		fclose(ctx->file);
+	ctx->file = NULL;
+	ctx->buffer = NULL;
+	ctx->data = NULL;
+	ctx->header = NULL;
+}
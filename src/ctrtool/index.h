@@ -0,0 +1,98 @@
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include "types.h"
+#include "settings.h"
+#include "reader.h"
+#include "exefs.h"
+#include "romfs.h"
+#include "ncch.h"
+
+#define MAGIC_INDEX 0x58444943 // "CIDX"
+#define INDEX_VERSION 2
+
+#define INDEX_FLAG_EXEFS	1
+#define INDEX_FLAG_ROMFS	2
+#define INDEX_FLAG_HASHES	4
+#define INDEX_FLAG_NCCH		8	// keys are derived from the NCCH header at ncchoffset
+
+#define INDEX_CHECK_SIZE	0x200	// raw bytes at the start of the RomFS region covered by imagecheck
+
+typedef enum
+{
+	INDEX_DIRHASHTABLE = 0,
+	INDEX_DIRMETA,
+	INDEX_FILEHASHTABLE,
+	INDEX_FILEMETA,
+	INDEX_FILEHASHES,
+	INDEX_SECTION_NUM
+} index_sectiontype;
+
+typedef struct
+{
+	u8 offset[8];
+	u8 size[8];
+} index_region;
+
+/*
+ * One record per file entry, sorted by the entry's offset in the file
+ * metadata block.
+ */
+typedef struct
+{
+	u8 entryoffset[4];
+	u8 hash[0x20];
+} index_filehash;
+
+/*
+ * All fields are little endian. Region offsets are absolute offsets into
+ * the indexed image, section offsets are relative to the start of the
+ * index. The four RomFS metadata sections are stored exactly as they
+ * appear in the RomFS info block. No key material is stored: keys are
+ * derived again from the NCCH header (keyY, crypto method and seed
+ * flag) and the keyset when the index is loaded.
+ */
+typedef struct
+{
+	u8 magic[4];
+	u8 version[4];
+	u8 headersize[4];
+	u8 flags[4];
+	u8 imagecheck[0x20];
+	u8 encrypted[4];
+	u8 exefscompressed[4];
+	u8 ncchoffset[8];
+	u8 exefscounter[16];
+	u8 romfscounter[16];
+	index_region exefs;
+	index_region romfs;
+	u8 datablockoffset[8];
+	romfs_infoheader infoheader;
+	index_region section[INDEX_SECTION_NUM];
+} index_header;
+
+typedef struct
+{
+	const reader_context* reader;
+	settings* usersettings;
+	FILE* file;
+	mapfile map;
+	u8* buffer;
+	const u8* data;
+	u64 size;
+	const index_header* header;
+	u8 key[2][16];
+	u32 encrypted;
+	exefs_context exefs;
+	romfs_context romfs;
+} index_context;
+
+void index_init(index_context* ctx);
+void index_set_reader(index_context* ctx, const reader_context* reader);
+void index_set_usersettings(index_context* ctx, settings* usersettings);
+int  index_write(const char* path, const ncch_context* ncch, romfs_context* romfs, exefs_context* exefs, int hashes, u32 threadcount);
+int  index_load(index_context* ctx, const char* path);
+int index_process(index_context* ctx, u32 actions);
+void index_free(index_context* ctx);
+
+#endif // _INDEX_H_
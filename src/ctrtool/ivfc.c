@@ -5,6 +5,8 @@
 #include "utils.h"
 #include "ivfc.h"
 #include "ctr.h"
+#include "worker.h"
+#include "cache.h"
 
 void ivfc_init(ivfc_context* ctx)
 {
@@ -26,9 +28,9 @@ void ivfc_set_size(ivfc_context* ctx, u64 size)
 	ctx->size = size;
 }
 
-void ivfc_set_file(ivfc_context* ctx, FILE* file)
+void ivfc_set_reader(ivfc_context* ctx, const reader_context* reader)
 {
-	ctx->file = file;
+	ctx->reader = reader;
 }
 
 void ivfc_set_encrypted(ivfc_context* ctx, u32 encrypted)
@@ -38,6 +40,7 @@ void ivfc_set_encrypted(ivfc_context* ctx, u32 encrypted)
 
 void ivfc_set_key(ivfc_context* ctx, u8 key[16])
 {
+	memcpy(ctx->key, key, 16);
 	ctr_init_key(&ctx->aes, key);
 }
 
@@ -49,7 +52,8 @@ void ivfc_set_counter(ivfc_context* ctx, u8 counter[16])
 void ivfc_fseek(ivfc_context* ctx, u64 offset)
 {
 	u64 data_pos = offset - ctx->offset;
-	fseeko64(ctx->file, offset, SEEK_SET);
+
+	ctx->position = offset;
 
 	if (ctx->encrypted) {
 		//printf("start fseek encrypted prep\n");
@@ -60,16 +64,37 @@ void ivfc_fseek(ivfc_context* ctx, u64 offset)
 	}
 }
 
+static void ivfc_cache_region(ivfc_context* ctx, cache_region* region)
+{
+	cache_region_init(region, ctx->reader, ctx->offset, ctx->size, CACHE_CRYPTO_CTR, ctx->key, ctx->counter);
+}
+
 size_t ivfc_fread(ivfc_context* ctx, void* buffer, size_t size, size_t count)
 {
 	size_t read;
-	if ((read = fread(buffer, size, count, ctx->file)) != count) {
-		//printf("ivfc_fread() fail\n");
-		return read;
+	const u8* src;
+	cache_region region;
+
+	// encrypted reads go through the shared cache, which also serves RomFS
+	if (ctx->encrypted)
+	{
+		ivfc_cache_region(ctx, &region);
+		if (!cache_read(&region, ctx->position - ctx->offset, buffer, (u64)size*count))
+			return 0;
+		ctx->position += size*count;
+		return count;
 	}
-	if (ctx->encrypted) {
-		ctr_crypt_counter(&ctx->aes, buffer, buffer, size*read);
+
+	src = reader_get(ctx->reader, ctx->position, (u64)size*count);
+	if (src)
+	{
+		memcpy(buffer, src, size*count);
+		ctx->position += size*count;
+		return count;
 	}
+
+	read = reader_read_at(ctx->reader, ctx->position, buffer, size*count) / size;
+	ctx->position += size*read;
 	return read;
 }
 
@@ -118,66 +143,443 @@ void ivfc_process(ivfc_context* ctx, u32 actions)
 
 }
 
-void ivfc_verify(ivfc_context* ctx, u32 flags)
+typedef struct
 {
-	u32 i, j;
-	u32 blockcount;
+	ivfc_context* ctx;
+	ivfc_level* level;
+	u32 jobblocks;
+	u64 blockcount;
+	u64* failblock;
+} ivfc_verify_job;
+
+/*
+ * Hash count blocks and compare them against the expected hashes. Returns
+ * the index of the first mismatching block, or count if all of them match.
+ */
+static u32 ivfc_check_blocks(const u8* buffer, const u8* hashes, u8* calchash, u32 count, u32 blocksize)
+{
+	u32 i;
 
-	for(i=0; i<ctx->levelcount; i++)
+	ctr_sha_256_many(buffer, count, blocksize, calchash);
+
+	if (memcmp(calchash, hashes, (size_t)count * 0x20) == 0)
+		return count;
+
+	for (i=0; i<count; i++)
 	{
-		ivfc_level* level = ctx->level + i;
+		if (memcmp(calchash + i * 0x20, hashes + i * 0x20, 0x20) != 0)
+			break;
+	}
 
-		level->hashcheck = Fail;
+	return i;
+}
+
+static int ivfc_check_level(ivfc_context* ctx, ivfc_level* level)
+{
+	u32 blocksize = level->hashblocksize;
+
+	if (blocksize < IVFC_MIN_BLOCKSIZE || blocksize > IVFC_VERIFY_WINDOW || level->datasize % blocksize != 0)
+	{
+		fprintf(stderr, "Error, IVFC block size mismatch\n");
+		return 0;
 	}
 
-	// Import IVFC level hashes
-	uint8_t *levelhash[IVFC_MAX_LEVEL] = { NULL };
+	if (level->dataoffset + level->datasize > ctx->size || level->hashoffset + level->datasize / blocksize * 0x20 > ctx->size)
+	{
+		fprintf(stderr, "Error, IVFC offset out of range (offset=0x%08"PRIx64", size=0x%08"PRIx64")\n", level->dataoffset, level->datasize);
+		return 0;
+	}
 
-	for (i=0; i<ctx->levelcount; i++)
+	return 1;
+}
+
+/*
+ * Positional read of a region relative to the IVFC start, decrypted with a
+ * private counter so it can run on any thread.
+ */
+static int ivfc_pread(ivfc_context* ctx, u64 offset, u8* buffer, u32 size)
+{
+	ctr_aes_context aes;
+	const u8* src = reader_get(ctx->reader, ctx->offset + offset, size);
+
+	if (src)
+	{
+		if (!ctx->encrypted)
+			memcpy(buffer, src, size);
+	}
+	else if (size != reader_read_at(ctx->reader, ctx->offset + offset, buffer, size))
 	{
-		blockcount = (u32)(ctx->level[i].datasize / ctx->level[i].hashblocksize);
-		u32 read_size = align(blockcount * 0x20, ctx->level[i].hashblocksize);
-		levelhash[i] = malloc(read_size);
-		ivfc_read(ctx, ctx->level[i].hashoffset, read_size, levelhash[i]);
+		return 0;
 	}
 
-	// Verify blocks
-	for (i=0; i<ctx->levelcount; i++)
+	if (ctx->encrypted)
 	{
-		blockcount = (u32) (ctx->level[i].datasize / ctx->level[i].hashblocksize);
-		if (ctx->level[i].datasize % ctx->level[i].hashblocksize != 0)
+		aes = ctx->aes;
+		ctr_init_counter(&aes, ctx->counter);
+		ctr_add_counter(&aes, (u32)(offset / 0x10));
+		ctr_crypt_counter(&aes, src? (u8*)src : buffer, buffer, size);
+	}
+
+	return 1;
+}
+
+/*
+ * Plain regions of a mapped image are checked where they lie, without
+ * copying them into a buffer first.
+ */
+static const u8* ivfc_map_plain(ivfc_context* ctx, u64 offset, u64 size)
+{
+	if (ctx->encrypted)
+		return NULL;
+
+	return reader_get(ctx->reader, ctx->offset + offset, size);
+}
+
+static void ivfc_verify_range(void* arg, u32 index)
+{
+	ivfc_verify_job* job = (ivfc_verify_job*) arg;
+	ivfc_level* level = job->level;
+	u32 blocksize = level->hashblocksize;
+	u64 first = (u64)index * job->jobblocks;
+	u32 count = job->jobblocks;
+	u32 bad;
+	const u8* data;
+	const u8* expected;
+	u8* buffer = NULL;
+	u8* hashes = NULL;
+	u8* calchash = malloc((size_t)count * 0x20);
+
+	if (count > job->blockcount - first)
+		count = (u32)(job->blockcount - first);
+
+	data = ivfc_map_plain(job->ctx, level->dataoffset + first * blocksize, (u64)count * blocksize);
+	expected = ivfc_map_plain(job->ctx, level->hashoffset + first * 0x20, (u64)count * 0x20);
+	if (data == NULL)
+		data = buffer = malloc((size_t)count * blocksize);
+	if (expected == NULL)
+		expected = hashes = malloc((size_t)count * 0x20);
+
+	if (data == NULL || expected == NULL || calchash == NULL)
+	{
+		fprintf(stderr, "Error, IVFC could not allocate memory\n");
+		job->failblock[index] = IVFC_NO_BLOCK - 1;
+		goto clean;
+	}
+
+	if ((hashes && !ivfc_pread(job->ctx, level->hashoffset + first * 0x20, hashes, count * 0x20)) ||
+		(buffer && !ivfc_pread(job->ctx, level->dataoffset + first * blocksize, buffer, count * blocksize)))
+	{
+		fprintf(stderr, "Error, IVFC could not read file\n");
+		job->failblock[index] = IVFC_NO_BLOCK - 1;
+		goto clean;
+	}
+
+	bad = ivfc_check_blocks(data, expected, calchash, count, blocksize);
+	if (bad != count)
+		job->failblock[index] = first + bad;
+
+clean:
+	free(buffer);
+	free(hashes);
+	free(calchash);
+}
+
+/*
+ * Verify one level on a worker pool. The level is split into fixed size
+ * block ranges, and every range is read with positional reads and checked
+ * independently. A failing range records its first bad block, so the
+ * lowest of those is the first bad block of the level.
+ */
+static int ivfc_verify_level_parallel(ivfc_context* ctx, ivfc_level* level, u32 threadcount)
+{
+	ivfc_verify_job job;
+	u32 jobcount;
+	u32 i;
+	u64 failblock = IVFC_NO_BLOCK;
+	int failed = 0;
+
+	if (!ivfc_check_level(ctx, level))
+		return Fail;
+
+	job.ctx = ctx;
+	job.level = level;
+	job.blockcount = level->datasize / level->hashblocksize;
+	job.jobblocks = IVFC_VERIFY_JOB_SIZE / level->hashblocksize;
+	if (job.jobblocks == 0)
+		job.jobblocks = 1;
+	jobcount = (u32)((job.blockcount + job.jobblocks - 1) / job.jobblocks);
+
+	job.failblock = malloc(jobcount * sizeof(u64));
+	if (job.failblock == NULL)
+	{
+		fprintf(stderr, "Error, IVFC could not allocate memory\n");
+		return Fail;
+	}
+
+	for (i=0; i<jobcount; i++)
+		job.failblock[i] = IVFC_NO_BLOCK;
+
+	worker_run(threadcount, jobcount, ivfc_verify_range, &job);
+
+	// read or allocation failures carry no block index, so a later range
+	// may still hold the first bad block
+	for (i=0; i<jobcount; i++)
+	{
+		if (job.failblock[i] == IVFC_NO_BLOCK)
+			continue;
+
+		failed = 1;
+		if (job.failblock[i] != IVFC_NO_BLOCK - 1)
 		{
-			fprintf(stderr, "Error, IVFC block size mismatch\n");
-			return;
+			failblock = job.failblock[i];
+			break;
 		}
+	}
+
+	free(job.failblock);
 
-		ctx->level[i].hashcheck = Good;
+	if (!failed)
+		return Good;
 
-		for (j=0; j<blockcount; j++)
+	if (failblock != IVFC_NO_BLOCK)
+		level->failblock = failblock;
+
+	return Fail;
+}
+
+/*
+ * Verify one level by streaming its data sequentially in large windows.
+ * The data of a level is decrypted with its own running counter, while the
+ * matching slice of the expected hashes is fetched separately for every
+ * window, so memory use stays bounded by IVFC_VERIFY_WINDOW.
+ */
+static int ivfc_verify_level(ivfc_context* ctx, ivfc_level* level, u8* buffer, u8* hashes, u8* calchash)
+{
+	ctr_aes_context stream;
+	u32 blocksize = level->hashblocksize;
+	u32 windowblocks;
+	u32 count;
+	u32 bad;
+	u64 blockcount;
+	u64 j;
+	const u8* src;
+	const u8* data;
+	cache_region region;
+	int cached;
+
+	if (!ivfc_check_level(ctx, level))
+		return Fail;
+
+	// a level that fits in the block cache is read through it, so later
+	// verify-on-read and metadata reads of the same range skip the AES
+	cached = ctx->encrypted && level->datasize <= cache_get_budget() / 2;
+	ivfc_cache_region(ctx, &region);
+
+	src = cached? NULL : reader_get(ctx->reader, ctx->offset + level->dataoffset, level->datasize);
+	reader_advise(ctx->reader, ctx->offset + level->dataoffset, level->datasize, MAPFILE_SEQUENTIAL);
+
+	blockcount = level->datasize / blocksize;
+	windowblocks = IVFC_VERIFY_WINDOW / blocksize;
+
+	stream = ctx->aes;
+	ctr_init_counter(&stream, ctx->counter);
+	ctr_add_counter(&stream, (u32)(level->dataoffset / 0x10));
+
+	for (j=0; j<blockcount; j+=count)
+	{
+		count = windowblocks;
+		if (count > blockcount - j)
+			count = (u32)(blockcount - j);
+
+		ivfc_read(ctx, level->hashoffset + j * 0x20, (u64)count * 0x20, hashes);
+
+		data = buffer;
+		if (src)
+		{
+			if (ctx->encrypted)
+				ctr_crypt_counter(&stream, (u8*)src + j * blocksize, buffer, count * blocksize);
+			else
+				data = src + j * blocksize;
+		}
+		else if (cached)
 		{
-			u8 calchash[32];
-			
-			// a hash level
-			if (i < 2) {
-				ctr_sha_256(levelhash[i+1] + ctx->level[i].hashblocksize * j, ctx->level[i].hashblocksize, calchash);
+			if (!cache_read(&region, level->dataoffset + j * blocksize, buffer, (u64)count * blocksize))
+			{
+				fprintf(stderr, "Error, IVFC could not read file\n");
+				return Fail;
 			}
-			// a data level
-			else {
-				ivfc_read(ctx, ctx->level[i].dataoffset + j * ctx->level[i].hashblocksize, ctx->level[i].hashblocksize, ctx->buffer);
-				ctr_sha_256(ctx->buffer, (u32)ctx->level[i].hashblocksize, calchash);
+		}
+		else
+		{
+			if (count * blocksize != reader_read_at(ctx->reader, ctx->offset + level->dataoffset + j * blocksize, buffer, count * blocksize))
+			{
+				fprintf(stderr, "Error, IVFC could not read file\n");
+				return Fail;
 			}
 
-			if (memcmp(calchash, levelhash[i] + 0x20 * j, 0x20) != 0) {
-				ctx->level[i].hashcheck = Fail;
-			}
-				
+			if (ctx->encrypted)
+				ctr_crypt_counter(&stream, buffer, buffer, count * blocksize);
 		}
+
+		bad = ivfc_check_blocks(data, hashes, calchash, count, blocksize);
+		if (bad != count)
+		{
+			level->failblock = j + bad;
+			return Fail;
+		}
+	}
+
+	return Good;
+}
+
+void ivfc_verify(ivfc_context* ctx, u32 flags)
+{
+	u32 i;
+	u32 hashsize = IVFC_VERIFY_WINDOW / IVFC_MIN_BLOCKSIZE * 0x20;
+	u8* buffer = NULL;
+	u8* hashes = NULL;
+	u8* calchash = NULL;
+	u32 threadcount = settings_get_thread_count(ctx->usersettings);
+
+	for(i=0; i<ctx->levelcount; i++)
+	{
+		ivfc_level* level = ctx->level + i;
+
+		level->hashcheck = Fail;
+		level->failblock = IVFC_NO_BLOCK;
 	}
 
-	// Free level hashes
-	for (int i = 0; i < 3; i++) {
-		free(levelhash[i]);
+	buffer = malloc(IVFC_VERIFY_WINDOW);
+	hashes = malloc(hashsize);
+	calchash = malloc(hashsize);
+	if (buffer == NULL || hashes == NULL || calchash == NULL)
+	{
+		fprintf(stderr, "Error, IVFC could not allocate memory\n");
+		goto clean;
 	}
+
+	for (i=0; i<ctx->levelcount; i++)
+	{
+		ivfc_level* level = ctx->level + i;
+
+		if (threadcount > 1 && level->datasize > IVFC_VERIFY_JOB_SIZE)
+			level->hashcheck = ivfc_verify_level_parallel(ctx, level, threadcount);
+		else
+			level->hashcheck = ivfc_verify_level(ctx, level, buffer, hashes, calchash);
+	}
+
+clean:
+	free(buffer);
+	free(hashes);
+	free(calchash);
+}
+
+/*
+ * Prepare on-demand verification of data level blocks. The level 0 data
+ * (the hashes of the level 1 blocks) is small, so it is read and checked
+ * against the master hash up front. Level 1 blocks are only read, checked
+ * and kept once a data block that depends on them is requested.
+ */
+int ivfc_verifyread_init(ivfc_context* ctx)
+{
+	ivfc_level* level0 = ctx->level + 0;
+	ivfc_level* level1 = ctx->level + 1;
+	u8 masterhash[0x20];
+	u64 blockcount0;
+	u64 blockcount1;
+	u64 i;
+
+	if (ctx->levelcount != 3)
+		return 0;
+
+	if (level0->hashblocksize < IVFC_MIN_BLOCKSIZE || level1->hashblocksize < IVFC_MIN_BLOCKSIZE ||
+		level0->datasize % level0->hashblocksize != 0 || level1->datasize % level1->hashblocksize != 0)
+	{
+		fprintf(stderr, "Error, IVFC block size mismatch\n");
+		return 0;
+	}
+
+	blockcount0 = level0->datasize / level0->hashblocksize;
+	blockcount1 = level1->datasize / level1->hashblocksize;
+
+	if (blockcount0 * 0x20 > getle32(ctx->header.masterhashsize))
+	{
+		fprintf(stderr, "Error, IVFC master hash too small\n");
+		return 0;
+	}
+
+	ctx->masterlevel = malloc(level0->datasize);
+	ctx->masterstate = calloc(1, blockcount0);
+	ctx->hashlevel = malloc(level1->datasize);
+	ctx->hashstate = calloc(1, blockcount1);
+	if (!ctx->masterlevel || !ctx->masterstate || !ctx->hashlevel || !ctx->hashstate)
+	{
+		fprintf(stderr, "Error, IVFC could not allocate memory\n");
+		ivfc_verifyread_free(ctx);
+		return 0;
+	}
+
+	ivfc_read(ctx, level0->dataoffset, level0->datasize, ctx->masterlevel);
+
+	for(i=0; i<blockcount0; i++)
+	{
+		ivfc_read(ctx, level0->hashoffset + i * 0x20, 0x20, masterhash);
+		if (ctr_sha_256_verify(ctx->masterlevel + i * level0->hashblocksize, level0->hashblocksize, masterhash) == Good)
+			ctx->masterstate[i] = Good;
+		else
+			ctx->masterstate[i] = Fail;
+	}
+
+	return 1;
+}
+
+/*
+ * Check one decrypted data level block, given by its index in the data
+ * level. Returns Good or Fail.
+ */
+int ivfc_verifyread_block(ivfc_context* ctx, u64 blockindex, const u8* data)
+{
+	ivfc_level* level0 = ctx->level + 0;
+	ivfc_level* level1 = ctx->level + 1;
+	ivfc_level* level2 = ctx->level + 2;
+	u64 hashblock = blockindex * 0x20 / level1->hashblocksize;
+	u64 masterblock = hashblock * 0x20 / level0->hashblocksize;
+	u8* hashdata;
+
+	if (ctx->hashstate == NULL || (blockindex + 1) * level2->hashblocksize > level2->datasize ||
+		(blockindex + 1) * 0x20 > level1->datasize || (hashblock + 1) * 0x20 > level0->datasize)
+		return Fail;
+
+	hashdata = ctx->hashlevel + hashblock * level1->hashblocksize;
+
+	if (ctx->hashstate[hashblock] == Unchecked)
+	{
+		ivfc_read(ctx, level1->dataoffset + hashblock * level1->hashblocksize, level1->hashblocksize, hashdata);
+
+		if (ctx->masterstate[masterblock] == Good &&
+			ctr_sha_256_verify(hashdata, level1->hashblocksize, ctx->masterlevel + hashblock * 0x20) == Good)
+			ctx->hashstate[hashblock] = Good;
+		else
+			ctx->hashstate[hashblock] = Fail;
+	}
+
+	if (ctx->hashstate[hashblock] != Good)
+		return Fail;
+
+	return ctr_sha_256_verify(data, level2->hashblocksize, ctx->hashlevel + blockindex * 0x20);
+}
+
+void ivfc_verifyread_free(ivfc_context* ctx)
+{
+	free(ctx->masterlevel);
+	free(ctx->masterstate);
+	free(ctx->hashlevel);
+	free(ctx->hashstate);
+
+	ctx->masterlevel = NULL;
+	ctx->masterstate = NULL;
+	ctx->hashlevel = NULL;
+	ctx->hashstate = NULL;
 }
 
 void ivfc_read(ivfc_context* ctx, u64 offset, u64 size, u8* buffer)
@@ -228,6 +630,8 @@ void ivfc_print(ivfc_context* ctx)
 			fprintf(stdout, "Level %d:               \n", i);
 		else
 			fprintf(stdout, "Level %d (%s):          \n", i, level->hashcheck == Good? "GOOD" : "FAIL");
+		if (level->hashcheck == Fail && level->failblock != IVFC_NO_BLOCK)
+			fprintf(stdout, " First bad block:       0x%08"PRIx64"\n", level->failblock);
 		fprintf(stdout, " Data offset:           0x%08"PRIx64"\n", ctx->offset + level->dataoffset);
 		fprintf(stdout, " Data size:             0x%08"PRIx64"\n", level->datasize);
 		fprintf(stdout, " Hash offset:           0x%08"PRIx64"\n", ctx->offset + level->hashoffset);
@@ -4,10 +4,15 @@
 #include "types.h"
 #include "ctr.h"
 #include "settings.h"
+#include "reader.h"
 
 #define IVFC_HEADER_SIZE 0x60
 #define IVFC_MAX_LEVEL 4
 #define IVFC_MAX_BUFFERSIZE 0x4000
+#define IVFC_VERIFY_WINDOW (4 * 1024 * 1024)
+#define IVFC_MIN_BLOCKSIZE 0x40
+#define IVFC_VERIFY_JOB_SIZE (1024 * 1024)
+#define IVFC_NO_BLOCK (~(u64)0)
 
 typedef struct
 {
@@ -24,6 +29,7 @@ typedef struct
 	u64 hashoffset;
 	u32 hashblocksize;
 	int hashcheck;
+	u64 failblock;
 } ivfc_level;
 
 typedef struct
@@ -40,11 +46,13 @@ typedef struct
 
 typedef struct
 {
-	FILE* file;
+	const reader_context* reader;
+	u64 position;
 	u64 offset;
 	u64 size;
 	settings* usersettings;
 	u8 counter[16];
+	u8 key[16];
 	ctr_aes_context aes;
 	int encrypted;
 
@@ -55,13 +63,19 @@ typedef struct
 	u64 bodyoffset;
 	u64 bodysize;
 	u8 buffer[IVFC_MAX_BUFFERSIZE];
+
+	// verify-on-read state, see ivfc_verifyread_init
+	u8* masterlevel;
+	u8* masterstate;
+	u8* hashlevel;
+	u8* hashstate;
 } ivfc_context;
 
 void ivfc_init(ivfc_context* ctx);
 void ivfc_process(ivfc_context* ctx, u32 actions);
 void ivfc_set_offset(ivfc_context* ctx, u64 offset);
 void ivfc_set_size(ivfc_context* ctx, u64 size);
-void ivfc_set_file(ivfc_context* ctx, FILE* file);
+void ivfc_set_reader(ivfc_context* ctx, const reader_context* reader);
 void ivfc_set_usersettings(ivfc_context* ctx, settings* usersettings);
 void ivfc_set_encrypted(ivfc_context* ctx, u32 encrypted);
 void ivfc_set_key(ivfc_context* ctx, u8 key[16]);
@@ -72,6 +86,10 @@ size_t ivfc_fread(ivfc_context* ctx, void* buffer, size_t size, size_t count);
 void ivfc_verify(ivfc_context* ctx, u32 flags);
 void ivfc_print(ivfc_context* ctx);
 
+int ivfc_verifyread_init(ivfc_context* ctx);
+int ivfc_verifyread_block(ivfc_context* ctx, u64 blockindex, const u8* data);
+void ivfc_verifyread_free(ivfc_context* ctx);
+
 void ivfc_read(ivfc_context* ctx, u64 offset, u64 size, u8* buffer);
 void ivfc_hash(ivfc_context* ctx, u64 offset, u64 size, u8* hash);
 
@@ -34,15 +34,12 @@ void lzss_set_file(lzss_context* ctx, FILE* file)
 void lzss_process(lzss_context* ctx, u32 actions)
 {
 	unsigned int compressedsize;
-	unsigned char* compressedbuffer = 0;
+	unsigned char footer[LZSS_FOOTER_SIZE];
 	unsigned int decompressedsize;
 	unsigned char* decompressedbuffer = 0;
 	FILE* fout = 0;
 
 
-	fseeko64(ctx->file, ctx->offset, SEEK_SET);
-	
-
 	if (actions & ExtractFlag)
 	{
 		
@@ -57,27 +54,48 @@ void lzss_process(lzss_context* ctx, u32 actions)
 			fprintf(stdout, "Error opening out file %s\n", path->pathname);
 			goto clean;
 		}
+
+		// only the footer is needed to size the buffer the blob is decompressed in
 		compressedsize = ctx->size;
-		compressedbuffer = malloc(compressedsize);
-		if (1 != fread(compressedbuffer, compressedsize, 1, ctx->file))
+		if (compressedsize < LZSS_FOOTER_SIZE)
 		{
 			fprintf(stdout, "Error read input file\n");
 			goto clean;
 		}
 
-		decompressedsize = lzss_get_decompressed_size(compressedbuffer, compressedsize);
-		decompressedbuffer = malloc(decompressedsize);
+		fseeko64(ctx->file, ctx->offset + compressedsize - LZSS_FOOTER_SIZE, SEEK_SET);
+		if (1 != fread(footer, LZSS_FOOTER_SIZE, 1, ctx->file))
+		{
+			fprintf(stdout, "Error read input file\n");
+			goto clean;
+		}
+
+		decompressedsize = lzss_get_footer_decompressed_size(footer, compressedsize);
 
 		printf("Compressed: %d\n", compressedsize);
 		printf("Decompressed: %d\n", decompressedsize);
-		
+
+		if (decompressedsize < compressedsize)
+		{
+			fprintf(stderr, "Error, compression out of bounds\n");
+			goto clean;
+		}
+
+		decompressedbuffer = malloc(decompressedsize);
 		if (decompressedbuffer == 0)
 		{
 			fprintf(stdout, "Error allocating memory\n");
 			goto clean;
 		}
 
-		if (0 == lzss_decompress(compressedbuffer, compressedsize, decompressedbuffer, decompressedsize))
+		fseeko64(ctx->file, ctx->offset, SEEK_SET);
+		if (1 != fread(decompressedbuffer, compressedsize, 1, ctx->file))
+		{
+			fprintf(stdout, "Error read input file\n");
+			goto clean;
+		}
+
+		if (0 == lzss_decompress_inplace(decompressedbuffer, compressedsize, decompressedsize))
 			goto clean;
 
 		printf("Saving decompressed lzss blob to %s...\n", path->pathname);
@@ -90,7 +108,6 @@ void lzss_process(lzss_context* ctx, u32 actions)
 
 clean:
 	free(decompressedbuffer);
-	free(compressedbuffer);
 	if (fout)
 		fclose(fout);
 }
@@ -98,54 +115,158 @@ clean:
 
 u32 lzss_get_decompressed_size(u8* compressed, u32 compressedsize)
 {
-	u8* footer = compressed + compressedsize - 8;
+	return lzss_get_footer_decompressed_size(compressed + compressedsize - LZSS_FOOTER_SIZE, compressedsize);
+}
 
+/*
+ * The decompressed size only needs the footer, so a buffer for in-place
+ * decompression can be sized before the section is read. Returns 0 for
+ * a size that does not fit in 32 bits.
+ */
+u32 lzss_get_footer_decompressed_size(const u8* footer, u32 compressedsize)
+{
 	//u32 buffertopandbottom = getle32(footer+0);
 	u32 originalbottom = getle32(footer+4);
 
+	if (originalbottom > 0xFFFFFFFF - compressedsize)
+		return 0;
+
 	return originalbottom + compressedsize;
 }
 
-int lzss_decompress(u8* compressed, u32 compressedsize, u8* decompressed, u32 decompressedsize)
+/*
+ * Copy a match of size bytes (3..18) that ends at dst + size from
+ * distance bytes above it. Sources and destinations are disjoint when
+ * distance >= size, so the match is moved with whole 4/8-byte loads
+ * (head, middle and tail may overlap each other, never the source).
+ * Otherwise the match repeats a pattern of distance bytes, which is
+ * replicated downwards one pattern at a time.
+ */
+static void lzss_copy_match(u8* dst, u32 size, u32 distance)
+{
+	const u8* src = dst + distance;
+	u64 head, middle, tail;
+	u32 head4, tail4;
+	u32 count;
+
+	if (distance >= size)
+	{
+		if (size >= 8)
+		{
+			memcpy(&head, src, 8);
+			memcpy(&tail, src + size - 8, 8);
+			if (size > 16)
+			{
+				memcpy(&middle, src + 8, 8);
+				memcpy(dst + 8, &middle, 8);
+			}
+			memcpy(dst, &head, 8);
+			memcpy(dst + size - 8, &tail, 8);
+		}
+		else if (size >= 4)
+		{
+			memcpy(&head4, src, 4);
+			memcpy(&tail4, src + size - 4, 4);
+			memcpy(dst, &head4, 4);
+			memcpy(dst + size - 4, &tail4, 4);
+		}
+		else
+		{
+			dst[2] = src[2];
+			dst[1] = src[1];
+			dst[0] = src[0];
+		}
+		return;
+	}
+
+	while(size)
+	{
+		count = size < distance? size : distance;
+		size -= count;
+		memcpy(dst + size, dst + size + distance, count);
+	}
+}
+
+/*
+ * The stream is decoded backwards from the footer: each control byte
+ * holds 8 flags, MSB first, for a literal (0) or a 2-byte match (1).
+ * Every token is bounds checked once, and a control byte of 8 literals
+ * is copied as one 8-byte move.
+ *
+ * decompressed must start with the compressed data. compressed may
+ * point at that same copy, as the output is written from the top down
+ * and never overtakes the input in a well formed stream; a stream that
+ * would is rejected.
+ */
+static int lzss_decode(const u8* compressed, u32 compressedsize, u8* decompressed, u32 decompressedsize)
 {
-	u8* footer = compressed + compressedsize - 8;
-	u32 buffertopandbottom = getle32(footer+0);
-	//u32 originalbottom = getle32(footer+4);
-	u32 i, j;
+	const u8* footer;
+	u32 buffertopandbottom;
+	u32 i;
 	u32 out = decompressedsize;
-	u32 index = compressedsize - ((buffertopandbottom>>24)&0xFF);
+	u32 index;
 	u32 segmentoffset;
 	u32 segmentsize;
 	u8 control;
-	u32 stopindex = compressedsize - (buffertopandbottom&0xFFFFFF);
+	u32 stopindex;
+	int inplace = (compressed == decompressed);
 
-	memset(decompressed, 0, decompressedsize);
-	memcpy(decompressed, compressed, compressedsize);
+	if (compressedsize < LZSS_FOOTER_SIZE || decompressedsize < compressedsize)
+		goto outofbounds;
+
+	footer = compressed + compressedsize - LZSS_FOOTER_SIZE;
+	buffertopandbottom = getle32(footer+0);
+	if (((buffertopandbottom>>24)&0xFF) > compressedsize || (buffertopandbottom&0xFFFFFF) > compressedsize)
+		goto outofbounds;
+
+	index = compressedsize - ((buffertopandbottom>>24)&0xFF);
+	stopindex = compressedsize - (buffertopandbottom&0xFFFFFF);
+
+	memset(decompressed + compressedsize, 0, decompressedsize - compressedsize);
 
-	
 	while(index > stopindex)
 	{
 		control = compressed[--index];
-		
 
-		for(i=0; i<8; i++)
+		if (control == 0 && index >= stopindex + 8 && out >= 8 && out >= index)
 		{
-			if (index <= stopindex)
-				break;
+			index -= 8;
+			out -= 8;
+			memmove(decompressed + out, compressed + index, 8);
+			continue;
+		}
 
-			if (index <= 0)
-				break;
+		// 8 tokens consume at most 16 input and 8*18 output bytes, and a
+		// match reaches at most 0x1001 bytes above out
+		if (index >= stopindex + 16 && out >= index + 8 * 18 && decompressedsize - out > 0x1001)
+		{
+			for(i=0; i<8; i++, control <<= 1)
+			{
+				if (control & 0x80)
+				{
+					index -= 2;
+					segmentoffset = compressed[index] | (compressed[index+1]<<8);
+					segmentsize = ((segmentoffset >> 12)&15)+3;
+					out -= segmentsize;
+					lzss_copy_match(decompressed + out, segmentsize, (segmentoffset & 0x0FFF) + 3);
+				}
+				else
+				{
+					decompressed[--out] = compressed[--index];
+				}
+			}
+			continue;
+		}
 
-			if (out <= 0)
+		for(i=0; i<8; i++)
+		{
+			if (index <= stopindex || out == 0)
 				break;
 
 			if (control & 0x80)
 			{
 				if (index < 2)
-				{
-					fprintf(stderr, "Error, compression out of bounds\n");
-					goto clean;
-				}
+					goto outofbounds;
 
 				index -= 2;
 
@@ -154,34 +275,19 @@ int lzss_decompress(u8* compressed, u32 compressedsize, u8* decompressed, u32 de
 				segmentoffset &= 0x0FFF;
 				segmentoffset += 2;
 
-				
-				if (out < segmentsize)
-				{
-					fprintf(stderr, "Error, compression out of bounds\n");
-					goto clean;
-				}
+				// the match reads decompressed[out+segmentoffset] downwards
+				if (out < segmentsize || segmentoffset >= decompressedsize - out)
+					goto outofbounds;
+				if (inplace && out - segmentsize < index)
+					goto outofbounds;
 
-				for(j=0; j<segmentsize; j++)
-				{
-					u8 data;
-					
-					if (out+segmentoffset >= decompressedsize)
-					{
-						fprintf(stderr, "Error, compression out of bounds\n");
-						goto clean;
-					}
-
-					data  = decompressed[out+segmentoffset];
-					decompressed[--out] = data;
-				}
+				out -= segmentsize;
+				lzss_copy_match(decompressed + out, segmentsize, segmentoffset + 1);
 			}
 			else
 			{
-				if (out < 1)
-				{
-					fprintf(stderr, "Error, compression out of bounds\n");
-					goto clean;
-				}
+				if (inplace && out < index)
+					goto outofbounds;
 				decompressed[--out] = compressed[--index];
 			}
 
@@ -190,6 +296,31 @@ int lzss_decompress(u8* compressed, u32 compressedsize, u8* decompressed, u32 de
 	}
 
 	return 1;
-clean:
+
+outofbounds:
+	fprintf(stderr, "Error, compression out of bounds\n");
 	return 0;
 }
+
+int lzss_decompress(u8* compressed, u32 compressedsize, u8* decompressed, u32 decompressedsize)
+{
+	if (decompressedsize < compressedsize)
+	{
+		fprintf(stderr, "Error, compression out of bounds\n");
+		return 0;
+	}
+
+	memcpy(decompressed, compressed, compressedsize);
+	return lzss_decode(compressed, compressedsize, decompressed, decompressedsize);
+}
+
+/*
+ * Decompress in a single buffer of decompressedsize bytes whose first
+ * compressedsize bytes hold the compressed data. The data has to sit at
+ * the head, not the tail: the bottom of the stream is stored raw and is
+ * already where it belongs in the output.
+ */
+int lzss_decompress_inplace(u8* buffer, u32 compressedsize, u32 decompressedsize)
+{
+	return lzss_decode(buffer, compressedsize, buffer, decompressedsize);
+}
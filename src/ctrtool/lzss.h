@@ -4,6 +4,8 @@
 #include "types.h"
 #include "settings.h"
 
+#define LZSS_FOOTER_SIZE	8
+
 typedef struct
 {
 	FILE* file;
@@ -20,7 +22,9 @@ void lzss_set_file(lzss_context* ctx, FILE* file);
 void lzss_set_usersettings(lzss_context* ctx, settings* usersettings);
 
 u32 lzss_get_decompressed_size(u8* compressed, u32 compressedsize);
+u32 lzss_get_footer_decompressed_size(const u8* footer, u32 compressedsize);
 int lzss_decompress(u8* compressed, u32 compressedsize, u8* decompressed, u32 decompressedsize);
+int lzss_decompress_inplace(u8* buffer, u32 compressedsize, u32 decompressedsize);
 
 
 #endif // _LZSS_H_
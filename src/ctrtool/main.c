@@ -17,6 +17,10 @@
 #include "firm.h"
 #include "cwav.h"
 #include "romfs.h"
+#include "index.h"
+#include "mount.h"
+#include "cache.h"
+#include "thumbnail.h"
 
 enum cryptotype
 {
@@ -32,6 +36,8 @@ typedef struct
 	u32 filetype;
 	FILE* infile;
 	u64 infilesize;
+	mapfile inmap;
+	reader_context inreader;
 	settings usersettings;
 } toolcontext;
 
@@ -62,6 +68,10 @@ static void usage(const char *argv0)
 		   "  --seed=key         Set specific seed for ncch seed crypto.\n"
 		   "  --showkeys         Show the keys being used.\n"
 		   "  --showsyscalls     Show system call names instead of numbers.\n"
+		   "  --threads=count    Number of threads for decryption, hashing and batch thumbnails\n"
+		   "                     (default: CPU count). RomFS files are only extracted in\n"
+		   "                     parallel when this is given.\n"
+		   "  --cache-size=MiB   Memory for decrypted blocks that are read more than once (default: 16, 0 disables).\n"
 		   "  -t, --intype=type	 Specify input file type [ncsd, ncch, exheader, cia, tmd, lzss,\n"
 		   "                        firm, cwav, exefs, romfs]\n"
 		   "LZSS options:\n"
@@ -75,7 +85,24 @@ static void usage(const char *argv0)
 		   "  --exefsdir=dir     Specify ExeFS directory path.\n"
 		   "  --romfs=file       Specify RomFS file path.\n"
 		   "  --romfsdir=dir     Specify RomFS directory path.\n"
+		   "  --exefs-tar=file   Write ExeFS sections to a tar archive (- for stdout).\n"
+		   "  --romfs-tar=file   Write RomFS files to a tar archive (- for stdout).\n"
 		   "  --listromfs        List files in RomFS.\n" 
+		   "  --romfs-include=glob  Only extract RomFS files matching glob (repeatable).\n"
+		   "  --romfs-exclude=glob  Do not extract RomFS files matching glob (repeatable).\n"
+		   "                     '*' and '?' stay within a path component, '**' spans directories.\n"
+		   "                     Globs without a leading '/' match at any depth.\n"
+		   "  --verifyread       Check RomFS data against the IVFC hash tree while extracting.\n"
+		   "  --romfs-file=path  Extract a single file from RomFS by its path.\n"
+		   "  --romfs-out=file   Specify output file for --romfs-file (default: stdout).\n"
+		   "  --write-index=file Write an index of the ExeFS/RomFS layout and keys to file.\n"
+		   "  --index-hashes     Include SHA-256 hashes of all RomFS files in the index.\n"
+		   "  --index=file       Use an index written by --write-index instead of parsing the input.\n"
+		   "  --mount=dir        Mount ExeFS/RomFS (or CIA contents) read-only at dir (FUSE builds).\n"
+		   "  --thumbnail=file   Write the icon as a PNG thumbnail (- for stdout).\n"
+		   "  --size=pixels      Thumbnail width and height (default: 128).\n"
+		   "  --thumbnail-dir=dir  Thumbnail every NCSD/NCCH/CIA file below dir into the freedesktop\n"
+		   "                     thumbnail cache (normal and large), skipping current ones.\n"
 		   "CIA options:\n"
 		   "  --certs=file       Specify Certificate chain file path.\n"
 		   "  --tik=file         Specify Ticket file path.\n"
@@ -106,6 +133,7 @@ int main(int argc, char* argv[])
 	char keysetfname[512] = "keys.xml";
 	keyset tmpkeys;
 	unsigned int checkkeysetfile = 0;
+	int exitcode = 0;
 
 	memset(&ctx, 0, sizeof(toolcontext));
 	ctx.actions = InfoFlag | ExtractFlag;
@@ -159,6 +187,22 @@ int main(int argc, char* argv[])
 			//{"ncchkeyxninesix", 1, NULL, 27},
 			{"seeddb", 1, NULL, 28},
 			{"seed", 1, NULL, 29 },
+			{"threads", 1, NULL, 30},
+			{"verifyread", 0, NULL, 31},
+			{"romfs-file", 1, NULL, 32},
+			{"romfs-out", 1, NULL, 33},
+			{"write-index", 1, NULL, 34},
+			{"index", 1, NULL, 35},
+			{"index-hashes", 0, NULL, 36},
+			{"mount", 1, NULL, 37},
+			{"cache-size", 1, NULL, 38},
+			{"romfs-include", 1, NULL, 39},
+			{"romfs-exclude", 1, NULL, 40},
+			{"romfs-tar", 1, NULL, 41},
+			{"exefs-tar", 1, NULL, 42},
+			{"thumbnail", 1, NULL, 43},
+			{"size", 1, NULL, 44},
+			{"thumbnail-dir", 1, NULL, 45},
 			{NULL},
 		};
 
@@ -258,6 +302,28 @@ int main(int argc, char* argv[])
 			//case 27: keyset_parse_ncchkeyX_ninesix(&tmpkeys, optarg, strlen(optarg)); break;
 			case 28: keyset_parse_seeddb(&tmpkeys, optarg); break;
 			case 29: keyset_parse_seed_fallback(&tmpkeys, optarg, strlen(optarg)); break;
+			case 30: settings_set_thread_count(&ctx.usersettings, strtoul(optarg, 0, 0)); break;
+			case 31: settings_set_verify_read(&ctx.usersettings, 1); break;
+			case 32: settings_set_romfs_file_path(&ctx.usersettings, optarg); break;
+			case 33: settings_set_romfs_out_path(&ctx.usersettings, optarg); break;
+			case 34: settings_set_write_index_path(&ctx.usersettings, optarg); break;
+			case 35: settings_set_index_path(&ctx.usersettings, optarg); break;
+			case 36: settings_set_index_hashes(&ctx.usersettings, 1); break;
+			case 37: settings_set_mount_path(&ctx.usersettings, optarg); break;
+			case 38: cache_set_budget((u64)strtoul(optarg, 0, 0) * 1024 * 1024); break;
+			case 39:
+			case 40:
+				if (!settings_add_romfs_filter(&ctx.usersettings, optarg, c == 40))
+				{
+					fprintf(stderr, "Error, too many RomFS filters (at most %d)\n", SETTINGS_MAX_ROMFS_FILTERS);
+					return -1;
+				}
+			break;
+			case 41: settings_set_romfs_tar_path(&ctx.usersettings, optarg); break;
+			case 42: settings_set_exefs_tar_path(&ctx.usersettings, optarg); break;
+			case 43: settings_set_thumbnail_path(&ctx.usersettings, optarg); break;
+			case 44: settings_set_thumbnail_size(&ctx.usersettings, strtoul(optarg, 0, 0)); break;
+			case 45: settings_set_thumbnail_dir_path(&ctx.usersettings, optarg); break;
 
 			default:
 				usage(argv[0]);
@@ -275,12 +341,37 @@ int main(int argc, char* argv[])
 		usage(argv[0]);
 	}
 
+	if (settings_get_romfs_tar_path(&ctx.usersettings)->valid && settings_get_exefs_tar_path(&ctx.usersettings)->valid &&
+		strcmp(settings_get_romfs_tar_path(&ctx.usersettings)->pathname, settings_get_exefs_tar_path(&ctx.usersettings)->pathname) == 0)
+	{
+		fprintf(stderr, "Error, --exefs-tar and --romfs-tar need different outputs\n");
+		return -1;
+	}
+
+	// keep stdout clean when a RomFS file or an archive is streamed to it
+	if ((settings_get_romfs_file_path(&ctx.usersettings)->valid && !settings_get_romfs_out_path(&ctx.usersettings)->valid) ||
+		(settings_get_romfs_tar_path(&ctx.usersettings)->valid && strcmp(settings_get_romfs_tar_path(&ctx.usersettings)->pathname, "-") == 0) ||
+		(settings_get_exefs_tar_path(&ctx.usersettings)->valid && strcmp(settings_get_exefs_tar_path(&ctx.usersettings)->pathname, "-") == 0) ||
+		(settings_get_thumbnail_path(&ctx.usersettings)->valid && strcmp(settings_get_thumbnail_path(&ctx.usersettings)->pathname, "-") == 0))
+	{
+		ctx.actions &= ~InfoFlag;
+		settings_set_stdout_data(&ctx.usersettings, 1);
+	}
+
 	keyset_init(&ctx.usersettings.keys, ctx.actions);
 	keyset_load(&ctx.usersettings.keys, keysetfname, (ctx.actions & VerboseFlag) | checkkeysetfile);
 	keyset_merge(&ctx.usersettings.keys, &tmpkeys);
 	if (ctx.actions & ShowKeysFlag)
 		keyset_dump(&ctx.usersettings.keys);
 
+	// batch thumbnailing walks a directory instead of reading one input file
+	if (settings_get_thumbnail_dir_path(&ctx.usersettings)->valid)
+	{
+		if (!thumbnail_batch_run(settings_get_thumbnail_dir_path(&ctx.usersettings)->pathname, &ctx.usersettings, ctx.actions))
+			exitcode = 1;
+		goto clean;
+	}
+
 	ctx.infilesize = _fsize(infname);
 	ctx.infile = fopen(infname, "rb");
 
@@ -290,6 +381,27 @@ int main(int argc, char* argv[])
 		return -1;
 	}
 
+	// fall back to positional reads if the input cannot be mapped
+	if (mapfile_open(&ctx.inmap, ctx.infile, ctx.infilesize))
+		reader_init(&ctx.inreader, ctx.infile, &ctx.inmap);
+	else
+		reader_init(&ctx.inreader, ctx.infile, NULL);
+
+	// an index replaces all parsing of the input
+	if (settings_get_index_path(&ctx.usersettings)->valid)
+	{
+		index_context indexctx;
+
+		index_init(&indexctx);
+		index_set_reader(&indexctx, &ctx.inreader);
+		index_set_usersettings(&indexctx, &ctx.usersettings);
+		if (!index_load(&indexctx, settings_get_index_path(&ctx.usersettings)->pathname) ||
+			!index_process(&indexctx, ctx.actions))
+			exitcode = 1;
+		index_free(&indexctx);
+		goto clean;
+	}
+
 	if (ctx.filetype == FILETYPE_UNKNOWN)
 	{
 		fseeko64(ctx.infile, 0x100, SEEK_SET);
@@ -341,6 +453,21 @@ int main(int argc, char* argv[])
 		exit(1);
 	}
 
+	// only the headers and the icon are read, nothing else is processed
+	if (settings_get_thumbnail_path(&ctx.usersettings)->valid)
+	{
+		if (!thumbnail_run(&ctx.inreader, ctx.filetype, ncchindex, &ctx.usersettings, ctx.actions,
+						   settings_get_thumbnail_path(&ctx.usersettings)->pathname, settings_get_thumbnail_size(&ctx.usersettings)))
+			exitcode = 1;
+		goto clean;
+	}
+
+	if (settings_get_mount_path(&ctx.usersettings)->valid)
+	{
+		if (mount_run(&ctx.inreader, ctx.filetype, ncchindex, &ctx.usersettings, ctx.actions, settings_get_mount_path(&ctx.usersettings)->pathname) != 0)
+			exitcode = 1;
+		goto clean;
+	}
 
 	switch(ctx.filetype)
 	{
@@ -349,11 +476,12 @@ int main(int argc, char* argv[])
 			ncsd_context ncsdctx;
 
 			ncsd_init(&ncsdctx);
-			ncsd_set_file(&ncsdctx, ctx.infile);
+			ncsd_set_reader(&ncsdctx, &ctx.inreader);
 			ncsd_set_size(&ncsdctx, ctx.infilesize);
 			ncsd_set_ncch_index(&ncsdctx, ncchindex);
 			ncsd_set_usersettings(&ncsdctx, &ctx.usersettings);
-			ncsd_process(&ncsdctx, ctx.actions);
+			if (!ncsd_process(&ncsdctx, ctx.actions))
+				exitcode = 1;
 			
 			break;			
 		}
@@ -363,7 +491,7 @@ int main(int argc, char* argv[])
 			firm_context firmctx;
 
 			firm_init(&firmctx);
-			firm_set_file(&firmctx, ctx.infile);
+			firm_set_reader(&firmctx, &ctx.inreader);
 			firm_set_size(&firmctx, (u32) ctx.infilesize);
 			firm_set_usersettings(&firmctx, &ctx.usersettings);
 			firm_process(&firmctx, ctx.actions);
@@ -376,10 +504,11 @@ int main(int argc, char* argv[])
 			ncch_context ncchctx;
 
 			ncch_init(&ncchctx);
-			ncch_set_file(&ncchctx, ctx.infile);
+			ncch_set_reader(&ncchctx, &ctx.inreader);
 			ncch_set_size(&ncchctx, ctx.infilesize);
 			ncch_set_usersettings(&ncchctx, &ctx.usersettings);
-			ncch_process(&ncchctx, ctx.actions);
+			if (!ncch_process(&ncchctx, ctx.actions))
+				exitcode = 1;
 
 			break;
 		}
@@ -390,7 +519,7 @@ int main(int argc, char* argv[])
 			cia_context ciactx;
 
 			cia_init(&ciactx);
-			cia_set_file(&ciactx, ctx.infile);
+			cia_set_reader(&ciactx, &ctx.inreader);
 			cia_set_size(&ciactx, ctx.infilesize);
 			cia_set_usersettings(&ciactx, &ctx.usersettings);
 			cia_process(&ciactx, ctx.actions);
@@ -445,7 +574,7 @@ int main(int argc, char* argv[])
 			cwav_context cwavctx;
 
 			cwav_init(&cwavctx);
-			cwav_set_file(&cwavctx, ctx.infile);
+			cwav_set_reader(&cwavctx, &ctx.inreader);
 			cwav_set_size(&cwavctx, ctx.infilesize);
 			cwav_set_usersettings(&cwavctx, &ctx.usersettings);
 			cwav_process(&cwavctx, ctx.actions);
@@ -458,7 +587,7 @@ int main(int argc, char* argv[])
 			exefs_context exefsctx;
 
 			exefs_init(&exefsctx);
-			exefs_set_file(&exefsctx, ctx.infile);
+			exefs_set_reader(&exefsctx, &ctx.inreader);
 			exefs_set_size(&exefsctx, ctx.infilesize);
 			exefs_set_usersettings(&exefsctx, &ctx.usersettings);
 			exefs_process(&exefsctx, ctx.actions);
@@ -471,18 +600,29 @@ int main(int argc, char* argv[])
 			romfs_context romfsctx;
 
 			romfs_init(&romfsctx);
-			romfs_set_file(&romfsctx, ctx.infile);
+			romfs_set_reader(&romfsctx, &ctx.inreader);
 			romfs_set_size(&romfsctx, ctx.infilesize);
 			romfs_set_usersettings(&romfsctx, &ctx.usersettings);
 			romfs_set_encrypted(&romfsctx, 0);
-			romfs_process(&romfsctx, ctx.actions);
+			if (!romfs_process(&romfsctx, ctx.actions))
+				exitcode = 1;
+			if (settings_get_write_index_path(&ctx.usersettings)->valid &&
+				!index_write(settings_get_write_index_path(&ctx.usersettings)->pathname, NULL, &romfsctx, NULL,
+							 settings_get_index_hashes(&ctx.usersettings), settings_get_thread_count(&ctx.usersettings)))
+				exitcode = 1;
 	
 			break;
 		}
 	}
-	
+
+clean:
+	// stderr, so a file streamed to stdout stays intact
+	if (ctx.actions & VerboseFlag)
+		cache_print(stderr);
+	cache_free();
+	mapfile_close(&ctx.inmap);
 	if (ctx.infile)
 		fclose(ctx.infile);
 
-	return 0;
+	return exitcode;
 }
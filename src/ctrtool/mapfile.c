@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "mapfile.h"
+
+/*
+ * Map a whole input file read-only. Returns 0 when the file cannot be
+ * mapped (pipes, empty files, 32-bit address space exhausted, ...), in
+ * which case callers keep using stdio.
+ */
+int mapfile_open(mapfile* map, FILE* file, u64 size)
+{
+	memset(map, 0, sizeof(mapfile));
+
+	if (file == NULL || size == 0 || size > SIZE_MAX)
+		return 0;
+
+#ifdef _WIN32
+	HANDLE filehandle = (HANDLE) _get_osfhandle(_fileno(file));
+	HANDLE mapping = CreateFileMapping(filehandle, NULL, PAGE_READONLY, (DWORD)(size >> 32), (DWORD)size, NULL);
+	void* data;
+
+	if (mapping == NULL)
+		return 0;
+
+	data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, (SIZE_T)size);
+	if (data == NULL)
+	{
+		CloseHandle(mapping);
+		return 0;
+	}
+
+	map->handle = mapping;
+	map->data = data;
+#else
+	void* data = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fileno(file), 0);
+
+	if (data == MAP_FAILED)
+		return 0;
+
+	map->data = data;
+#endif
+
+	map->size = size;
+
+	return 1;
+}
+
+void mapfile_close(mapfile* map)
+{
+	if (map->data == NULL)
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(map->data);
+	CloseHandle((HANDLE) map->handle);
+#else
+	munmap(map->data, (size_t)map->size);
+#endif
+
+	memset(map, 0, sizeof(mapfile));
+}
+
+/*
+ * Pointer to size bytes at offset, or NULL if there is no mapping or the
+ * range is not inside the file.
+ */
+const u8* mapfile_get(const mapfile* map, u64 offset, u64 size)
+{
+	if (map == NULL || map->data == NULL)
+		return NULL;
+
+	if (offset > map->size || size > map->size - offset)
+		return NULL;
+
+	return map->data + offset;
+}
+
+int mapfile_read(const mapfile* map, u64 offset, void* buffer, u64 size)
+{
+	const u8* data = mapfile_get(map, offset, size);
+
+	if (data == NULL)
+		return 0;
+
+	memcpy(buffer, data, (size_t)size);
+
+	return 1;
+}
+
+void mapfile_advise(const mapfile* map, u64 offset, u64 size, int advice)
+{
+#ifndef _WIN32
+	long pagesize = sysconf(_SC_PAGESIZE);
+	u64 start;
+	int flag;
+
+	if (map == NULL || map->data == NULL || offset >= map->size || pagesize <= 0)
+		return;
+
+	if (size > map->size - offset)
+		size = map->size - offset;
+
+	switch(advice)
+	{
+		case MAPFILE_SEQUENTIAL: flag = MADV_SEQUENTIAL; break;
+		case MAPFILE_RANDOM: flag = MADV_RANDOM; break;
+		case MAPFILE_WILLNEED: flag = MADV_WILLNEED; break;
+		default: flag = MADV_NORMAL; break;
+	}
+
+	// madvise wants a page aligned start
+	start = offset - (offset % (u64)pagesize);
+	madvise(map->data + start, (size_t)(size + (offset - start)), flag);
+#endif
+}
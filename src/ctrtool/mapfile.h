@@ -0,0 +1,36 @@
+#ifndef _MAPFILE_H_
+#define _MAPFILE_H_
+
+#include <stdio.h>
+#include "types.h"
+
+typedef enum
+{
+	MAPFILE_NORMAL = 0,
+	MAPFILE_SEQUENTIAL,
+	MAPFILE_RANDOM,
+	MAPFILE_WILLNEED,
+} mapfile_advice;
+
+typedef struct
+{
+	u8* data;
+	u64 size;
+	void* handle;
+} mapfile;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int mapfile_open(mapfile* map, FILE* file, u64 size);
+void mapfile_close(mapfile* map);
+const u8* mapfile_get(const mapfile* map, u64 offset, u64 size);
+int mapfile_read(const mapfile* map, u64 offset, void* buffer, u64 size);
+void mapfile_advise(const mapfile* map, u64 offset, u64 size, int advice);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _MAPFILE_H_
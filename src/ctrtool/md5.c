@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "types.h"
+#include "utils.h"
+#include "md5.h"
+
+/*
+ * MD5 (RFC 1321). Not used for anything security related, only where a
+ * format mandates it, e.g. freedesktop thumbnail file names.
+ */
+
+static const u32 md5_sines[64] =
+{
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const u8 md5_shifts[16] =
+{
+	7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21,
+};
+
+static void md5_block(md5_context* ctx, const u8* block)
+{
+	u32 words[16];
+	u32 a = ctx->state[0];
+	u32 b = ctx->state[1];
+	u32 c = ctx->state[2];
+	u32 d = ctx->state[3];
+	u32 i;
+
+	for(i=0; i<16; i++)
+		words[i] = getle32(block + i * 4);
+
+	for(i=0; i<64; i++)
+	{
+		u32 round = i / 16;
+		u32 f;
+		u32 g;
+		u32 shift = md5_shifts[round * 4 + i % 4];
+
+		switch(round)
+		{
+			case 0: f = (b & c) | (~b & d); g = i; break;
+			case 1: f = (d & b) | (~d & c); g = (5 * i + 1) % 16; break;
+			case 2: f = b ^ c ^ d; g = (3 * i + 5) % 16; break;
+			default: f = c ^ (b | ~d); g = (7 * i) % 16; break;
+		}
+
+		f += a + md5_sines[i] + words[g];
+		a = d;
+		d = c;
+		c = b;
+		b += (f << shift) | (f >> (32 - shift));
+	}
+
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+}
+
+void md5_init(md5_context* ctx)
+{
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->length = 0;
+}
+
+void md5_update(md5_context* ctx, const u8* data, u32 size)
+{
+	u32 used = (u32)(ctx->length % 64);
+
+	ctx->length += size;
+
+	if (used)
+	{
+		u32 max = 64 - used;
+
+		if (max > size)
+			max = size;
+		memcpy(ctx->buffer + used, data, max);
+		data += max;
+		size -= max;
+		if (used + max < 64)
+			return;
+		md5_block(ctx, ctx->buffer);
+	}
+
+	while(size >= 64)
+	{
+		md5_block(ctx, data);
+		data += 64;
+		size -= 64;
+	}
+
+	memcpy(ctx->buffer, data, size);
+}
+
+void md5_finish(md5_context* ctx, u8 digest[16])
+{
+	static const u8 padding[64] = { 0x80 };
+	u8 length[8];
+	u32 used = (u32)(ctx->length % 64);
+	u32 i;
+
+	putle64(length, ctx->length * 8);
+	md5_update(ctx, padding, used < 56? 56 - used : 120 - used);
+	md5_update(ctx, length, 8);
+
+	for(i=0; i<4; i++)
+		putle32(digest + i * 4, ctx->state[i]);
+}
+
+void md5(const u8* data, u32 size, u8 digest[16])
+{
+	md5_context ctx;
+
+	md5_init(&ctx);
+	md5_update(&ctx, data, size);
+	md5_finish(&ctx, digest);
+}
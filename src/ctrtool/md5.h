@@ -0,0 +1,26 @@
+#ifndef _MD5_H_
+#define _MD5_H_
+
+#include "types.h"
+
+typedef struct
+{
+	u32 state[4];
+	u64 length;
+	u8 buffer[64];
+} md5_context;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void md5_init(md5_context* ctx);
+void md5_update(md5_context* ctx, const u8* data, u32 size);
+void md5_finish(md5_context* ctx, u8 digest[16]);
+void md5(const u8* data, u32 size, u8 digest[16]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _MD5_H_
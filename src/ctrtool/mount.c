@@ -0,0 +1,551 @@
+#ifdef HAVE_FUSE
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#define FUSE_USE_VERSION 31
+#endif
+
+#include <stdio.h>
+#include "types.h"
+#include "mount.h"
+
+#ifdef HAVE_FUSE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <fuse.h>
+
+#include "utils.h"
+#include "ctr.h"
+#include "ncsd.h"
+#include "ncch.h"
+#include "cia.h"
+#include "lzss.h"
+#include "cache.h"
+
+typedef enum
+{
+	MOUNT_NODE_NONE = 0,
+	MOUNT_NODE_DIR,
+	MOUNT_NODE_FILE,
+} mount_nodetype;
+
+typedef struct
+{
+	int type;
+	u32 region;
+	u64 start;
+	u64 size;
+	u32 diroffset;
+	const u8* memory;
+} mount_node;
+
+typedef struct
+{
+	char name[32];
+	u32 region;
+} mount_content;
+
+typedef struct
+{
+	const reader_context* reader;
+	settings* usersettings;
+	struct stat imagestat;
+	ncsd_context ncsd;
+	ncch_context ncchctx;
+	cia_context cia;
+	exefs_context* exefs;
+	romfs_context* romfs;
+	cache_region* regions;
+	u32 regioncount;
+	u32 exefsregion[2];
+	u32 romfsregion;
+	u8* code;
+	u32 codesize;
+	mount_content* contents;
+	u32 contentcount;
+} mount_context;
+
+
+static mount_context* mount_get_context(void)
+{
+	return (mount_context*) fuse_get_context()->private_data;
+}
+
+static u32 mount_add_region(mount_context* ctx, u64 offset, u64 size, u32 crypto, const u8 key[16], const u8 iv[16])
+{
+	cache_region_init(ctx->regions + ctx->regioncount, ctx->reader, offset, size, crypto, key, iv);
+
+	return ctx->regioncount++;
+}
+
+/*
+ * Reads are served from the process-wide block cache, so only the extents
+ * a read touches are decrypted, and each of them once while it stays
+ * cached.
+ */
+static int mount_read_region(mount_context* ctx, u32 regionindex, u64 position, u8* buffer, u32 size)
+{
+	if (!cache_read(ctx->regions + regionindex, position, buffer, size))
+		return -EIO;
+
+	return (int) size;
+}
+
+static void mount_exefs_name(exefs_sectionheader* section, char name[16])
+{
+	memset(name, 0, 16);
+	memcpy(name, section->name[0] == '.'? section->name + 1 : section->name, section->name[0] == '.'? 7 : 8);
+	strcat(name, ".bin");
+}
+
+static int mount_resolve(mount_context* ctx, const char* path, mount_node* node)
+{
+	romfs_fileentry entry;
+	char name[16];
+	u32 i;
+
+	memset(node, 0, sizeof(mount_node));
+
+	if (strcmp(path, "/") == 0)
+	{
+		node->type = MOUNT_NODE_DIR;
+	}
+	else if (ctx->exefs && strncmp(path, "/exefs", 6) == 0 && (path[6] == 0 || path[6] == '/'))
+	{
+		if (path[6] == 0 || path[7] == 0)
+		{
+			node->type = MOUNT_NODE_DIR;
+			return 1;
+		}
+
+		for(i=0; i<EXEFS_SECTION_NUM; i++)
+		{
+			exefs_sectionheader* section = ctx->exefs->header.section + i;
+
+			mount_exefs_name(section, name);
+			if (getle32(section->size) && strcmp(path + 7, name) == 0)
+			{
+				int usekey0 = strncmp((const char*)section->name, "icon", 8) == 0 || strncmp((const char*)section->name, "banner", 8) == 0;
+
+				node->type = MOUNT_NODE_FILE;
+				node->region = ctx->exefsregion[usekey0? 0 : 1];
+				node->start = getle32(section->offset) + sizeof(exefs_header);
+				node->size = getle32(section->size);
+				if (i == 0 && ctx->code)
+				{
+					node->memory = ctx->code;
+					node->size = ctx->codesize;
+				}
+				break;
+			}
+		}
+	}
+	else if (ctx->romfs && strncmp(path, "/romfs", 6) == 0 && (path[6] == 0 || path[6] == '/'))
+	{
+		u32 offset = romfs_lookup_file(ctx->romfs, path + 6, &entry);
+
+		if (offset != (~0))
+		{
+			node->type = MOUNT_NODE_FILE;
+			node->region = ctx->romfsregion;
+			node->start = ctx->romfs->datablockoffset - ctx->romfs->offset + getle64(entry.dataoffset);
+			node->size = getle64(entry.datasize);
+		}
+		else
+		{
+			node->diroffset = romfs_lookup_dir_path(ctx->romfs, path + 6);
+			if (node->diroffset != (~0))
+				node->type = MOUNT_NODE_DIR;
+		}
+	}
+	else if (ctx->contentcount && strncmp(path, "/contents", 9) == 0 && (path[9] == 0 || path[9] == '/'))
+	{
+		if (path[9] == 0 || path[10] == 0)
+		{
+			node->type = MOUNT_NODE_DIR;
+			return 1;
+		}
+
+		for(i=0; i<ctx->contentcount; i++)
+		{
+			if (strcmp(path + 10, ctx->contents[i].name) == 0)
+			{
+				node->type = MOUNT_NODE_FILE;
+				node->region = ctx->contents[i].region;
+				node->size = ctx->regions[node->region].size;
+				break;
+			}
+		}
+	}
+
+	return node->type != MOUNT_NODE_NONE;
+}
+
+static int mount_getattr(const char* path, struct stat* st, struct fuse_file_info* fi)
+{
+	mount_context* ctx = mount_get_context();
+	mount_node node;
+
+	if (!mount_resolve(ctx, path, &node))
+		return -ENOENT;
+
+	memset(st, 0, sizeof(struct stat));
+	st->st_uid = ctx->imagestat.st_uid;
+	st->st_gid = ctx->imagestat.st_gid;
+	st->st_atime = ctx->imagestat.st_atime;
+	st->st_mtime = ctx->imagestat.st_mtime;
+	st->st_ctime = ctx->imagestat.st_ctime;
+
+	if (node.type == MOUNT_NODE_DIR)
+	{
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+	}
+	else
+	{
+		st->st_mode = S_IFREG | 0444;
+		st->st_nlink = 1;
+		st->st_size = node.size;
+	}
+
+	return 0;
+}
+
+static void mount_fill_utf16(void* buf, fuse_fill_dir_t filler, const u8* name)
+{
+	char converted[ROMFS_MAXNAMESIZE / 2 * OS_UTF16_MAXCHARS + 1];
+	u32 length = utf16_strlen((const utf16char_t*)name);
+
+	converted[os_ConvertUTF16Str(converted, (const utf16char_t*)name, length)] = 0;
+	filler(buf, converted, NULL, 0, 0);
+}
+
+static int mount_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi, enum fuse_readdir_flags flags)
+{
+	mount_context* ctx = mount_get_context();
+	mount_node node;
+	char name[16];
+	u32 i;
+
+	if (!mount_resolve(ctx, path, &node) || node.type != MOUNT_NODE_DIR)
+		return -ENOENT;
+
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+
+	if (strcmp(path, "/") == 0)
+	{
+		if (ctx->exefs)
+			filler(buf, "exefs", NULL, 0, 0);
+		if (ctx->romfs)
+			filler(buf, "romfs", NULL, 0, 0);
+		if (ctx->contentcount)
+			filler(buf, "contents", NULL, 0, 0);
+	}
+	else if (strncmp(path, "/exefs", 6) == 0)
+	{
+		for(i=0; i<EXEFS_SECTION_NUM; i++)
+		{
+			exefs_sectionheader* section = ctx->exefs->header.section + i;
+
+			if (getle32(section->size))
+			{
+				mount_exefs_name(section, name);
+				filler(buf, name, NULL, 0, 0);
+			}
+		}
+	}
+	else if (strncmp(path, "/romfs", 6) == 0)
+	{
+		romfs_direntry dir;
+		romfs_direntry child;
+		romfs_fileentry file;
+		u32 steps;
+		u32 entryoffset;
+
+		if (!romfs_dirblock_readentry(ctx->romfs, node.diroffset, &dir))
+			return -EIO;
+
+		steps = ctx->romfs->dirblocksize / (sizeof(romfs_direntry) - ROMFS_MAXNAMESIZE);
+		entryoffset = getle32(dir.childoffset);
+		while(entryoffset != (~0) && steps-- && romfs_dirblock_readentry(ctx->romfs, entryoffset, &child))
+		{
+			mount_fill_utf16(buf, filler, child.name);
+			entryoffset = getle32(child.siblingoffset);
+		}
+
+		steps = ctx->romfs->fileblocksize / (sizeof(romfs_fileentry) - ROMFS_MAXNAMESIZE);
+		entryoffset = getle32(dir.fileoffset);
+		while(entryoffset != (~0) && steps-- && romfs_fileblock_readentry(ctx->romfs, entryoffset, &file))
+		{
+			mount_fill_utf16(buf, filler, file.name);
+			entryoffset = getle32(file.siblingoffset);
+		}
+	}
+	else if (strncmp(path, "/contents", 9) == 0)
+	{
+		for(i=0; i<ctx->contentcount; i++)
+			filler(buf, ctx->contents[i].name, NULL, 0, 0);
+	}
+
+	return 0;
+}
+
+static int mount_open(const char* path, struct fuse_file_info* fi)
+{
+	mount_context* ctx = mount_get_context();
+	mount_node* node;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+
+	node = malloc(sizeof(mount_node));
+	if (node == NULL)
+		return -ENOMEM;
+
+	if (!mount_resolve(ctx, path, node) || node->type != MOUNT_NODE_FILE)
+	{
+		free(node);
+		return -ENOENT;
+	}
+
+	fi->fh = (uint64_t)(uintptr_t) node;
+	fi->keep_cache = 1;
+	return 0;
+}
+
+static int mount_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	mount_context* ctx = mount_get_context();
+	mount_node* node = (mount_node*)(uintptr_t) fi->fh;
+
+	if (offset < 0 || (u64)offset >= node->size)
+		return 0;
+
+	if (size > node->size - offset)
+		size = (size_t)(node->size - offset);
+
+	if (node->memory)
+	{
+		memcpy(buf, node->memory + offset, size);
+		return (int) size;
+	}
+
+	return mount_read_region(ctx, node->region, node->start + offset, (u8*)buf, (u32)size);
+}
+
+static int mount_release(const char* path, struct fuse_file_info* fi)
+{
+	free((mount_node*)(uintptr_t) fi->fh);
+	return 0;
+}
+
+/*
+ * Like --exefsdir, a compressed .code section is served decompressed.
+ * It is decoded once up front so reads at any offset stay cheap.
+ */
+static void mount_setup_code(mount_context* ctx, u32 actions)
+{
+	exefs_sectionheader* section = ctx->exefs->header.section;
+	u32 compressedsize = getle32(section->size);
+	u64 position = getle32(section->offset) + sizeof(exefs_header);
+	u8 footer[LZSS_FOOTER_SIZE];
+	u32 codesize;
+
+	if (compressedsize < LZSS_FOOTER_SIZE || (actions & RawFlag) || !(ctx->exefs->compressedflag || (actions & DecompressCodeFlag)))
+		return;
+
+	// the section is read into the head of the code buffer and decompressed in place
+	if (LZSS_FOOTER_SIZE != mount_read_region(ctx, ctx->exefsregion[1], position + compressedsize - LZSS_FOOTER_SIZE, footer, LZSS_FOOTER_SIZE))
+		return;
+
+	codesize = lzss_get_footer_decompressed_size(footer, compressedsize);
+	if (codesize < compressedsize)
+		return;
+
+	ctx->code = malloc(codesize);
+	if (ctx->code == NULL)
+		return;
+
+	if (compressedsize != mount_read_region(ctx, ctx->exefsregion[1], position, ctx->code, compressedsize) ||
+		0 == lzss_decompress_inplace(ctx->code, compressedsize, codesize))
+	{
+		fprintf(stderr, "Error, could not decompress ExeFS code, serving it compressed\n");
+		free(ctx->code);
+		ctx->code = NULL;
+		return;
+	}
+
+	ctx->codesize = codesize;
+}
+
+static void mount_setup_ncch(mount_context* ctx, ncch_context* ncch, u32 actions)
+{
+	int crypto = ncch->encrypted? CACHE_CRYPTO_CTR : CACHE_CRYPTO_NONE;
+
+	if (ncch_get_exefs_size(ncch))
+	{
+		ctx->exefs = &ncch->exefs;
+		ctx->exefsregion[0] = mount_add_region(ctx, ctx->exefs->offset, ctx->exefs->size, crypto, ctx->exefs->key[0], ctx->exefs->counter);
+		ctx->exefsregion[1] = mount_add_region(ctx, ctx->exefs->offset, ctx->exefs->size, crypto, ctx->exefs->key[1], ctx->exefs->counter);
+		mount_setup_code(ctx, actions);
+	}
+
+	if (ncch_get_romfs_size(ncch) && ncch->romfs.fileblock)
+	{
+		ctx->romfs = &ncch->romfs;
+		ctx->romfsregion = mount_add_region(ctx, ctx->romfs->offset, ctx->romfs->size, ctx->romfs->encrypted? CACHE_CRYPTO_CTR : CACHE_CRYPTO_NONE, ctx->romfs->key, ctx->romfs->counter);
+	}
+}
+
+static void mount_setup_cia(mount_context* ctx, u32 actions)
+{
+	ctr_tmd_body* body = tmd_get_body(&ctx->cia.tmd);
+	ctr_tmd_contentchunk* chunk;
+	u64 offset = ctx->cia.offset + ctx->cia.offsetcontent;
+	cache_region* regions;
+	u32 contentcount;
+	u8 iv[16];
+	u32 i;
+
+	if (body == NULL)
+		return;
+
+	// TMD_MAX_CONTENTS only bounds the content info records, a title can have more contents
+	contentcount = getbe16(body->contentcount);
+	regions = realloc(ctx->regions, (ctx->regioncount + contentcount) * sizeof(cache_region));
+	if (regions == NULL)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		return;
+	}
+	ctx->regions = regions;
+
+	ctx->contents = malloc(contentcount * sizeof(mount_content));
+	if (ctx->contents == NULL && contentcount)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		return;
+	}
+
+	chunk = (ctr_tmd_contentchunk*)(body->contentinfo + (sizeof(ctr_tmd_contentinfo) * TMD_MAX_CONTENTS));
+	for(i = 0; i < contentcount; i++, chunk++)
+	{
+		u16 index = getbe16(chunk->index);
+		u64 size = getbe64(chunk->size) & 0xffffffff;
+		int crypto = ((getbe16(chunk->type) & 1) && !(actions & PlainFlag))? CACHE_CRYPTO_CBC : CACHE_CRYPTO_NONE;
+		mount_content* content;
+
+		if (!(ctx->cia.header.contentindex[index >> 3] & (0x80 >> (index & 7))))
+			continue;
+
+		memset(iv, 0, 16);
+		iv[0] = (index >> 8) & 0xff;
+		iv[1] = index & 0xff;
+
+		content = ctx->contents + ctx->contentcount++;
+		snprintf(content->name, sizeof(content->name), "%04x.%08x.app", index, getbe32(chunk->id));
+		content->region = mount_add_region(ctx, offset, size, crypto, ctx->cia.titlekey, iv);
+		offset += size;
+	}
+}
+
+/*
+ * Parse the image with the regular processing code, with every action
+ * that prints, verifies or writes masked off, then serve it read-only
+ * until the filesystem is unmounted.
+ */
+int mount_run(const reader_context* reader, u32 filetype, u32 ncchindex, settings* usersettings, u32 actions, const char* mountpoint)
+{
+	struct fuse_operations operations;
+	mount_context* ctx;
+	char* argv[] = { "ctrtool", "-f", "-o", "ro,fsname=ctrtool,default_permissions", (char*)mountpoint, NULL };
+	int result = 1;
+
+
+	// an NCCH needs three regions, ExeFS with either key and RomFS
+	ctx = calloc(1, sizeof(mount_context));
+	if (ctx)
+		ctx->regions = malloc(3 * sizeof(cache_region));
+	if (ctx == NULL || ctx->regions == NULL)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		free(ctx);
+		return 1;
+	}
+
+	ctx->reader = reader;
+	ctx->usersettings = usersettings;
+	fstat(fileno(reader->file), &ctx->imagestat);
+	actions &= ~(InfoFlag | ExtractFlag | VerifyFlag);
+
+	switch(filetype)
+	{
+		case FILETYPE_CCI:
+			ncsd_init(&ctx->ncsd);
+			ncsd_set_reader(&ctx->ncsd, reader);
+			ncsd_set_size(&ctx->ncsd, ctx->imagestat.st_size);
+			ncsd_set_ncch_index(&ctx->ncsd, ncchindex);
+			ncsd_set_usersettings(&ctx->ncsd, usersettings);
+			ncsd_process(&ctx->ncsd, actions);
+			mount_setup_ncch(ctx, &ctx->ncsd.ncch, actions);
+		break;
+
+		case FILETYPE_CXI:
+			ncch_init(&ctx->ncchctx);
+			ncch_set_reader(&ctx->ncchctx, reader);
+			ncch_set_size(&ctx->ncchctx, ctx->imagestat.st_size);
+			ncch_set_usersettings(&ctx->ncchctx, usersettings);
+			ncch_process(&ctx->ncchctx, actions);
+			mount_setup_ncch(ctx, &ctx->ncchctx, actions);
+		break;
+
+		case FILETYPE_CIA:
+			cia_init(&ctx->cia);
+			cia_set_reader(&ctx->cia, reader);
+			cia_set_size(&ctx->cia, ctx->imagestat.st_size);
+			cia_set_usersettings(&ctx->cia, usersettings);
+			cia_process(&ctx->cia, actions);
+			mount_setup_cia(ctx, actions);
+		break;
+
+		default:
+			fprintf(stderr, "Error, only NCSD, NCCH and CIA files can be mounted\n");
+			goto clean;
+	}
+
+	if (ctx->exefs == NULL && ctx->romfs == NULL && ctx->contentcount == 0)
+	{
+		fprintf(stderr, "Error, nothing to mount\n");
+		goto clean;
+	}
+
+	memset(&operations, 0, sizeof(operations));
+	operations.getattr = mount_getattr;
+	operations.readdir = mount_readdir;
+	operations.open = mount_open;
+	operations.read = mount_read;
+	operations.release = mount_release;
+
+	result = fuse_main(sizeof(argv) / sizeof(argv[0]) - 1, argv, &operations, ctx);
+
+clean:
+	free(ctx->code);
+	free(ctx->contents);
+	free(ctx->regions);
+	free(ctx);
+	return result;
+}
+
+#else
+
+int mount_run(const reader_context* reader, u32 filetype, u32 ncchindex, settings* usersettings, u32 actions, const char* mountpoint)
+{
+	fprintf(stderr, "Error, ctrtool was built without FUSE support (rebuild with make FUSE=1)\n");
+	return 1;
+}
+
+#endif // HAVE_FUSE
@@ -0,0 +1,10 @@
+#ifndef _MOUNT_H_
+#define _MOUNT_H_
+
+#include "types.h"
+#include "settings.h"
+#include "reader.h"
+
+int mount_run(const reader_context* reader, u32 filetype, u32 ncchindex, settings* usersettings, u32 actions, const char* mountpoint);
+
+#endif // _MOUNT_H_
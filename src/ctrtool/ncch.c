@@ -7,6 +7,8 @@
 #include "ctr.h"
 #include "settings.h"
 #include "aes_keygen.h"
+#include "pipeline.h"
+#include "index.h"
 #include <inttypes.h>
 
 static int programid_is_system(u8 programid[8])
@@ -41,9 +43,9 @@ void ncch_set_size(ncch_context* ctx, u64 size)
 	ctx->size = size;
 }
 
-void ncch_set_file(ncch_context* ctx, FILE* file)
+void ncch_set_reader(ncch_context* ctx, const reader_context* reader)
 {
-	ctx->file = file;
+	ctx->reader = reader;
 }
 
 void ncch_get_counter(ncch_context* ctx, u8 counter[16], u8 type)
@@ -136,8 +138,8 @@ int ncch_extract_prepare(ncch_context* ctx, u32 type, u32 flags)
 	}
 
 	ctx->extractsize = size;
+	ctx->extractoffset = offset;
 	ctx->extractflags = flags;
-	fseeko64(ctx->file, offset, SEEK_SET);
 	ncch_get_counter(ctx, counter, type);
 	
 	ctr_init_counter(&ctx->aes, counter);
@@ -159,16 +161,30 @@ int ncch_extract_buffer(ncch_context* ctx, u8* buffer, u32 buffersize, u32* outs
 
 	if (ctx->extractsize)
 	{
-		if (read_len != fread(buffer, 1, read_len, ctx->file))
+		const u8* src = reader_get(ctx->reader, ctx->extractoffset, read_len);
+
+		if (src)
 		{
-			fprintf(stdout, "Error reading input file\n");
-			goto clean;
+			// decrypt straight out of the mapping into the caller's buffer
+			if (ctx->encrypted && !nocrypto)
+				ctr_crypt_counter_parallel(&ctx->aes, (u8*)src, buffer, read_len, settings_get_thread_count(ctx->usersettings));
+			else
+				memcpy(buffer, src, read_len);
 		}
+		else
+		{
+			if (read_len != reader_read_at(ctx->reader, ctx->extractoffset, buffer, read_len))
+			{
+				fprintf(stderr, "Error reading input file\n");
+				goto clean;
+			}
 
-		if (ctx->encrypted && !nocrypto)
-			ctr_crypt_counter(&ctx->aes, buffer, buffer, read_len);
+			if (ctx->encrypted && !nocrypto)
+				ctr_crypt_counter_parallel(&ctx->aes, buffer, buffer, read_len, settings_get_thread_count(ctx->usersettings));
+		}
 
 		ctx->extractsize -= read_len;
+		ctx->extractoffset += read_len;
 	}
 
 	return 1;
@@ -177,11 +193,20 @@ clean:
 	return 0;
 }
 
+static void ncch_pipeline_crypt(void* arg, const u8* input, u8* output, u32 size)
+{
+	ncch_context* ctx = (ncch_context*) arg;
+
+	ctr_crypt_counter_parallel(&ctx->aes, (u8*)input, output, size, settings_get_thread_count(ctx->usersettings));
+}
+
 void ncch_save(ncch_context* ctx, u32 type, u32 flags)
 {
 	FILE* fout = 0;
 	filepath* path = 0;
-	u8 buffer[16*1024];
+	u8* buffer = 0;
+	u32 buffersize = NCCH_EXTRACT_BUFFER_SIZE;
+	u32 threadcount = settings_get_thread_count(ctx->usersettings);
 	exefs_header exefs_hdr;
 
 
@@ -203,23 +228,33 @@ void ncch_save(ncch_context* ctx, u32 type, u32 flags)
 	fout = fopen(path->pathname, "wb");
 	if (0 == fout)
 	{
-		fprintf(stdout, "Error opening out file %s\n", path->pathname);
+		fprintf(stderr, "Error opening out file %s\n", path->pathname);
 		goto clean;
 	}
 
+	buffer = malloc(buffersize);
+	if (0 == buffer)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		goto clean;
+	}
+
+	reader_advise(ctx->reader, ctx->extractoffset, ctx->extractsize, MAPFILE_SEQUENTIAL);
+
 	switch(type)
 	{
-		case NCCHTYPE_EXEFS: fprintf(stdout, "Saving ExeFS...\n"); break;
-		case NCCHTYPE_ROMFS: fprintf(stdout, "Saving RomFS...\n"); break;
-		case NCCHTYPE_EXHEADER: fprintf(stdout, "Saving Extended Header...\n"); break;
-		case NCCHTYPE_LOGO: fprintf(stdout, "Saving Logo...\n"); break;
-		case NCCHTYPE_PLAINRGN: fprintf(stdout, "Saving Plain Region...\n"); break;
+		case NCCHTYPE_EXEFS: fprintf(settings_get_message_file(ctx->usersettings), "Saving ExeFS...\n"); break;
+		case NCCHTYPE_ROMFS: fprintf(settings_get_message_file(ctx->usersettings), "Saving RomFS...\n"); break;
+		case NCCHTYPE_EXHEADER: fprintf(settings_get_message_file(ctx->usersettings), "Saving Extended Header...\n"); break;
+		case NCCHTYPE_LOGO: fprintf(settings_get_message_file(ctx->usersettings), "Saving Logo...\n"); break;
+		case NCCHTYPE_PLAINRGN: fprintf(settings_get_message_file(ctx->usersettings), "Saving Plain Region...\n"); break;
 	}
 
 	// special crypto considerations for exefs when two keys are used
 	if (type == NCCHTYPE_EXEFS && ctx->header.flags[3] > 0 && ctx->encrypted)
 	{
 		u32 read_len;
+		u64 position;
 
 		// read header
 		if (0 == ncch_extract_buffer(ctx, (u8*)&exefs_hdr, sizeof(exefs_hdr), &read_len, 0))
@@ -227,10 +262,12 @@ void ncch_save(ncch_context* ctx, u32 type, u32 flags)
 
 		if (read_len != fwrite(&exefs_hdr, 1, read_len, fout))
 		{
-			fprintf(stdout, "Error writing output file\n");
+			fprintf(stderr, "Error writing output file\n");
 			goto clean;
 		}
 
+		position = ctx->extractoffset;
+
 		for (int i = 0; i < 8; i++)
 		{
 			
@@ -257,22 +294,32 @@ void ncch_save(ncch_context* ctx, u32 type, u32 flags)
 			// extract data
 			while (section_size > 0)
 			{
-				read_len = sizeof(buffer);
+				const u8* src;
+
+				read_len = buffersize;
 				if (read_len > section_size)
 					read_len = section_size;
 
-
-				if (read_len != fread(buffer, 1, read_len, ctx->file))
+				src = reader_get(ctx->reader, position, read_len);
+				if (src)
 				{
-					fprintf(stdout, "Error reading input file\n");
-					goto clean;
+					ctr_crypt_counter_parallel(&ctx->aes, (u8*)src, buffer, read_len, threadcount);
 				}
+				else
+				{
+					if (read_len != reader_read_at(ctx->reader, position, buffer, read_len))
+					{
+						fprintf(stderr, "Error reading input file\n");
+						goto clean;
+					}
 
-				ctr_crypt_counter(&ctx->aes, buffer, buffer, read_len);
+					ctr_crypt_counter_parallel(&ctx->aes, buffer, buffer, read_len, threadcount);
+				}
+				position += read_len;
 
 				if (read_len != fwrite(buffer, 1, read_len, fout))
 				{
-					fprintf(stdout, "Error writing output file\n");
+					fprintf(stderr, "Error writing output file\n");
 					goto clean;
 				}
 
@@ -283,11 +330,11 @@ void ncch_save(ncch_context* ctx, u32 type, u32 flags)
 			// skip the padding
 			if (section_padding)
 			{
-				fseeko64(ctx->file, section_padding, SEEK_CUR);
+				position += section_padding;
 				memset(buffer, 0, section_padding);
 				if (section_padding != fwrite(buffer, 1, section_padding, fout))
 				{
-					fprintf(stdout, "Error writing output file\n");
+					fprintf(stderr, "Error writing output file\n");
 					goto clean;
 				}
 
@@ -298,25 +345,17 @@ void ncch_save(ncch_context* ctx, u32 type, u32 flags)
 	}
 	else
 	{
-		while (1)
-		{
-			u32 read_len;
-
-			if (0 == ncch_extract_buffer(ctx, buffer, sizeof(buffer), &read_len, (type == NCCHTYPE_LOGO || type == NCCHTYPE_PLAINRGN)))
-				goto clean;
+		u8 nocrypto = (type == NCCHTYPE_LOGO || type == NCCHTYPE_PLAINRGN);
 
-			if (read_len == 0)
-				break;
+		if (0 == pipeline_copy(ctx->reader, ctx->extractoffset, ctx->extractsize, fout, (ctx->encrypted && !nocrypto)? ncch_pipeline_crypt : NULL, ctx))
+			goto clean;
 
-			if (read_len != fwrite(buffer, 1, read_len, fout))
-			{
-				fprintf(stdout, "Error writing output file\n");
-				goto clean;
-			}
-		}
+		ctx->extractoffset += ctx->extractsize;
+		ctx->extractsize = 0;
 	}
 	
 clean:
+	free(buffer);
 	if (fout)
 		fclose(fout);
 	return;
@@ -399,28 +438,31 @@ clean:
 }
 
 
-void ncch_process(ncch_context* ctx, u32 actions)
+/*
+ * Read the header, determine the keys and point the exheader, ExeFS and
+ * RomFS contexts at their regions. Nothing beyond the header and the
+ * exheader is read. Returns 0 if the header is unusable.
+ */
+int ncch_setup(ncch_context* ctx, u32 actions)
 {
 	u8 exheadercounter[16];
 	u8 exefscounter[16];
 	u8 romfscounter[16];
-	int result = 1;
 
 
-	fseeko64(ctx->file, ctx->offset, SEEK_SET);
-	fread(&ctx->header, 1, 0x200, ctx->file);
+	reader_read_at(ctx->reader, ctx->offset, &ctx->header, 0x200);
 
 	if (getle32(ctx->header.magic) != MAGIC_NCCH)
 	{
 		fprintf(stdout, "Error, NCCH segment corrupted\n");
-		return;
+		return 0;
 	}
 
 	const u32 exheaderSize = getle32(ctx->header.extendedheadersize);
 	if (exheaderSize != 0x400 && exheaderSize != 0)
 	{
 		fprintf(stdout, "Error, exheader is 0x%02x bytes long, expected 0x400 or 0\n", getle32(ctx->header.extendedheadersize));
-		return;
+		return 0;
 	}
 
 	ncch_determine_key(ctx, actions);
@@ -438,7 +480,7 @@ void ncch_process(ncch_context* ctx, u32 actions)
 	}
 
 
-	exheader_set_file(&ctx->exheader, ctx->file);
+	exheader_set_file(&ctx->exheader, ctx->reader->file);
 	exheader_set_offset(&ctx->exheader, ncch_get_exheader_offset(ctx) );
 	exheader_set_size(&ctx->exheader, ncch_get_exheader_size(ctx) );
 	exheader_set_usersettings(&ctx->exheader, ctx->usersettings);
@@ -449,7 +491,7 @@ void ncch_process(ncch_context* ctx, u32 actions)
 	exheader_set_key(&ctx->exheader, ctx->key[0]);
 	exheader_set_encrypted(&ctx->exheader, ctx->encrypted);
 
-	exefs_set_file(&ctx->exefs, ctx->file);
+	exefs_set_reader(&ctx->exefs, ctx->reader);
 	exefs_set_offset(&ctx->exefs, ncch_get_exefs_offset(ctx) );
 	exefs_set_size(&ctx->exefs, ncch_get_exefs_size(ctx) );
 	exefs_set_titleid(&ctx->exefs, ctx->header.titleid);
@@ -458,7 +500,7 @@ void ncch_process(ncch_context* ctx, u32 actions)
 	exefs_set_keys(&ctx->exefs, ctx->key[0], ctx->key[1]);
 	exefs_set_encrypted(&ctx->exefs, ctx->encrypted);
 
-	romfs_set_file(&ctx->romfs, ctx->file);
+	romfs_set_reader(&ctx->romfs, ctx->reader);
 	romfs_set_offset(&ctx->romfs, ncch_get_romfs_offset(ctx));
 	romfs_set_size(&ctx->romfs, ncch_get_romfs_size(ctx));
 	romfs_set_usersettings(&ctx->romfs, ctx->usersettings);
@@ -466,6 +508,21 @@ void ncch_process(ncch_context* ctx, u32 actions)
 	romfs_set_key(&ctx->romfs, ctx->key[1]);
 	romfs_set_encrypted(&ctx->romfs, ctx->encrypted);
 
+	return 1;
+}
+
+/*
+ * Returns 0 if the NCCH could not be processed, a requested RomFS file
+ * could not be extracted or the index could not be written.
+ */
+int ncch_process(ncch_context* ctx, u32 actions)
+{
+	int result = 1;
+
+
+	if (!ncch_setup(ctx, actions))
+		return 0;
+
 	exheader_read(&ctx->exheader, actions);
 
 
@@ -478,7 +535,7 @@ void ncch_process(ncch_context* ctx, u32 actions)
 	if (ctx->encrypted == NCCHCRYPTO_BROKEN)
 	{
 		fprintf(stderr, "Error, NCCH encryption broken.\n");
-		return;
+		return 0;
 	}
 
 	if ((actions & ShowKeysFlag) && ctx->encrypted)
@@ -512,7 +569,7 @@ void ncch_process(ncch_context* ctx, u32 actions)
 	if (result && ncch_get_exheader_size(ctx))
 	{
 		if (!exheader_hash_valid(&ctx->exheader))
-			return;
+			return 0;
 
 		result = exheader_process(&ctx->exheader, actions);
 	} 
@@ -526,8 +583,17 @@ void ncch_process(ncch_context* ctx, u32 actions)
 
 	if (result && ncch_get_romfs_size(ctx))
 	{
-		romfs_process(&ctx->romfs, actions);
+		result = romfs_process(&ctx->romfs, actions);
+	}
+
+	if (settings_get_write_index_path(ctx->usersettings)->valid)
+	{
+		if (!index_write(settings_get_write_index_path(ctx->usersettings)->pathname, ctx, &ctx->romfs, &ctx->exefs,
+						 settings_get_index_hashes(ctx->usersettings), settings_get_thread_count(ctx->usersettings)))
+			result = 0;
 	}
+
+	return result;
 }
 
 int ncch_signature_verify(ncch_context* ctx, rsakey2048* key)
@@ -626,9 +692,8 @@ void ncch_determine_key(ncch_context* ctx, u32 actions)
 
 	// Check if the NCCH is already decrypted, by checking if the exheader hash matches
 	// Otherwise, use determination rules
-	fseeko64(ctx->file, ncch_get_exheader_offset(ctx), SEEK_SET);
 	memset(exheader_buffer, 0, exheaderSize);
-	fread(exheader_buffer, 1, exheaderSize, ctx->file);
+	reader_read_at(ctx->reader, ncch_get_exheader_offset(ctx), exheader_buffer, exheaderSize);
 	ctr_sha_256(exheader_buffer, exheaderSize, hash);
 	if (!memcmp(hash, header->extendedheaderhash, 32))
 	{
@@ -10,6 +10,9 @@
 #include "romfs.h"
 #include "exheader.h"
 #include "settings.h"
+#include "reader.h"
+
+#define NCCH_EXTRACT_BUFFER_SIZE (4 * 1024 * 1024)
 
 typedef enum
 {
@@ -64,7 +67,7 @@ typedef struct
 
 typedef struct
 {
-	FILE* file;
+	const reader_context* reader;
 	u8 key[2][16];
 	u8 seed[16];
 	u32 encrypted;
@@ -82,14 +85,16 @@ typedef struct
 	int logohashcheck;
 	int headersigcheck;
 	u64 extractsize;
+	u64 extractoffset;
 	u32 extractflags;
 } ncch_context;
 
 void ncch_init(ncch_context* ctx);
-void ncch_process(ncch_context* ctx, u32 actions);
+int ncch_setup(ncch_context* ctx, u32 actions);
+int ncch_process(ncch_context* ctx, u32 actions);
 void ncch_set_offset(ncch_context* ctx, u64 offset);
 void ncch_set_size(ncch_context* ctx, u64 size);
-void ncch_set_file(ncch_context* ctx, FILE* file);
+void ncch_set_reader(ncch_context* ctx, const reader_context* reader);
 void ncch_set_usersettings(ncch_context* ctx, settings* usersettings);
 u64 ncch_get_exefs_offset(ncch_context* ctx);
 u64 ncch_get_exefs_size(ncch_context* ctx);
@@ -18,9 +18,9 @@ void ncsd_set_offset(ncsd_context* ctx, u64 offset)
 	ctx->offset = offset;
 }
 
-void ncsd_set_file(ncsd_context* ctx, FILE* file)
+void ncsd_set_reader(ncsd_context* ctx, const reader_context* reader)
 {
-	ctx->file = file;
+	ctx->reader = reader;
 }
 
 void ncsd_set_size(ncsd_context* ctx, u64 size)
@@ -58,17 +58,40 @@ u64 ncsd_get_mediaunit_size(ncsd_context* ctx)
 	return mediaunitsize;
 }
 
-void ncsd_process(ncsd_context* ctx, u32 actions)
+/*
+ * Read the header and point the NCCH context at the selected partition.
+ * Nothing beyond the header is read. Returns 0 if the header is unusable
+ * or the partition does not exist.
+ */
+int ncsd_setup(ncsd_context* ctx)
 {
-	fseeko64(ctx->file, ctx->offset, SEEK_SET);
-	fread(&ctx->header, 1, 0x200, ctx->file);
+	reader_read_at(ctx->reader, ctx->offset, &ctx->header, 0x200);
 
 	if (getle32(ctx->header.magic) != MAGIC_NCSD)
 	{
-		fprintf(stdout, "Error, NCSD segment corrupted\n");
-		return;
+		fprintf(stderr, "Error, NCSD segment corrupted\n");
+		return 0;
 	}
 
+	if(ctx->ncch_index > 7 || ctx->header.partitiongeometry[ctx->ncch_index].size == 0)
+	{
+		fprintf(stderr," ERROR NCSD partition %d, does not exist\n",ctx->ncch_index);
+		return 0;
+	}
+
+	ncch_init(&ctx->ncch);
+	ncch_set_reader(&ctx->ncch, ctx->reader);
+	ncch_set_offset(&ctx->ncch, ctx->header.partitiongeometry[ctx->ncch_index].offset * ncsd_get_mediaunit_size(ctx));
+	ncch_set_size(&ctx->ncch, ctx->header.partitiongeometry[ctx->ncch_index].size * ncsd_get_mediaunit_size(ctx));
+	ncch_set_usersettings(&ctx->ncch, ctx->usersettings);
+	return 1;
+}
+
+int ncsd_process(ncsd_context* ctx, u32 actions)
+{
+	if (!ncsd_setup(ctx))
+		return 0;
+
 
 	if (actions & VerifyFlag)
 	{
@@ -79,17 +102,7 @@ void ncsd_process(ncsd_context* ctx, u32 actions)
 	if (actions & InfoFlag)
 		ncsd_print(ctx);
 
-	if(ctx->ncch_index > 7 || ctx->header.partitiongeometry[ctx->ncch_index].size == 0)
-	{
-		fprintf(stderr," ERROR NCSD partition %d, does not exist\n",ctx->ncch_index);
-		return;
-	}
-		
-	ncch_set_file(&ctx->ncch, ctx->file);
-	ncch_set_offset(&ctx->ncch, ctx->header.partitiongeometry[ctx->ncch_index].offset * ncsd_get_mediaunit_size(ctx));
-	ncch_set_size(&ctx->ncch, ctx->header.partitiongeometry[ctx->ncch_index].size * ncsd_get_mediaunit_size(ctx));
-	ncch_set_usersettings(&ctx->ncch, ctx->usersettings);
-	ncch_process(&ctx->ncch, actions);
+	return ncch_process(&ctx->ncch, actions);
 }
 
 const char* ncsd_print_mediatype(u8 type)
@@ -171,6 +171,60 @@ char* strcopy_UTF16toUTF8(const utf16char_t *src)
 }
 #endif
 
+/*
+ * Convert len UTF16 units into the native encoding without allocating.
+ * dst must hold len * OS_UTF16_MAXCHARS chars; no terminator is written.
+ * Returns the number of chars written.
+ */
+uint32_t os_ConvertUTF16Str(oschar_t *dst, const utf16char_t *src, uint32_t len)
+{
+#ifdef _WIN32
+	memcpy(dst, src, len * sizeof(utf16char_t));
+	return len;
+#else
+	uint32_t i, out = 0;
+	uint32_t code;
+
+	for (i = 0; i < len; i++)
+	{
+		code = src[i];
+		if (code >= 0xD800 && code < 0xDC00 && i + 1 < len && src[i+1] >= 0xDC00 && src[i+1] < 0xE000)
+		{
+			code = 0x10000 + ((code - 0xD800) << 10) + (src[++i] - 0xDC00);
+		}
+		else if (code >= 0xD800 && code < 0xE000)
+		{
+			code = 0xFFFD; // unpaired surrogate
+		}
+
+		if (code < 0x80)
+		{
+			dst[out++] = (char)code;
+		}
+		else if (code < 0x800)
+		{
+			dst[out++] = (char)(0xC0 | (code >> 6));
+			dst[out++] = (char)(0x80 | (code & 0x3F));
+		}
+		else if (code < 0x10000)
+		{
+			dst[out++] = (char)(0xE0 | (code >> 12));
+			dst[out++] = (char)(0x80 | ((code >> 6) & 0x3F));
+			dst[out++] = (char)(0x80 | (code & 0x3F));
+		}
+		else
+		{
+			dst[out++] = (char)(0xF0 | (code >> 18));
+			dst[out++] = (char)(0x80 | ((code >> 12) & 0x3F));
+			dst[out++] = (char)(0x80 | ((code >> 6) & 0x3F));
+			dst[out++] = (char)(0x80 | (code & 0x3F));
+		}
+	}
+
+	return out;
+#endif
+}
+
 oschar_t* os_AppendToPath(const oschar_t *src, const oschar_t *add)
 {
 	uint32_t len;
@@ -82,6 +82,8 @@ uint32_t utf16_strlen(const utf16char_t* str);
 void utf16_fputs(const utf16char_t *str, FILE *out);
 
 /* String Copy and Conversion */
+#define OS_UTF16_MAXCHARS 3 // native chars one UTF16 unit can expand to
+uint32_t os_ConvertUTF16Str(oschar_t *dst, const utf16char_t *src, uint32_t len);
 char* strcopy_8to8(const char *src);
 utf16char_t* strcopy_8to16(const char *src);
 utf16char_t* strcopy_16to16(const utf16char_t *src);
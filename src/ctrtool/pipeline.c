@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define PIPELINE_URING
+#endif
+#endif
+#endif
+
+#include "types.h"
+#include "utils.h"
+#include "pipeline.h"
+
+enum pipelinestate
+{
+	PIPELINE_FREE,
+	PIPELINE_READING,
+	PIPELINE_READ,
+	PIPELINE_WRITING,
+};
+
+typedef struct
+{
+	u8* buffer;
+	const u8* input;
+	const u8* output;
+	u32 size;
+	u32 done;
+	int state;
+} pipeline_slot;
+
+typedef struct
+{
+	const reader_context* reader;
+	u64 offset;
+	u64 size;
+	FILE* fout;
+	pipeline_func func;
+	void* arg;
+	u32 chunkcount;
+	int failed;
+	pipeline_slot slot[PIPELINE_DEPTH];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} pipeline_job;
+
+
+static u32 pipeline_chunk_size(pipeline_job* job, u32 chunk)
+{
+	u64 left = job->size - (u64)chunk * PIPELINE_CHUNK_SIZE;
+
+	return (left > PIPELINE_CHUNK_SIZE)? PIPELINE_CHUNK_SIZE : (u32) left;
+}
+
+/*
+ * Point a slot at its chunk. Mapped input needs no read at all, the
+ * transform or the write then work straight from the mapping.
+ */
+static int pipeline_prepare(pipeline_job* job, pipeline_slot* slot, u32 chunk)
+{
+	u64 offset = job->offset + (u64)chunk * PIPELINE_CHUNK_SIZE;
+
+	slot->size = pipeline_chunk_size(job, chunk);
+	slot->done = 0;
+	slot->input = reader_get(job->reader, offset, slot->size);
+	if (slot->input)
+		return 1;
+
+	slot->input = slot->buffer;
+	return 0;
+}
+
+static void pipeline_transform(pipeline_job* job, pipeline_slot* slot)
+{
+	if (job->func)
+	{
+		job->func(job->arg, slot->input, slot->buffer, slot->size);
+		slot->output = slot->buffer;
+	}
+	else
+	{
+		slot->output = slot->input;
+	}
+}
+
+/*
+ * Plain loop without any overlap, used for copies of a single chunk and
+ * whenever neither of the asynchronous engines can be started.
+ */
+static int pipeline_copy_sync(pipeline_job* job)
+{
+	pipeline_slot* slot = job->slot;
+	u32 chunk;
+
+	for(chunk=0; chunk<job->chunkcount; chunk++)
+	{
+		if (!pipeline_prepare(job, slot, chunk))
+		{
+			if (slot->size != reader_read_at(job->reader, job->offset + (u64)chunk * PIPELINE_CHUNK_SIZE, slot->buffer, slot->size))
+			{
+				fprintf(stderr, "Error reading input file\n");
+				return 0;
+			}
+		}
+
+		pipeline_transform(job, slot);
+
+		if (slot->size != fwrite(slot->output, 1, slot->size, job->fout))
+		{
+			fprintf(stderr, "Error writing output file\n");
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+#ifdef PIPELINE_URING
+typedef struct
+{
+	int fd;
+	u8* sqring;
+	size_t sqringsize;
+	u8* cqring;
+	size_t cqringsize;
+	struct io_uring_sqe* sqes;
+	size_t sqessize;
+	u32* sqtail;
+	u32* sqarray;
+	u32 sqmask;
+	u32* cqhead;
+	u32* cqtail;
+	u32 cqmask;
+	struct io_uring_cqe* cqes;
+	u32 pending;
+	u32 inflight;
+	struct iovec iov[PIPELINE_DEPTH];
+} pipeline_uring;
+
+static void pipeline_uring_close(pipeline_uring* ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqessize);
+	if (ring->cqring && ring->cqring != ring->sqring)
+		munmap(ring->cqring, ring->cqringsize);
+	if (ring->sqring)
+		munmap(ring->sqring, ring->sqringsize);
+	if (ring->fd >= 0)
+		close(ring->fd);
+}
+
+/*
+ * Set up a ring with raw system calls, so no liburing is needed. Fails on
+ * kernels without io_uring or where it is disabled by policy.
+ */
+static int pipeline_uring_open(pipeline_uring* ring)
+{
+	struct io_uring_params params;
+	void* map;
+
+	memset(ring, 0, sizeof(pipeline_uring));
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = (int) syscall(__NR_io_uring_setup, PIPELINE_DEPTH, &params);
+	if (ring->fd < 0)
+		return 0;
+
+	ring->sqringsize = params.sq_off.array + params.sq_entries * sizeof(u32);
+	ring->cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cqringsize > ring->sqringsize)
+			ring->sqringsize = ring->cqringsize;
+		ring->cqringsize = ring->sqringsize;
+	}
+
+	map = mmap(NULL, ring->sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED)
+		goto fail;
+	ring->sqring = map;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->cqring = ring->sqring;
+	}
+	else
+	{
+		map = mmap(NULL, ring->cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (map == MAP_FAILED)
+			goto fail;
+		ring->cqring = map;
+	}
+
+	ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+	map = mmap(NULL, ring->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (map == MAP_FAILED)
+		goto fail;
+	ring->sqes = map;
+
+	ring->sqtail = (u32*)(ring->sqring + params.sq_off.tail);
+	ring->sqarray = (u32*)(ring->sqring + params.sq_off.array);
+	ring->sqmask = *(u32*)(ring->sqring + params.sq_off.ring_mask);
+	ring->cqhead = (u32*)(ring->cqring + params.cq_off.head);
+	ring->cqtail = (u32*)(ring->cqring + params.cq_off.tail);
+	ring->cqmask = *(u32*)(ring->cqring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(ring->cqring + params.cq_off.cqes);
+
+	return 1;
+
+fail:
+	pipeline_uring_close(ring);
+	return 0;
+}
+
+static void pipeline_uring_queue(pipeline_uring* ring, u8 opcode, int fd, u32 index, const u8* data, u32 size, u64 offset)
+{
+	u32 tail = *ring->sqtail;
+	u32 pos = tail & ring->sqmask;
+	struct io_uring_sqe* sqe = ring->sqes + pos;
+
+	ring->iov[index].iov_base = (void*) data;
+	ring->iov[index].iov_len = size;
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (u64)(uintptr_t)&ring->iov[index];
+	sqe->len = 1;
+	sqe->off = offset;
+	sqe->user_data = index;
+
+	ring->sqarray[pos] = pos;
+	__atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+
+	ring->pending++;
+	ring->inflight++;
+}
+
+static int pipeline_uring_enter(pipeline_uring* ring)
+{
+	long result;
+
+	do
+	{
+		result = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	}
+	while(result < 0 && errno == EINTR);
+
+	if (result < 0)
+		return 0;
+
+	ring->pending -= (u32) result;
+	return 1;
+}
+
+static void pipeline_uring_read(pipeline_uring* ring, pipeline_job* job, u32 index, u32 chunk, int infd)
+{
+	pipeline_slot* slot = job->slot + index;
+	u64 offset = job->offset + (u64)chunk * PIPELINE_CHUNK_SIZE + slot->done;
+
+	pipeline_uring_queue(ring, IORING_OP_READV, infd, index, slot->buffer + slot->done, slot->size - slot->done, offset);
+}
+
+static void pipeline_uring_write(pipeline_uring* ring, pipeline_job* job, u32 index, u32 chunk, int outfd, u64 outbase)
+{
+	pipeline_slot* slot = job->slot + index;
+	u64 offset = outbase + (u64)chunk * PIPELINE_CHUNK_SIZE + slot->done;
+
+	pipeline_uring_queue(ring, IORING_OP_WRITEV, outfd, index, slot->output + slot->done, slot->size - slot->done, offset);
+}
+
+/*
+ * Keep up to PIPELINE_DEPTH chunks in flight. Chunk n lives in slot
+ * n % PIPELINE_DEPTH; its read is queued as soon as the slot is free, it
+ * is transformed once the read completes and all earlier chunks have been
+ * transformed, and its write then runs while later chunks are processed.
+ * Short reads and writes are resubmitted for the remainder.
+ */
+static int pipeline_copy_uring(pipeline_job* job)
+{
+	pipeline_uring ring;
+	int infd = fileno(job->reader->file);
+	int outfd;
+	u64 outbase;
+	u32 nextread = 0;
+	u32 nexttransform = 0;
+	u32 chunkwritten = 0;
+	u32 chunk[PIPELINE_DEPTH];
+	u32 i;
+
+	if (fflush(job->fout) != 0)
+		return -1;
+
+	outfd = fileno(job->fout);
+	outbase = (u64) ftello64(job->fout);
+	if (lseek64(outfd, 0, SEEK_CUR) < 0 || lseek64(infd, 0, SEEK_CUR) < 0)
+		return -1;
+
+	if (!pipeline_uring_open(&ring))
+		return -1;
+
+	while(chunkwritten < job->chunkcount && !job->failed)
+	{
+		while(nextread < job->chunkcount && job->slot[nextread % PIPELINE_DEPTH].state == PIPELINE_FREE)
+		{
+			i = nextread % PIPELINE_DEPTH;
+			chunk[i] = nextread++;
+
+			if (pipeline_prepare(job, job->slot + i, chunk[i]))
+			{
+				job->slot[i].state = PIPELINE_READ;
+			}
+			else
+			{
+				job->slot[i].state = PIPELINE_READING;
+				pipeline_uring_read(&ring, job, i, chunk[i], infd);
+			}
+		}
+
+		while(nexttransform < nextread && job->slot[nexttransform % PIPELINE_DEPTH].state == PIPELINE_READ)
+		{
+			i = nexttransform % PIPELINE_DEPTH;
+			nexttransform++;
+
+			pipeline_transform(job, job->slot + i);
+			job->slot[i].done = 0;
+			job->slot[i].state = PIPELINE_WRITING;
+			pipeline_uring_write(&ring, job, i, chunk[i], outfd, outbase);
+		}
+
+		if (ring.inflight == 0)
+			continue;
+
+		if (!pipeline_uring_enter(&ring))
+		{
+			fprintf(stderr, "Error, io_uring submission failed\n");
+			job->failed = 1;
+			break;
+		}
+
+		while(*ring.cqhead != __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe* cqe = ring.cqes + (*ring.cqhead & ring.cqmask);
+			pipeline_slot* slot;
+			s32 result = cqe->res;
+
+			i = (u32) cqe->user_data;
+			slot = job->slot + i;
+			__atomic_store_n(ring.cqhead, *ring.cqhead + 1, __ATOMIC_RELEASE);
+			ring.inflight--;
+
+			if (job->failed)
+				continue;
+
+			if (result <= 0)
+			{
+				if (slot->state == PIPELINE_READING)
+					fprintf(stderr, "Error reading input file\n");
+				else
+					fprintf(stderr, "Error writing output file\n");
+				job->failed = 1;
+				continue;
+			}
+
+			slot->done += (u32) result;
+			if (slot->state == PIPELINE_READING)
+			{
+				if (slot->done < slot->size)
+					pipeline_uring_read(&ring, job, i, chunk[i], infd);
+				else
+					slot->state = PIPELINE_READ;
+			}
+			else
+			{
+				if (slot->done < slot->size)
+				{
+					pipeline_uring_write(&ring, job, i, chunk[i], outfd, outbase);
+				}
+				else
+				{
+					slot->state = PIPELINE_FREE;
+					chunkwritten++;
+				}
+			}
+		}
+	}
+
+	// buffers must outlive every request the kernel still holds
+	while(ring.inflight && pipeline_uring_enter(&ring))
+	{
+		while(*ring.cqhead != __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE))
+		{
+			__atomic_store_n(ring.cqhead, *ring.cqhead + 1, __ATOMIC_RELEASE);
+			ring.inflight--;
+		}
+	}
+
+	pipeline_uring_close(&ring);
+
+	if (job->failed)
+		return 0;
+
+	fseeko64(job->fout, outbase + job->size, SEEK_SET);
+	return 1;
+}
+#endif
+
+/*
+ * Wait for a slot to reach state. Returns 0 once any thread has failed;
+ * failed is only ever looked at under the lock.
+ */
+static int pipeline_wait(pipeline_job* job, pipeline_slot* slot, int state)
+{
+	int result;
+
+	pthread_mutex_lock(&job->lock);
+	while(slot->state != state && !job->failed)
+		pthread_cond_wait(&job->cond, &job->lock);
+	result = !job->failed;
+	pthread_mutex_unlock(&job->lock);
+	return result;
+}
+
+static void pipeline_post(pipeline_job* job, pipeline_slot* slot, int state, int failed)
+{
+	pthread_mutex_lock(&job->lock);
+	slot->state = state;
+	if (failed)
+		job->failed = 1;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void* pipeline_reader_main(void* param)
+{
+	pipeline_job* job = (pipeline_job*) param;
+	u32 chunk;
+
+	for(chunk=0; chunk<job->chunkcount; chunk++)
+	{
+		pipeline_slot* slot = job->slot + chunk % PIPELINE_DEPTH;
+		int failed = 0;
+
+		if (!pipeline_wait(job, slot, PIPELINE_FREE))
+			break;
+
+		if (!pipeline_prepare(job, slot, chunk))
+		{
+			if (slot->size != reader_read_at(job->reader, job->offset + (u64)chunk * PIPELINE_CHUNK_SIZE, slot->buffer, slot->size))
+			{
+				fprintf(stderr, "Error reading input file\n");
+				failed = 1;
+			}
+		}
+
+		pipeline_post(job, slot, PIPELINE_READ, failed);
+	}
+
+	return NULL;
+}
+
+static void* pipeline_writer_main(void* param)
+{
+	pipeline_job* job = (pipeline_job*) param;
+	u32 chunk;
+
+	for(chunk=0; chunk<job->chunkcount; chunk++)
+	{
+		pipeline_slot* slot = job->slot + chunk % PIPELINE_DEPTH;
+		int failed = 0;
+
+		if (!pipeline_wait(job, slot, PIPELINE_WRITING))
+			break;
+
+		if (slot->size != fwrite(slot->output, 1, slot->size, job->fout))
+		{
+			fprintf(stderr, "Error writing output file\n");
+			failed = 1;
+		}
+
+		pipeline_post(job, slot, PIPELINE_FREE, failed);
+	}
+
+	return NULL;
+}
+
+/*
+ * Portable fallback: a reader thread and a writer thread run ahead of and
+ * behind the calling thread, which does the transforms in stream order.
+ */
+static int pipeline_copy_threaded(pipeline_job* job)
+{
+	pthread_t readthread;
+	pthread_t writethread;
+	u32 chunk;
+
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, NULL);
+
+	if (pthread_create(&readthread, NULL, pipeline_reader_main, job) != 0)
+		goto fail;
+
+	if (pthread_create(&writethread, NULL, pipeline_writer_main, job) != 0)
+	{
+		pipeline_post(job, job->slot, PIPELINE_FREE, 1);
+		pthread_join(readthread, NULL);
+		goto fail;
+	}
+
+	for(chunk=0; chunk<job->chunkcount; chunk++)
+	{
+		pipeline_slot* slot = job->slot + chunk % PIPELINE_DEPTH;
+
+		if (!pipeline_wait(job, slot, PIPELINE_READ))
+			break;
+
+		pipeline_transform(job, slot);
+		pipeline_post(job, slot, PIPELINE_WRITING, 0);
+	}
+
+	// both helpers are joined, so failed can be read without the lock
+	pthread_join(readthread, NULL);
+	pthread_join(writethread, NULL);
+
+	pthread_cond_destroy(&job->cond);
+	pthread_mutex_destroy(&job->lock);
+
+	return !job->failed;
+
+fail:
+	pthread_cond_destroy(&job->cond);
+	pthread_mutex_destroy(&job->lock);
+
+	// nothing was written yet, so the plain loop can still do the copy
+	job->failed = 0;
+	job->slot[0].state = PIPELINE_FREE;
+	return pipeline_copy_sync(job);
+}
+
+/*
+ * Copy size bytes at offset of the input to the current position of fout,
+ * passing every chunk through func on the way. Reads, transforms and
+ * writes of different chunks overlap, using io_uring where the kernel
+ * offers it and helper threads elsewhere. Returns 1 on success.
+ */
+int pipeline_copy(const reader_context* reader, u64 offset, u64 size, FILE* fout, pipeline_func func, void* arg)
+{
+	pipeline_job job;
+	u32 slotcount;
+	u32 i;
+	int result = 0;
+
+	if (size == 0)
+		return 1;
+
+	memset(&job, 0, sizeof(pipeline_job));
+	job.reader = reader;
+	job.offset = offset;
+	job.size = size;
+	job.fout = fout;
+	job.func = func;
+	job.arg = arg;
+	job.chunkcount = (u32)((size + PIPELINE_CHUNK_SIZE - 1) / PIPELINE_CHUNK_SIZE);
+
+	slotcount = (job.chunkcount < PIPELINE_DEPTH)? job.chunkcount : PIPELINE_DEPTH;
+	for(i=0; i<slotcount; i++)
+	{
+		job.slot[i].buffer = malloc(pipeline_chunk_size(&job, i));
+		if (job.slot[i].buffer == NULL)
+		{
+			fprintf(stderr, "Error allocating memory\n");
+			goto clean;
+		}
+	}
+
+	if (job.chunkcount == 1)
+	{
+		result = pipeline_copy_sync(&job);
+		goto clean;
+	}
+
+#ifdef PIPELINE_URING
+	result = pipeline_copy_uring(&job);
+	if (result >= 0)
+		goto clean;
+#endif
+
+	result = pipeline_copy_threaded(&job);
+
+clean:
+	for(i=0; i<slotcount; i++)
+		free(job.slot[i].buffer);
+
+	return result;
+}
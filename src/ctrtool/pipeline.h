@@ -0,0 +1,29 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <stdio.h>
+#include "types.h"
+#include "reader.h"
+
+#define PIPELINE_DEPTH 8
+#define PIPELINE_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Transforms size bytes of input into output, e.g. by decrypting them.
+ * Input and output may be the same buffer. Chunks are always passed in
+ * stream order, so stateful ciphers like CTR and CBC can carry their
+ * counter or IV from one call to the next.
+ */
+typedef void (*pipeline_func)(void* arg, const u8* input, u8* output, u32 size);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int pipeline_copy(const reader_context* reader, u64 offset, u64 size, FILE* fout, pipeline_func func, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PIPELINE_H_
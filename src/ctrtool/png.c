@@ -0,0 +1,448 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "utils.h"
+#include "png.h"
+
+#define PNG_HASH_BITS	15
+#define PNG_WINDOW_SIZE	32768
+#define PNG_MAX_CHAIN	32		// candidates tried per position
+#define PNG_MIN_MATCH	3
+#define PNG_MAX_MATCH	258
+#define PNG_NONE		(~0u)
+
+typedef struct
+{
+	u8* data;
+	u32 size;
+	u32 bitbuffer;
+	u32 bitcount;
+} png_bitstream;
+
+static const u8 png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+static const u32 png_crc_table[16] =
+{
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+static const u16 png_length_base[29] =
+{
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+static const u8 png_length_extra[29] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+static const u16 png_distance_base[30] =
+{
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+
+static const u8 png_distance_extra[30] =
+{
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+
+static u32 png_crc(u32 crc, const u8* data, u32 size)
+{
+	while(size--)
+	{
+		crc ^= *data++;
+		crc = (crc >> 4) ^ png_crc_table[crc & 15];
+		crc = (crc >> 4) ^ png_crc_table[crc & 15];
+	}
+
+	return crc;
+}
+
+static u32 png_adler(const u8* data, u32 size)
+{
+	u32 a = 1;
+	u32 b = 0;
+
+	while(size)
+	{
+		// 5552 bytes is the most that can be summed before b overflows
+		u32 max = size < 5552? size : 5552;
+
+		size -= max;
+		while(max--)
+		{
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+
+	return (b << 16) | a;
+}
+
+static void png_put_bits(png_bitstream* stream, u32 value, u32 count)
+{
+	stream->bitbuffer |= value << stream->bitcount;
+	stream->bitcount += count;
+	while(stream->bitcount >= 8)
+	{
+		stream->data[stream->size++] = stream->bitbuffer & 0xff;
+		stream->bitbuffer >>= 8;
+		stream->bitcount -= 8;
+	}
+}
+
+// Huffman codes are stored most significant bit first, unlike everything else
+static void png_put_code(png_bitstream* stream, u32 code, u32 length)
+{
+	u32 reversed = 0;
+	u32 i;
+
+	for(i=0; i<length; i++)
+	{
+		reversed = (reversed << 1) | (code & 1);
+		code >>= 1;
+	}
+
+	png_put_bits(stream, reversed, length);
+}
+
+static void png_put_symbol(png_bitstream* stream, u32 symbol)
+{
+	if (symbol < 144)
+		png_put_code(stream, 0x30 + symbol, 8);
+	else if (symbol < 256)
+		png_put_code(stream, 0x190 + symbol - 144, 9);
+	else if (symbol < 280)
+		png_put_code(stream, symbol - 256, 7);
+	else
+		png_put_code(stream, 0xC0 + symbol - 280, 8);
+}
+
+static void png_put_match(png_bitstream* stream, u32 length, u32 distance)
+{
+	u32 i = 28;
+
+	while(png_length_base[i] > length)
+		i--;
+	png_put_symbol(stream, 257 + i);
+	png_put_bits(stream, length - png_length_base[i], png_length_extra[i]);
+
+	i = 29;
+	while(png_distance_base[i] > distance)
+		i--;
+	png_put_code(stream, i, 5);
+	png_put_bits(stream, distance - png_distance_base[i], png_distance_extra[i]);
+}
+
+static u32 png_hash(const u8* data)
+{
+	return ((data[0] << 10) ^ (data[1] << 5) ^ data[2]) & ((1 << PNG_HASH_BITS) - 1);
+}
+
+/*
+ * Compress input as a single deflate block with the fixed Huffman codes.
+ * Thumbnails are small, so a dynamic code table would save little.
+ */
+static int png_deflate(png_bitstream* stream, const u8* input, u32 size)
+{
+	u32* head = malloc((1 << PNG_HASH_BITS) * sizeof(u32));
+	u32* prev = malloc(PNG_WINDOW_SIZE * sizeof(u32));
+	u32 position = 0;
+	u32 i;
+
+	if (head == NULL || prev == NULL)
+	{
+		free(head);
+		free(prev);
+		return 0;
+	}
+
+	for(i=0; i<(1 << PNG_HASH_BITS); i++)
+		head[i] = PNG_NONE;
+
+	// BFINAL, then BTYPE 01
+	png_put_bits(stream, 1, 1);
+	png_put_bits(stream, 1, 2);
+
+	while(position < size)
+	{
+		u32 bestlength = 0;
+		u32 bestdistance = 0;
+		u32 advance;
+
+		if (size - position >= PNG_MIN_MATCH)
+		{
+			u32 maxlength = size - position < PNG_MAX_MATCH? size - position : PNG_MAX_MATCH;
+			u32 candidate = head[png_hash(input + position)];
+			u32 chain = PNG_MAX_CHAIN;
+
+			while(candidate != PNG_NONE && position - candidate <= PNG_WINDOW_SIZE && chain--)
+			{
+				u32 length = 0;
+				u32 next;
+
+				while(length < maxlength && input[candidate + length] == input[position + length])
+					length++;
+
+				if (length > bestlength)
+				{
+					bestlength = length;
+					bestdistance = position - candidate;
+					if (length == maxlength)
+						break;
+				}
+
+				// the slot may already hold a newer position, which ends the chain
+				next = prev[candidate % PNG_WINDOW_SIZE];
+				if (next != PNG_NONE && next >= candidate)
+					break;
+				candidate = next;
+			}
+		}
+
+		if (bestlength >= PNG_MIN_MATCH)
+		{
+			png_put_match(stream, bestlength, bestdistance);
+			advance = bestlength;
+		}
+		else
+		{
+			png_put_symbol(stream, input[position]);
+			advance = 1;
+		}
+
+		while(advance--)
+		{
+			if (size - position >= PNG_MIN_MATCH)
+			{
+				u32 hash = png_hash(input + position);
+
+				prev[position % PNG_WINDOW_SIZE] = head[hash];
+				head[hash] = position;
+			}
+			position++;
+		}
+	}
+
+	png_put_symbol(stream, 256);
+	if (stream->bitcount)
+		png_put_bits(stream, 0, 8 - stream->bitcount);
+
+	free(head);
+	free(prev);
+	return 1;
+}
+
+static u8 png_paeth(u8 a, u8 b, u8 c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	else if (pb <= pc)
+		return b;
+	else
+		return c;
+}
+
+/*
+ * Filter one row with each of the five filters and keep the one with the
+ * smallest sum of signed residuals, the usual libpng heuristic.
+ */
+static void png_filter_row(u8* output, const u8* row, const u8* above, u32 stride, u8* scratch)
+{
+	u32 bestsum = ~0u;
+	u32 filter;
+	u32 i;
+
+	for(filter=0; filter<5; filter++)
+	{
+		u32 sum = 0;
+
+		for(i=0; i<stride; i++)
+		{
+			u8 left = i >= 3? row[i-3] : 0;
+			u8 up = above? above[i] : 0;
+			u8 upleft = (above && i >= 3)? above[i-3] : 0;
+			u8 predicted;
+
+			switch(filter)
+			{
+				case 0: predicted = 0; break;
+				case 1: predicted = left; break;
+				case 2: predicted = up; break;
+				case 3: predicted = (left + up) >> 1; break;
+				default: predicted = png_paeth(left, up, upleft); break;
+			}
+
+			scratch[i] = row[i] - predicted;
+			sum += scratch[i] < 128? scratch[i] : 256 - scratch[i];
+		}
+
+		if (sum < bestsum)
+		{
+			bestsum = sum;
+			output[0] = filter;
+			memcpy(output + 1, scratch, stride);
+		}
+	}
+}
+
+static int png_write_chunk(FILE* file, const char* type, const u8* data, u32 size)
+{
+	u8 length[4];
+	u8 checksum[4];
+	u32 crc;
+
+	putbe32(length, size);
+	crc = png_crc(0xffffffff, (const u8*)type, 4);
+	crc = png_crc(crc, data, size);
+	putbe32(checksum, crc ^ 0xffffffff);
+
+	return fwrite(length, 1, 4, file) == 4 &&
+		   fwrite(type, 1, 4, file) == 4 &&
+		   fwrite(data, 1, size, file) == size &&
+		   fwrite(checksum, 1, 4, file) == 4;
+}
+
+/*
+ * Write a width x height 8-bit RGB image as PNG, with optional tEXt
+ * chunks. Returns 1 on success.
+ */
+int png_write(FILE* file, const u8* rgb, u32 width, u32 height, const png_text* text, u32 textcount)
+{
+	u32 stride = width * 3;
+	u32 rawsize = (stride + 1) * height;
+	u8* raw = malloc(rawsize);
+	u8* scratch = malloc(stride);
+	png_bitstream stream;
+	u8 header[13];
+	int result = 0;
+	u32 i;
+
+	memset(&stream, 0, sizeof(png_bitstream));
+
+	// a match never costs more than 31 bits, so this is enough for the worst case
+	stream.data = malloc(rawsize + rawsize / 2 + 64);
+
+	if (raw == NULL || scratch == NULL || stream.data == NULL)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		goto clean;
+	}
+
+	for(i=0; i<height; i++)
+		png_filter_row(raw + i * (stride + 1), rgb + i * stride, i? rgb + (i - 1) * stride : NULL, stride, scratch);
+
+	// zlib header: deflate with a 32 KiB window, no preset dictionary
+	stream.data[stream.size++] = 0x78;
+	stream.data[stream.size++] = 0x01;
+	if (!png_deflate(&stream, raw, rawsize))
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		goto clean;
+	}
+	putbe32(stream.data + stream.size, png_adler(raw, rawsize));
+	stream.size += 4;
+
+	putbe32(header, width);
+	putbe32(header + 4, height);
+	header[8] = 8;		// bit depth
+	header[9] = 2;		// truecolour
+	header[10] = 0;		// deflate
+	header[11] = 0;		// adaptive filtering
+	header[12] = 0;		// no interlace
+
+	if (fwrite(png_signature, 1, 8, file) != 8 || !png_write_chunk(file, "IHDR", header, sizeof(header)))
+		goto clean;
+
+	for(i=0; i<textcount; i++)
+	{
+		u32 keywordsize = (u32)strlen(text[i].keyword) + 1;
+		u32 textsize = (u32)strlen(text[i].text);
+		u8* chunk = malloc(keywordsize + textsize);
+
+		if (chunk == NULL)
+			goto clean;
+		memcpy(chunk, text[i].keyword, keywordsize);
+		memcpy(chunk + keywordsize, text[i].text, textsize);
+		if (!png_write_chunk(file, "tEXt", chunk, keywordsize + textsize))
+		{
+			free(chunk);
+			goto clean;
+		}
+		free(chunk);
+	}
+
+	if (!png_write_chunk(file, "IDAT", stream.data, stream.size) || !png_write_chunk(file, "IEND", NULL, 0))
+		goto clean;
+
+	result = 1;
+
+clean:
+	free(raw);
+	free(scratch);
+	free(stream.data);
+	return result;
+}
+
+/*
+ * Look up a tEXt chunk by keyword in the PNG at file, e.g. to check the
+ * metadata of a cached thumbnail. Only chunks before the image data are
+ * read. Returns 1 and the NUL terminated text if found.
+ */
+int png_read_text(FILE* file, const char* keyword, char* value, u32 size)
+{
+	u32 keywordsize = (u32)strlen(keyword) + 1;
+	u8 header[8];
+	char* chunk;
+
+	if (fread(header, 1, 8, file) != 8 || memcmp(header, png_signature, 8) != 0)
+		return 0;
+
+	while(fread(header, 1, 8, file) == 8)
+	{
+		u32 length = getbe32(header);
+
+		if (memcmp(header + 4, "IDAT", 4) == 0 || memcmp(header + 4, "IEND", 4) == 0)
+			break;
+
+		if (memcmp(header + 4, "tEXt", 4) != 0 || length < keywordsize || length - keywordsize >= size)
+		{
+			if (fseek(file, length + 4, SEEK_CUR) != 0)
+				break;
+			continue;
+		}
+
+		chunk = malloc(length);
+		if (chunk == NULL || fread(chunk, 1, length, file) != length || fseek(file, 4, SEEK_CUR) != 0)
+		{
+			free(chunk);
+			break;
+		}
+
+		if (memcmp(chunk, keyword, keywordsize) == 0)
+		{
+			memcpy(value, chunk + keywordsize, length - keywordsize);
+			value[length - keywordsize] = 0;
+			free(chunk);
+			return 1;
+		}
+		free(chunk);
+	}
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef _PNG_H_
+#define _PNG_H_
+
+#include <stdio.h>
+#include "types.h"
+
+typedef struct
+{
+	const char* keyword;
+	const char* text;
+} png_text;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int png_write(FILE* file, const u8* rgb, u32 width, u32 height, const png_text* text, u32 textcount);
+int png_read_text(FILE* file, const char* keyword, char* value, u32 size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PNG_H_
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "utils.h"
+#include "reader.h"
+
+/*
+ * The file is identified by device and inode, so state keyed on it (the
+ * block cache) cannot be picked up by another file that later reuses
+ * the same FILE pointer. Where there are no inode numbers every reader
+ * gets an identity of its own.
+ */
+void reader_init(reader_context* ctx, FILE* file, const mapfile* map)
+{
+	static u64 lastid = 0;
+	struct stat filestat;
+
+	ctx->file = file;
+	ctx->map = map;
+
+	if (file && fstat(fileno(file), &filestat) == 0 && filestat.st_ino != 0)
+	{
+		ctx->device = (u64) filestat.st_dev;
+		ctx->inode = (u64) filestat.st_ino;
+	}
+	else
+	{
+		ctx->device = ~0ULL;
+		ctx->inode = __sync_add_and_fetch(&lastid, 1);
+	}
+}
+
+/*
+ * Read size bytes at an absolute offset. Copies out of the mapping when
+ * the range is mapped and uses pread otherwise. Returns the number of
+ * bytes read.
+ */
+size_t reader_read_at(const reader_context* ctx, u64 offset, void* buffer, size_t size)
+{
+	const u8* data = mapfile_get(ctx->map, offset, size);
+
+	if (data)
+	{
+		memcpy(buffer, data, size);
+		return size;
+	}
+
+	return fpread(ctx->file, buffer, size, offset);
+}
+
+/*
+ * Direct view of a mapped range, or NULL when the input is not mapped and
+ * the caller has to go through reader_read_at.
+ */
+const u8* reader_get(const reader_context* ctx, u64 offset, u64 size)
+{
+	return mapfile_get(ctx->map, offset, size);
+}
+
+void reader_advise(const reader_context* ctx, u64 offset, u64 size, int advice)
+{
+	mapfile_advise(ctx->map, offset, size, advice);
+}
@@ -0,0 +1,34 @@
+#ifndef _READER_H_
+#define _READER_H_
+
+#include <stdio.h>
+#include "types.h"
+#include "mapfile.h"
+
+/*
+ * Positional input shared by the container parsers. There is no cursor:
+ * every read names its own offset, so any number of contexts and threads
+ * can read the same image at once.
+ */
+typedef struct
+{
+	FILE* file;
+	const mapfile* map;
+	u64 device;		// identity of the file, stable for as long as it is open
+	u64 inode;
+} reader_context;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void reader_init(reader_context* ctx, FILE* file, const mapfile* map);
+size_t reader_read_at(const reader_context* ctx, u64 offset, void* buffer, size_t size);
+const u8* reader_get(const reader_context* ctx, u64 offset, u64 size);
+void reader_advise(const reader_context* ctx, u64 offset, u64 size, int advice);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _READER_H_
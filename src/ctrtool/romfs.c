@@ -3,6 +3,22 @@
 #include "types.h"
 #include "romfs.h"
 #include "utils.h"
+#include "pipeline.h"
+#include "worker.h"
+#include "cache.h"
+
+typedef struct
+{
+	u32 entry;
+	u64 offset;
+	u32 size;
+} romfs_extract_chunk;
+
+typedef struct
+{
+	romfs_context* ctx;
+	romfs_extract_chunk* chunks;
+} romfs_extract_job;
 
 void romfs_init(romfs_context* ctx)
 {
@@ -10,9 +26,9 @@ void romfs_init(romfs_context* ctx)
 	ivfc_init(&ctx->ivfc);
 }
 
-void romfs_set_file(romfs_context* ctx, FILE* file)
+void romfs_set_reader(romfs_context* ctx, const reader_context* reader)
 {
-	ctx->file = file;
+	ctx->reader = reader;
 }
 
 void romfs_set_offset(romfs_context* ctx, u64 offset)
@@ -49,7 +65,8 @@ void romfs_set_counter(romfs_context* ctx, u8 counter[16])
 void romfs_fseek(romfs_context* ctx, u64 offset)
 {
 	u64 data_pos = offset - ctx->offset;
-	fseeko64(ctx->file, offset, SEEK_SET);
+
+	ctx->position = offset;
 
 	if (ctx->encrypted) {
 		ctr_init_counter(&ctx->aes, ctx->counter);
@@ -60,17 +77,55 @@ void romfs_fseek(romfs_context* ctx, u64 offset)
 size_t romfs_fread(romfs_context* ctx, void* buffer, size_t size, size_t count)
 {
 	size_t read;
-	if ((read = fread(buffer, size, count, ctx->file)) != count) {
-		//printf("romfs_fread() fail\n");
-		return read;
+	const u8* src;
+	cache_region region;
+
+	// encrypted reads go through the shared cache, which also serves IVFC
+	if (ctx->encrypted)
+	{
+		cache_region_init(&region, ctx->reader, ctx->offset, ctx->size, CACHE_CRYPTO_CTR, ctx->key, ctx->counter);
+		if (!cache_read(&region, ctx->position - ctx->offset, buffer, (u64)size*count))
+			return 0;
+		ctx->position += size*count;
+		return count;
 	}
-	if (ctx->encrypted) {
-		ctr_crypt_counter(&ctx->aes, buffer, buffer, size*read);
+
+	src = reader_get(ctx->reader, ctx->position, (u64)size*count);
+	if (src)
+	{
+		memcpy(buffer, src, size*count);
+		ctx->position += size*count;
+		return count;
 	}
+
+	read = reader_read_at(ctx->reader, ctx->position, buffer, size*count) / size;
+	ctx->position += size*read;
 	return read;
 }
 
-void romfs_process(romfs_context* ctx, u32 actions)
+/*
+ * Copy one section of the info block, or return NULL (and a zero size)
+ * when it is empty or does not lie within the block.
+ */
+static u8* romfs_copy_section(const u8* block, u32 blocksize, const romfs_sectionheader* section, u32* size)
+{
+	u32 offset = getle32(section->offset);
+	u8* data;
+
+	*size = 0;
+	if (block == NULL || offset > blocksize || getle32(section->size) > blocksize - offset || getle32(section->size) == 0)
+		return NULL;
+
+	data = malloc(getle32(section->size));
+	if (data == NULL)
+		return NULL;
+
+	memcpy(data, block + offset, getle32(section->size));
+	*size = getle32(section->size);
+	return data;
+}
+
+int romfs_process(romfs_context* ctx, u32 actions)
 {
 	u32 dirblockoffset = 0;
 	u32 dirblocksize = 0;
@@ -79,7 +134,7 @@ void romfs_process(romfs_context* ctx, u32 actions)
 
 	ivfc_set_offset(&ctx->ivfc, ctx->offset);
 	ivfc_set_size(&ctx->ivfc, ctx->size);
-	ivfc_set_file(&ctx->ivfc, ctx->file);
+	ivfc_set_reader(&ctx->ivfc, ctx->reader);
 	ivfc_set_usersettings(&ctx->ivfc, ctx->usersettings);
 	ivfc_set_counter(&ctx->ivfc, ctx->counter);
 	ivfc_set_key(&ctx->ivfc, ctx->key);
@@ -92,7 +147,7 @@ void romfs_process(romfs_context* ctx, u32 actions)
 	if (getle32(ctx->header.magic) != MAGIC_IVFC)
 	{
 		fprintf(stdout, "Error, RomFS corrupted\n");
-		return;
+		return 0;
 	}
 
 	ctx->infoblockoffset = (u32) (ctx->offset + 0x1000);
@@ -103,7 +158,7 @@ void romfs_process(romfs_context* ctx, u32 actions)
 	if (getle32(ctx->infoheader.headersize) != sizeof(romfs_infoheader))
 	{
 		fprintf(stderr, "Error, info header mismatch\n");
-		return;
+		return 0;
 	}
 
 	dirblockoffset = ctx->infoblockoffset + getle32(ctx->infoheader.section[1].offset);
@@ -114,22 +169,42 @@ void romfs_process(romfs_context* ctx, u32 actions)
 	u32 hdrsize = getle32(ctx->infoheader.dataoffset);
 	u8 *block = malloc(hdrsize);
 	romfs_fseek(ctx, ctx->infoblockoffset);
-	romfs_fread(ctx, block, hdrsize, 1);
+	if (block == NULL || romfs_fread(ctx, block, hdrsize, 1) != 1)
+	{
+		fprintf(stderr, "Error, could not read RomFS metadata\n");
+		free(block);
+		block = NULL;
+	}
 
-	ctx->dirblock = malloc(dirblocksize);
+	ctx->dirblock = romfs_copy_section(block, hdrsize, &ctx->infoheader.section[1], &dirblocksize);
 	ctx->dirblocksize = dirblocksize;
-	if(ctx->dirblock)
-		memcpy(ctx->dirblock, block + getle32(ctx->infoheader.section[1].offset), dirblocksize);
 
-	ctx->fileblock = malloc(fileblocksize);
+	ctx->fileblock = romfs_copy_section(block, hdrsize, &ctx->infoheader.section[3], &fileblocksize);
 	ctx->fileblocksize = fileblocksize;
-	if (ctx->fileblock)
-		memcpy(ctx->fileblock, block + getle32(ctx->infoheader.section[3].offset), fileblocksize);
+
+	ctx->dirhashtable = romfs_copy_section(block, hdrsize, &ctx->infoheader.section[0], &ctx->dirhashcount);
+	ctx->dirhashcount /= 4;
+
+	ctx->filehashtable = romfs_copy_section(block, hdrsize, &ctx->infoheader.section[2], &ctx->filehashcount);
+	ctx->filehashcount /= 4;
 
 	free(block);
 
 	ctx->datablockoffset = ctx->infoblockoffset + getle32(ctx->infoheader.dataoffset);
 
+	return romfs_process_tree(ctx, actions);
+}
+
+/*
+ * Everything that works from the loaded metadata blocks alone: info,
+ * listing, lookup and extraction. Also entered from a loaded index,
+ * which fills in the blocks without parsing the image. Returns 0 if a
+ * file asked for with --romfs-file could not be extracted.
+ */
+int romfs_process_tree(romfs_context* ctx, u32 actions)
+{
+	int result = 1;
+
 	if (actions & InfoFlag)
 		romfs_print(ctx);
 
@@ -138,8 +213,64 @@ void romfs_process(romfs_context* ctx, u32 actions)
 	else
 		ctx->extractdir = NULL;
 
-	romfs_visit_dir(ctx, 0, 0, actions, ctx->extractdir);
+	if ((ctx->extractdir || settings_get_romfs_file_path(ctx->usersettings)->valid || settings_get_romfs_tar_path(ctx->usersettings)->valid) &&
+		settings_get_verify_read(ctx->usersettings))
+	{
+		ctx->verifyread = ivfc_verifyread_init(&ctx->ivfc);
+		if (ctx->verifyread)
+			ctx->verifybuffer = malloc(ctx->ivfc.level[2].hashblocksize);
+		if (ctx->verifybuffer == NULL)
+		{
+			fprintf(stderr, "Error, RomFS verify-on-read unavailable, extracting without checks\n");
+			ctx->verifyread = 0;
+		}
+		ctx->verifyblock = IVFC_NO_BLOCK;
+	}
+
+	if (ctx->extractdir || settings_get_romfs_tar_path(ctx->usersettings)->valid)
+		reader_advise(ctx->reader, ctx->datablockoffset, ctx->offset + ctx->size - ctx->datablockoffset, MAPFILE_SEQUENTIAL);
+
+	if (settings_get_romfs_file_path(ctx->usersettings)->valid)
+	{
+		oschar_t* outpath = NULL;
+
+		if (settings_get_romfs_out_path(ctx->usersettings)->valid)
+			outpath = os_CopyConvertCharStr(settings_get_romfs_out_path(ctx->usersettings)->pathname);
+		result = romfs_extract_file(ctx, settings_get_romfs_file_path(ctx->usersettings)->pathname, outpath);
+		free(outpath);
+	}
+
+	romfs_walk(ctx, actions, ctx->extractdir);
+	romfs_plan_extract(ctx);
 	free(ctx->extractdir);
+
+	if (settings_get_romfs_tar_path(ctx->usersettings)->valid)
+	{
+		tar_context tar;
+		struct stat imagestat;
+
+		memset(&imagestat, 0, sizeof(imagestat));
+		fstat(fileno(ctx->reader->file), &imagestat);
+		if (tar_open(&tar, settings_get_romfs_tar_path(ctx->usersettings)->pathname, imagestat.st_mtime))
+		{
+			ctx->tar = &tar;
+			romfs_walk(ctx, actions, NULL);
+			romfs_plan_extract(ctx);
+			ctx->tar = NULL;
+			tar_close(&tar);
+		}
+	}
+
+	if (ctx->verifyread)
+	{
+		fprintf(settings_get_message_file(ctx->usersettings), "RomFS verify-on-read:   %u blocks checked, %u bad (%s)\n", ctx->checkedblocks, ctx->badblocks, ctx->badblocks? "FAIL" : "GOOD");
+		ivfc_verifyread_free(&ctx->ivfc);
+		free(ctx->verifybuffer);
+		ctx->verifybuffer = NULL;
+		ctx->verifyread = 0;
+	}
+
+	return result;
 }
 
 int romfs_dirblock_read(romfs_context* ctx, u32 diroffset, u32 dirsize, void* buffer)
@@ -213,155 +344,513 @@ int romfs_fileblock_readentry(romfs_context* ctx, u32 fileoffset, romfs_fileentr
 
 
 
-void romfs_visit_dir(romfs_context* ctx, u32 diroffset, u32 depth, u32 actions, const oschar_t* rootpath)
+static int romfs_path_reserve(romfs_patharena* arena, u32 extra)
 {
-	u32 siblingoffset;
-	u32 childoffset;
-	u32 fileoffset;
-	oschar_t* currentpath;
-	romfs_direntry* entry = &ctx->direntry;
+	u32 needed = arena->length + extra + 1;
+	u32 capacity = arena->capacity? arena->capacity : 256;
+	oschar_t* data;
 
+	if (needed <= arena->capacity)
+		return 1;
 
-	if (!romfs_dirblock_readentry(ctx, diroffset, entry))
-		return;
+	while(capacity < needed)
+		capacity *= 2;
+
+	data = realloc(arena->data, capacity * sizeof(oschar_t));
+	if (data == NULL)
+		return 0;
+
+	arena->data = data;
+	arena->capacity = capacity;
+	return 1;
+}
+
+static void romfs_path_truncate(romfs_patharena* arena, u32 length)
+{
+	arena->length = length;
+	if (arena->data)
+		arena->data[length] = 0;
+}
+
+/*
+ * Append an entry name, converted to the native encoding, to the path in
+ * the arena, optionally preceded by a path separator.
+ */
+static int romfs_path_append(romfs_patharena* arena, const u8* name, int separator)
+{
+	u32 namelength = utf16_strlen((const utf16char_t*)name);
+
+	if (!romfs_path_reserve(arena, 1 + namelength * OS_UTF16_MAXCHARS))
+		return 0;
 
+	if (separator)
+		arena->data[arena->length++] = OS_PATH_SEPARATOR;
+	arena->length += os_ConvertUTF16Str(arena->data + arena->length, (const utf16char_t*)name, namelength);
+	arena->data[arena->length] = 0;
+	return 1;
+}
 
-//	fprintf(stdout, "%08X %08X %08X %08X %08X ", 
-//			getle32(entry->parentoffset), getle32(entry->siblingoffset), getle32(entry->childoffset), 
-//			getle32(entry->fileoffset), getle32(entry->weirdoffset));
-//	fwprintf(stdout, L"%ls\n", entry->name);
+static void romfs_walk_list(romfs_patharena* arena, const u8* name, u32 depth, FILE* out)
+{
+	u32 i;
+
+	for(i=0; i<depth; i++)
+		fputs(" ", out);
 
+	if (romfs_path_append(arena, name, 0))
+		os_fputs(arena->data, out);
+	fputs("\n", out);
+	romfs_path_truncate(arena, 0);
+}
 
-	if (rootpath && os_strlen(rootpath))
+static int romfs_glob_separator(oschar_t c)
+{
+	return c == '/' || c == OS_PATH_SEPARATOR;
+}
+
+/*
+ * Match a whole path against a glob. '*' and '?' never cross a path
+ * separator, '**' does. A '**' component also matches zero directories,
+ * so "/movie" itself matches the exclude glob for everything below it.
+ */
+static int romfs_glob_match(const oschar_t* pattern, const oschar_t* path)
+{
+	while(1)
 	{
-		if (utf16_strlen((const utf16char_t*)entry->name) > 0)
-			currentpath = os_AppendUTF16StrToPath(rootpath, (const utf16char_t*)entry->name);
-		else // root dir, use the provided extract path instead of the empty root name.
-			currentpath = os_CopyStr(rootpath);
+		if (pattern[0] == '*' && pattern[1] == '*')
+		{
+			int segments;
+
+			pattern += 2;
+			segments = romfs_glob_separator(*pattern);
+			if (segments)
+				pattern++;
+
+			// a whole '**' component is followed by whole components only
+			while(1)
+			{
+				if (romfs_glob_match(pattern, path))
+					return 1;
+				if (*path == 0)
+					return 0;
+				if (!segments)
+				{
+					path++;
+					continue;
+				}
+				while(*path && !romfs_glob_separator(*path))
+					path++;
+				if (*path)
+					path++;
+				else
+					return 0;
+			}
+		}
 
-		if (currentpath)
+		if (romfs_glob_separator(pattern[0]) && pattern[1] == '*' && pattern[2] == '*' && pattern[3] == 0 && *path == 0)
+			return 1;
+
+		if (*pattern == '*')
 		{
-			os_makedir(currentpath);
+			pattern++;
+			while(1)
+			{
+				if (romfs_glob_match(pattern, path))
+					return 1;
+				if (*path == 0 || romfs_glob_separator(*path))
+					return 0;
+				path++;
+			}
 		}
-		else
+
+		if (*pattern == 0)
+			return *path == 0;
+		if (*path == 0)
+			return 0;
+
+		if (*pattern == '?')
 		{
-			fputs("Error creating directory in root ", stderr);
-			os_fputs(rootpath, stderr);
-			fputs("\n", stderr);
-			return;
+			if (romfs_glob_separator(*path))
+				return 0;
+
+			// one character, which may be a multi-byte UTF-8 sequence
+			if (sizeof(oschar_t) == 1)
+				while((path[1] & 0xC0) == 0x80)
+					path++;
 		}
+		else if (*pattern != *path && !(romfs_glob_separator(*pattern) && romfs_glob_separator(*path)))
+		{
+			return 0;
+		}
+
+		pattern++;
+		path++;
 	}
-	else
+}
+
+/*
+ * path is relative to the RomFS root and starts with a separator. A
+ * pattern without a leading '/' may match starting at any component.
+ */
+static int romfs_filter_match(const oschar_t* pattern, const oschar_t* path)
+{
+	if (romfs_glob_separator(*pattern))
+		return romfs_glob_match(pattern, path);
+
+	while(*path)
 	{
-		currentpath = os_CopyConvertUTF16Str((const utf16char_t*)entry->name);
-		if (settings_get_list_romfs_files(ctx->usersettings))
-		{
-			u32 i;
+		if (romfs_glob_separator(*path) && romfs_glob_match(pattern, path + 1))
+			return 1;
+		path++;
+	}
 
-			for(i=0; i<depth; i++)
-				printf(" ");
-			os_fputs(currentpath, stdout);
-			fputs("\n", stdout);
-		}
-		free(currentpath);
-		currentpath = NULL;
+	return 0;
+}
+
+/*
+ * Convert the --romfs-include/--romfs-exclude globs to the native path
+ * encoding once, so entries can be matched against the walker's path.
+ */
+static u32 romfs_filters_load(romfs_context* ctx, romfs_filter** filters)
+{
+	u32 count = settings_get_romfs_filter_count(ctx->usersettings);
+	u32 i;
+
+	*filters = NULL;
+	if (count == 0)
+		return 0;
+
+	*filters = calloc(count, sizeof(romfs_filter));
+	if (*filters == NULL)
+		return 0;
+
+	for(i=0; i<count; i++)
+	{
+		const char* pattern = settings_get_romfs_filter(ctx->usersettings, i, &(*filters)[i].exclude);
+
+		(*filters)[i].pattern = os_CopyConvertCharStr(pattern);
 	}
-	
 
-	siblingoffset = getle32(entry->siblingoffset);
-	childoffset = getle32(entry->childoffset);
-	fileoffset = getle32(entry->fileoffset);
+	return count;
+}
 
-	if (fileoffset != (~0))
-		romfs_visit_file(ctx, fileoffset, depth+1, actions, currentpath);
+static void romfs_filters_free(romfs_filter* filters, u32 count)
+{
+	u32 i;
 
-	if (childoffset != (~0))
-		romfs_visit_dir(ctx, childoffset, depth+1, actions, currentpath);
+	for(i=0; i<count; i++)
+		free(filters[i].pattern);
+	free(filters);
+}
 
-	if (siblingoffset != (~0))
-		romfs_visit_dir(ctx, siblingoffset, depth, actions, rootpath);
+/*
+ * A file is kept if it matches an include (or there are none) and no
+ * exclude. For a directory only the excludes are checked, since a
+ * directory matching one can hold nothing that is kept.
+ */
+static int romfs_filters_accept(romfs_filter* filters, u32 count, const oschar_t* path, int isdir)
+{
+	int included = 1;
+	u32 i;
+
+	for(i=0; i<count; i++)
+	{
+		if (filters[i].pattern == NULL)
+			continue;
+
+		if (filters[i].exclude)
+		{
+			if (romfs_filter_match(filters[i].pattern, path))
+				return 0;
+		}
+		else if (!isdir)
+		{
+			if (included == 1)
+				included = 0;
+			if (romfs_filter_match(filters[i].pattern, path))
+				included = 2;
+		}
+	}
 
-	free(currentpath);
+	return included != 0;
 }
 
+/*
+ * Create every directory from the extraction root down to the end of the
+ * path in the arena, for filtered walks that only create directories
+ * holding extracted files.
+ */
+static void romfs_path_makedirs(romfs_patharena* arena, u32 rootlength)
+{
+	u32 i;
 
-void romfs_visit_file(romfs_context* ctx, u32 fileoffset, u32 depth, u32 actions, const oschar_t* rootpath)
+	for(i=rootlength+1; i<arena->length; i++)
+	{
+		if (arena->data[i] == OS_PATH_SEPARATOR)
+		{
+			arena->data[i] = 0;
+			os_makedir(arena->data);
+			arena->data[i] = OS_PATH_SEPARATOR;
+		}
+	}
+	os_makedir(arena->data);
+}
+
+/*
+ * Walk the directory tree depth first, listing entries or creating
+ * directories and queueing files below rootpath. Pending directories live
+ * on an explicit stack, where a directory's sibling is pushed below its
+ * first child, so the visiting order matches a recursive walk. Each stack
+ * frame records the length of its parent path, and the path is built by
+ * appending to and truncating one shared arena.
+ */
+void romfs_walk(romfs_context* ctx, u32 actions, const oschar_t* rootpath)
 {
-	u32 siblingoffset = 0;
-	oschar_t* currentpath = NULL;
-	romfs_fileentry* entry = &ctx->fileentry;
+	romfs_direntry* dir = &ctx->direntry;
+	romfs_fileentry* file = &ctx->fileentry;
+	romfs_walkframe* stack = NULL;
+	romfs_walkframe frame;
+	u32 stackcount = 0;
+	u32 stackcapacity = 0;
+	romfs_patharena path;
+	int extract = (rootpath && os_strlen(rootpath)) || ctx->tar;
+	int list = !extract && settings_get_list_romfs_files(ctx->usersettings);
+	// a corrupt tree could link back into itself, so never visit more entries than exist
+	u32 dirsteps = ctx->dirblocksize / (sizeof(romfs_direntry) - ROMFS_MAXNAMESIZE);
+	u32 filesteps = ctx->fileblocksize / (sizeof(romfs_fileentry) - ROMFS_MAXNAMESIZE);
+	u32 dirlength;
+	u32 siblingoffset;
+	u32 childoffset;
+	u32 fileoffset;
+	u32 rootlength = rootpath? os_strlen(rootpath) : 0;
+	romfs_filter* filters = NULL;
+	u32 filtercount = extract? romfs_filters_load(ctx, &filters) : 0;
+	int dirmade = 1;
 
 
-	if (!romfs_fileblock_readentry(ctx, fileoffset, entry))
-		return;
+	memset(&path, 0, sizeof(romfs_patharena));
 
+	if (!romfs_path_reserve(&path, rootlength))
+		goto error;
+	if (rootlength)
+		memcpy(path.data, rootpath, rootlength * sizeof(oschar_t));
+	romfs_path_truncate(&path, rootlength);
 
-//	fprintf(stdout, "%08X %08X %016llX %016llX %08X ", 
-//		getle32(entry->parentdiroffset), getle32(entry->siblingoffset), ctx->datablockoffset+getle64(entry->dataoffset),
-//			getle64(entry->datasize), getle32(entry->unknown));
-//	fwprintf(stdout, L"%ls\n", entry->name);
+	stack = malloc(64 * sizeof(romfs_walkframe));
+	if (stack == NULL)
+		goto error;
+	stackcapacity = 64;
 
-	if (rootpath && os_strlen(rootpath))
+	stack[0].offset = 0;
+	stack[0].depth = 0;
+	stack[0].parentlength = path.length;
+	stackcount = 1;
+
+	while(stackcount && dirsteps)
 	{
-		currentpath = os_AppendUTF16StrToPath(rootpath, (const utf16char_t*)entry->name);
-		if (currentpath)
+		frame = stack[--stackcount];
+		dirsteps--;
+
+		if (!romfs_dirblock_readentry(ctx, frame.offset, dir))
+			continue;
+
+		romfs_path_truncate(&path, frame.parentlength);
+
+		if (extract)
 		{
-			fputs("Saving ", stdout);
-			os_fputs(currentpath, stdout);
-			fputs("...\n", stdout);
-			romfs_extract_datafile(ctx, getle64(entry->dataoffset), getle64(entry->datasize), currentpath);
+			// the root dir has an empty name and extracts to rootpath itself
+			if (utf16_strlen((const utf16char_t*)dir->name) > 0 && !romfs_path_append(&path, dir->name, 1))
+				goto error;
+
+			// an excluded directory is skipped with everything below it
+			if (filtercount && path.length > rootlength && !romfs_filters_accept(filters, filtercount, path.data + rootlength, 1))
+			{
+				if (getle32(dir->siblingoffset) != (~0))
+				{
+					stack[stackcount].offset = getle32(dir->siblingoffset);
+					stack[stackcount].depth = frame.depth;
+					stack[stackcount].parentlength = frame.parentlength;
+					stackcount++;
+				}
+				continue;
+			}
+
+			// with filters, directories are only created once a file in them is kept
+			dirmade = filtercount == 0 || path.length == rootlength;
+			if (dirmade && !ctx->tar)
+				os_makedir(path.data);
+			else if (dirmade && path.length > rootlength)
+				tar_add_dir(ctx->tar, path.data);
 		}
-		else
+		else if (list)
 		{
-			fputs("Error creating file in root ", stderr);
-			os_fputs(rootpath, stderr);
-			fputs("\n", stderr);
-			return;
+			romfs_walk_list(&path, dir->name, frame.depth, settings_get_message_file(ctx->usersettings));
+		}
+		dirlength = path.length;
+
+		siblingoffset = getle32(dir->siblingoffset);
+		childoffset = getle32(dir->childoffset);
+		fileoffset = getle32(dir->fileoffset);
+
+		while(fileoffset != (~0) && filesteps && romfs_fileblock_readentry(ctx, fileoffset, file))
+		{
+			filesteps--;
+
+			if (extract)
+			{
+				if (!romfs_path_append(&path, file->name, 1))
+					goto error;
+
+				if (filtercount && !romfs_filters_accept(filters, filtercount, path.data + rootlength, 0))
+				{
+					romfs_path_truncate(&path, dirlength);
+					fileoffset = getle32(file->siblingoffset);
+					continue;
+				}
+
+				// archives leave the parents of a filtered file implicit
+				if (!dirmade && !ctx->tar)
+				{
+					romfs_path_truncate(&path, dirlength);
+					romfs_path_makedirs(&path, rootlength);
+					dirmade = 1;
+					if (!romfs_path_append(&path, file->name, 1))
+						goto error;
+				}
+
+				// queued files are written once the whole tree has been walked
+				if (!romfs_plan_add(ctx, getle64(file->dataoffset), getle64(file->datasize), path.data, path.length))
+				{
+					if (ctx->tar)
+					{
+						romfs_tar_datafile(ctx, getle64(file->dataoffset), getle64(file->datasize), path.data);
+					}
+					else
+					{
+						fputs("Saving ", settings_get_message_file(ctx->usersettings));
+						os_fputs(path.data, settings_get_message_file(ctx->usersettings));
+						fputs("...\n", settings_get_message_file(ctx->usersettings));
+						romfs_extract_datafile(ctx, getle64(file->dataoffset), getle64(file->datasize), path.data);
+					}
+				}
+				romfs_path_truncate(&path, dirlength);
+			}
+			else if (list)
+			{
+				romfs_walk_list(&path, file->name, frame.depth + 1, settings_get_message_file(ctx->usersettings));
+			}
+
+			fileoffset = getle32(file->siblingoffset);
+		}
+
+		if (stackcount + 2 > stackcapacity)
+		{
+			u32 capacity = stackcapacity * 2;
+			romfs_walkframe* frames = realloc(stack, capacity * sizeof(romfs_walkframe));
+
+			if (frames == NULL)
+				goto error;
+			stack = frames;
+			stackcapacity = capacity;
+		}
+
+		if (siblingoffset != (~0))
+		{
+			stack[stackcount].offset = siblingoffset;
+			stack[stackcount].depth = frame.depth;
+			stack[stackcount].parentlength = frame.parentlength;
+			stackcount++;
+		}
+
+		if (childoffset != (~0))
+		{
+			stack[stackcount].offset = childoffset;
+			stack[stackcount].depth = frame.depth + 1;
+			stack[stackcount].parentlength = dirlength;
+			stackcount++;
 		}
 	}
-	else
+	goto clean;
+
+error:
+	fprintf(stderr, "Error, RomFS walk could not allocate memory\n");
+clean:
+	romfs_filters_free(filters, filtercount);
+	free(stack);
+	free(path.data);
+}
+
+/*
+ * Read through whole data level blocks so every block can be checked
+ * against the IVFC tree before its bytes are handed out. The last block
+ * stays cached, since consecutive reads usually share it.
+ */
+int romfs_read_verified(romfs_context* ctx, u64 offset, u8* buffer, u32 size)
+{
+	ivfc_level* level = ctx->ivfc.level + 2;
+	u32 blocksize = level->hashblocksize;
+	u64 datastart = ctx->offset + level->dataoffset;
+	u64 position;
+	u64 block;
+	u32 blockoffset;
+	u32 max;
+
+	if (offset < datastart)
+		return 0;
+
+	position = offset - datastart;
+
+	while(size)
 	{
-		currentpath = os_CopyConvertUTF16Str((const utf16char_t*)entry->name);
-		if (settings_get_list_romfs_files(ctx->usersettings))
+		block = position / blocksize;
+		blockoffset = (u32)(position % blocksize);
+		max = blocksize - blockoffset;
+		if (max > size)
+			max = size;
+
+		if (block != ctx->verifyblock)
 		{
-			u32 i;
+			ctx->verifyblock = IVFC_NO_BLOCK;
+
+			romfs_fseek(ctx, datastart + block * blocksize);
+			if (1 != romfs_fread(ctx, ctx->verifybuffer, blocksize, 1))
+				return 0;
 
-			for(i=0; i<depth; i++)
-				printf(" ");
-			os_fputs(currentpath, stdout);
-			fputs("\n", stdout);
+			ctx->verifyblock = block;
+			ctx->checkedblocks++;
+			if (ivfc_verifyread_block(&ctx->ivfc, block, ctx->verifybuffer) != Good)
+				ctx->badblocks++;
 		}
-		free(currentpath);
-		currentpath = NULL;
+
+		memcpy(buffer, ctx->verifybuffer + blockoffset, max);
+
+		buffer += max;
+		position += max;
+		size -= max;
 	}
 
-	siblingoffset = getle32(entry->siblingoffset);
+	return 1;
+}
 
-	if (siblingoffset != (~0))
-		romfs_visit_file(ctx, siblingoffset, depth, actions, rootpath);
+static void romfs_pipeline_crypt(void* arg, const u8* input, u8* output, u32 size)
+{
+	romfs_context* ctx = (romfs_context*) arg;
 
-	free(currentpath);
+	ctr_crypt_counter(&ctx->aes, (u8*)input, output, size);
 }
 
-void romfs_extract_datafile(romfs_context* ctx, u64 offset, u64 size, const oschar_t* path)
+int romfs_write_datafile(romfs_context* ctx, u64 offset, u64 size, FILE* outfile)
 {
-	FILE* outfile = 0;
 	u32 max;
 	u8 buffer[4096];
 
 
-	if (path == NULL || os_strlen(path) == 0)
-		goto clean;
-
 	offset += ctx->datablockoffset;
 
 	romfs_fseek(ctx, offset);
-	outfile = os_fopen(path, OS_MODE_WRITE);
-	if (outfile == NULL)
-	{
-		fprintf(stderr, "Error opening file for writing\n");
-		goto clean;
-	}
+
+	if (!ctx->verifyread)
+		return pipeline_copy(ctx->reader, offset, size, outfile, ctx->encrypted? romfs_pipeline_crypt : NULL, ctx);
 
 	while(size)
 	{
@@ -369,23 +858,564 @@ void romfs_extract_datafile(romfs_context* ctx, u64 offset, u64 size, const osch
 		if (max > size)
 			max = (u32) size;
 
-		if (max != romfs_fread(ctx, buffer, 1, max))
+		if (!romfs_read_verified(ctx, offset, buffer, max))
 		{
 			fprintf(stderr, "Error reading file\n");
-			goto clean;
+			return 0;
 		}
+		offset += max;
 
 		if (max != fwrite(buffer, 1, max, outfile))
 		{
 			fprintf(stderr, "Error writing file\n");
-			goto clean;
+			return 0;
 		}
 
 		size -= max;
 	}
+
+	return 1;
+}
+
+int romfs_extract_datafile(romfs_context* ctx, u64 offset, u64 size, const oschar_t* path)
+{
+	FILE* outfile = 0;
+	u32 badblocks = ctx->badblocks;
+	int result = 0;
+
+
+	if (path == NULL || os_strlen(path) == 0)
+		goto clean;
+
+	outfile = os_fopen(path, OS_MODE_WRITE);
+	if (outfile == NULL)
+	{
+		fprintf(stderr, "Error opening file for writing\n");
+		goto clean;
+	}
+
+	if (!romfs_write_datafile(ctx, offset, size, outfile))
+		goto clean;
+
+	if (ctx->badblocks != badblocks)
+	{
+		fputs("Error, hash check failed for ", stderr);
+		os_fputs(path, stderr);
+		fputs("\n", stderr);
+		goto clean;
+	}
+
+	result = 1;
+clean:
+	if (outfile)
+		fclose(outfile);
+	return result;
+}
+
+/*
+ * Append one file to the archive in ctx->tar. The header carries the
+ * size up front, so a short read leaves the archive unusable and marks
+ * it failed.
+ */
+int romfs_tar_datafile(romfs_context* ctx, u64 offset, u64 size, const oschar_t* path)
+{
+	u32 badblocks = ctx->badblocks;
+
+	if (!tar_begin_file(ctx->tar, path, size))
+		return 0;
+
+	if (!romfs_write_datafile(ctx, offset, size, ctx->tar->file))
+	{
+		ctx->tar->error = 1;
+		return 0;
+	}
+
+	if (ctx->badblocks != badblocks)
+	{
+		fputs("Error, hash check failed for ", stderr);
+		os_fputs(path, stderr);
+		fputs("\n", stderr);
+	}
+
+	return tar_end_file(ctx->tar);
+}
+
+/*
+ * Same path hash the console uses for both hash tables: the parent
+ * directory offset, mixed with every UTF-16 unit of the name.
+ */
+static u32 romfs_hash_name(u32 parentoffset, const utf16char_t* name, u32 namelength)
+{
+	u32 hash = parentoffset ^ 123456789;
+	u32 i;
+
+	for(i=0; i<namelength; i++)
+	{
+		hash = (hash >> 5) | (hash << 27);
+		hash ^= name[i];
+	}
+
+	return hash;
+}
+
+static int romfs_name_equal(const u8* entryname, u32 entrysize, const utf16char_t* name, u32 namelength)
+{
+	u32 i;
+
+	if (entrysize != namelength * 2 || entrysize > ROMFS_MAXNAMESIZE - 2)
+		return 0;
+
+	for(i=0; i<namelength; i++)
+		if (getle16(entryname + i*2) != name[i])
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Find a directory by name inside the directory at parentoffset, walking
+ * only the hash bucket the name falls in. Returns the entry offset, or
+ * ~0 if there is no such directory.
+ */
+u32 romfs_lookup_dir(romfs_context* ctx, u32 parentoffset, const utf16char_t* name, u32 namelength)
+{
+	romfs_direntry entry;
+	u32 offset;
+	u32 steps = ctx->dirblocksize / (sizeof(romfs_direntry) - ROMFS_MAXNAMESIZE);
+
+	if (ctx->dirhashtable == NULL || ctx->dirhashcount == 0)
+		return ~0;
+
+	offset = getle32(ctx->dirhashtable + 4 * (romfs_hash_name(parentoffset, name, namelength) % ctx->dirhashcount));
+
+	// a corrupt chain could loop, so never follow more links than there are entries
+	while(offset != (~0) && steps--)
+	{
+		if (!romfs_dirblock_readentry(ctx, offset, &entry))
+			break;
+
+		if (getle32(entry.parentoffset) == parentoffset && romfs_name_equal(entry.name, getle32(entry.namesize), name, namelength))
+			return offset;
+
+		offset = getle32(entry.hashsiblingoffset);
+	}
+
+	return ~0;
+}
+
+/*
+ * Resolve every directory component of a slash separated path. Returns
+ * the offset of the directory holding the last component, which is left
+ * in last/lastlength (empty for paths ending in a slash), or ~0 if a
+ * directory on the way does not exist.
+ */
+static u32 romfs_lookup_parent(romfs_context* ctx, const utf16char_t* path, const utf16char_t** last, u32* lastlength)
+{
+	u32 parentoffset = 0;
+	u32 length;
+
+	while(1)
+	{
+		while(*path == '/')
+			path++;
+
+		for(length=0; path[length] && path[length] != '/'; length++)
+			;
+
+		if (path[length] == 0)
+			break;
+
+		parentoffset = romfs_lookup_dir(ctx, parentoffset, path, length);
+		if (parentoffset == (~0))
+			return ~0;
+
+		path += length;
+	}
+
+	*last = path;
+	*lastlength = length;
+	return parentoffset;
+}
+
+static utf16char_t* romfs_lookup_convert(const char* path)
+{
+	oschar_t* ospath = os_CopyConvertCharStr(path);
+	utf16char_t* name = utf16_CopyConvertOsStr(ospath);
+
+	free(ospath);
+	return name;
+}
+
+/*
+ * Resolve a slash separated path to a directory entry offset, or ~0 if
+ * the path does not name a directory. The root is "" or "/".
+ */
+u32 romfs_lookup_dir_path(romfs_context* ctx, const char* path)
+{
+	utf16char_t* name = romfs_lookup_convert(path);
+	const utf16char_t* last;
+	u32 length;
+	u32 offset = ~0;
+
+	if (name == NULL)
+		return ~0;
+
+	offset = romfs_lookup_parent(ctx, name, &last, &length);
+	if (offset != (~0) && length)
+		offset = romfs_lookup_dir(ctx, offset, last, length);
+
+	free(name);
+	return offset;
+}
+
+/*
+ * Resolve a slash separated path to its file entry through the directory
+ * and file hash tables, without walking the tree. Returns the entry
+ * offset, or ~0 if the path does not name a file.
+ */
+u32 romfs_lookup_file(romfs_context* ctx, const char* path, romfs_fileentry* entry)
+{
+	utf16char_t* name = romfs_lookup_convert(path);
+	const utf16char_t* last;
+	u32 length;
+	u32 parentoffset;
+	u32 offset = ~0;
+	u32 steps = ctx->fileblocksize / (sizeof(romfs_fileentry) - ROMFS_MAXNAMESIZE);
+
+
+	if (name == NULL || ctx->filehashtable == NULL || ctx->filehashcount == 0)
+		goto clean;
+
+	parentoffset = romfs_lookup_parent(ctx, name, &last, &length);
+	if (parentoffset == (~0) || length == 0)
+		goto clean;
+
+	offset = getle32(ctx->filehashtable + 4 * (romfs_hash_name(parentoffset, last, length) % ctx->filehashcount));
+
+	while(offset != (~0) && steps--)
+	{
+		if (!romfs_fileblock_readentry(ctx, offset, entry))
+			break;
+
+		if (getle32(entry->parentdiroffset) == parentoffset && romfs_name_equal(entry->name, getle32(entry->namesize), last, length))
+			goto clean;
+
+		offset = getle32(entry->hashsiblingoffset);
+	}
+	offset = ~0;
+
+clean:
+	free(name);
+	return offset;
+}
+
+/*
+ * Extract the single file at path to outpath, or stream it to stdout
+ * when outpath is NULL. Returns 1 on success.
+ */
+int romfs_extract_file(romfs_context* ctx, const char* path, const oschar_t* outpath)
+{
+	romfs_fileentry entry;
+	u32 badblocks = ctx->badblocks;
+	int result;
+
+
+	if (romfs_lookup_file(ctx, path, &entry) == (~0))
+	{
+		fprintf(stderr, "Error, RomFS file %s not found\n", path);
+		return 0;
+	}
+
+	if (outpath)
+	{
+		fprintf(settings_get_message_file(ctx->usersettings), "Saving %s to ", path);
+		os_fputs(outpath, settings_get_message_file(ctx->usersettings));
+		fputs("...\n", settings_get_message_file(ctx->usersettings));
+		return romfs_extract_datafile(ctx, getle64(entry.dataoffset), getle64(entry.datasize), outpath);
+	}
+
+	result = romfs_write_datafile(ctx, getle64(entry.dataoffset), getle64(entry.datasize), stdout);
+	fflush(stdout);
+
+	if (ctx->badblocks != badblocks)
+	{
+		fprintf(stderr, "Error, hash check failed for %s\n", path);
+		result = 0;
+	}
+
+	return result;
+}
+
+/*
+ * Queue a file for extraction, copying its path into the plan's arena.
+ * Returns 0 when the plan cannot grow, in which case the caller extracts
+ * the file right away.
+ */
+int romfs_plan_add(romfs_context* ctx, u64 offset, u64 size, const oschar_t* path, u32 pathlength)
+{
+	romfs_planentry* entry;
+
+	if (ctx->plancount == ctx->plancapacity)
+	{
+		u32 capacity = ctx->plancapacity? ctx->plancapacity * 2 : 256;
+		romfs_planentry* plan = realloc(ctx->plan, capacity * sizeof(romfs_planentry));
+
+		if (plan == NULL)
+			return 0;
+
+		ctx->plan = plan;
+		ctx->plancapacity = capacity;
+	}
+
+	if (!romfs_path_reserve(&ctx->planpaths, pathlength))
+		return 0;
+
+	entry = ctx->plan + ctx->plancount++;
+	entry->offset = offset;
+	entry->size = size;
+	entry->path = ctx->planpaths.length;
+
+	memcpy(ctx->planpaths.data + ctx->planpaths.length, path, pathlength * sizeof(oschar_t));
+	ctx->planpaths.data[ctx->planpaths.length + pathlength] = 0;
+	ctx->planpaths.length += pathlength + 1;
+
+	return 1;
+}
+
+static int romfs_plan_compare(const void* a, const void* b)
+{
+	const romfs_planentry* x = (const romfs_planentry*) a;
+	const romfs_planentry* y = (const romfs_planentry*) b;
+
+	if (x->offset != y->offset)
+		return (x->offset < y->offset)? -1 : 1;
+	if (x->size != y->size)
+		return (x->size < y->size)? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write one chunk of a queued file. Every chunk sets up its own counter
+ * from its image offset and reads positionally, so chunks can run on any
+ * worker in any order. Files split into several chunks were created up
+ * front and are only patched here.
+ */
+static void romfs_extract_range(void* arg, u32 index)
+{
+	romfs_extract_job* job = (romfs_extract_job*) arg;
+	romfs_context* ctx = job->ctx;
+	romfs_extract_chunk* chunk = job->chunks + index;
+	romfs_planentry* entry = ctx->plan + chunk->entry;
+	const oschar_t* path = ctx->planpaths.data + entry->path;
+	u64 position = ctx->datablockoffset + entry->offset + chunk->offset;
+	const u8* src = reader_get(ctx->reader, position, chunk->size);
+	const u8* data = src;
+	u8* buffer = NULL;
+	FILE* outfile = NULL;
+	ctr_aes_context aes;
+
+
+	if (chunk->size == entry->size)
+		outfile = os_fopen(path, OS_MODE_WRITE);
+	else
+		outfile = os_fopen(path, OS_MODE_EDIT);
+	if (outfile == NULL)
+	{
+		fprintf(stderr, "Error opening file for writing\n");
+		goto clean;
+	}
+
+	if (chunk->size == 0)
+		goto clean;
+
+	if (src == NULL || ctx->encrypted)
+	{
+		buffer = malloc(chunk->size);
+		if (buffer == NULL)
+		{
+			fprintf(stderr, "Error allocating memory\n");
+			goto clean;
+		}
+	}
+
+	if (src == NULL)
+	{
+		if (chunk->size != reader_read_at(ctx->reader, position, buffer, chunk->size))
+		{
+			fprintf(stderr, "Error reading file\n");
+			goto clean;
+		}
+		data = buffer;
+	}
+
+	if (ctx->encrypted)
+	{
+		ctr_init_key(&aes, ctx->key);
+		ctr_init_counter(&aes, ctx->counter);
+		ctr_add_counter(&aes, (u32)((position - ctx->offset) / 0x10));
+		ctr_crypt_counter(&aes, (u8*)data, buffer, chunk->size);
+		data = buffer;
+	}
+
+	if (chunk->offset && fseeko64(outfile, chunk->offset, SEEK_SET) != 0)
+	{
+		fprintf(stderr, "Error writing file\n");
+		goto clean;
+	}
+
+	if (chunk->size != fwrite(data, 1, chunk->size, outfile))
+		fprintf(stderr, "Error writing file\n");
+
 clean:
 	if (outfile)
 		fclose(outfile);
+	free(buffer);
+}
+
+/*
+ * Hand the queued files to a worker pool. Files larger than one chunk are
+ * created here and split into counter aligned chunks, so a single big
+ * file still spreads over all workers. Returns 0 if the job list cannot
+ * be allocated, leaving the plan to the serial path.
+ */
+static int romfs_plan_extract_parallel(romfs_context* ctx, u32 threadcount)
+{
+	romfs_extract_job job;
+	u32 chunkcount = 0;
+	u32 i;
+
+
+	for(i=0; i<ctx->plancount; i++)
+	{
+		u64 size = ctx->plan[i].size;
+
+		chunkcount += (size > ROMFS_EXTRACT_CHUNK_SIZE)? (u32)((size + ROMFS_EXTRACT_CHUNK_SIZE - 1) / ROMFS_EXTRACT_CHUNK_SIZE) : 1;
+	}
+
+	job.ctx = ctx;
+	job.chunks = malloc(chunkcount * sizeof(romfs_extract_chunk));
+	if (job.chunks == NULL)
+		return 0;
+
+	chunkcount = 0;
+	for(i=0; i<ctx->plancount; i++)
+	{
+		romfs_planentry* entry = ctx->plan + i;
+		const oschar_t* path = ctx->planpaths.data + entry->path;
+		u64 offset = 0;
+
+		fputs("Saving ", settings_get_message_file(ctx->usersettings));
+		os_fputs(path, settings_get_message_file(ctx->usersettings));
+		fputs("...\n", settings_get_message_file(ctx->usersettings));
+
+		if (entry->size > ROMFS_EXTRACT_CHUNK_SIZE)
+		{
+			FILE* outfile = os_fopen(path, OS_MODE_WRITE);
+
+			if (outfile == NULL)
+			{
+				fprintf(stderr, "Error opening file for writing\n");
+				continue;
+			}
+			fclose(outfile);
+		}
+
+		do
+		{
+			romfs_extract_chunk* chunk = job.chunks + chunkcount++;
+			u64 max = entry->size - offset;
+
+			if (max > ROMFS_EXTRACT_CHUNK_SIZE)
+				max = ROMFS_EXTRACT_CHUNK_SIZE;
+
+			chunk->entry = i;
+			chunk->offset = offset;
+			chunk->size = (u32) max;
+			offset += max;
+		} while(offset < entry->size);
+	}
+
+	fflush(settings_get_message_file(ctx->usersettings));
+	worker_run(threadcount, chunkcount, romfs_extract_range, &job);
+
+	free(job.chunks);
+	return 1;
+}
+
+/*
+ * Read a small gap between two files and drop it, so positional reads
+ * reach the device as one forward stream instead of a short seek. A
+ * mapped image is already read ahead sequentially, so nothing is done.
+ */
+static void romfs_plan_readgap(romfs_context* ctx, u64 offset, u32 size, u8** scratch)
+{
+	u64 position = ctx->datablockoffset + offset;
+
+
+	if (reader_get(ctx->reader, position, size))
+		return;
+
+	if (*scratch == NULL)
+		*scratch = malloc(ROMFS_PLAN_MAXGAP);
+	if (*scratch)
+		reader_read_at(ctx->reader, position, *scratch, size);
+}
+
+/*
+ * Write out every queued file in data offset order, so the image is read
+ * in one forward sweep. Small gaps between files are read through as
+ * part of the sweep; across larger ones the next file is prefetched
+ * instead, so the jump does not stall on a cold page.
+ */
+void romfs_plan_extract(romfs_context* ctx)
+{
+	u32 i;
+	u64 end = 0;
+	u8* scratch = NULL;
+	u32 threadcount = settings_get_extract_thread_count(ctx->usersettings);
+
+	if (ctx->plancount == 0)
+		goto clean;
+
+	qsort(ctx->plan, ctx->plancount, sizeof(romfs_planentry), romfs_plan_compare);
+
+	// verify-on-read shares one cached block, and an archive is written in
+	// order, so both stay on the serial path
+	if (!ctx->verifyread && !ctx->tar && threadcount > 1 && romfs_plan_extract_parallel(ctx, threadcount))
+		goto clean;
+
+	for(i=0; i<ctx->plancount; i++)
+	{
+		romfs_planentry* entry = ctx->plan + i;
+		const oschar_t* path = ctx->planpaths.data + entry->path;
+
+		if (i && entry->offset > end + ROMFS_PLAN_MAXGAP)
+			reader_advise(ctx->reader, ctx->datablockoffset + entry->offset, entry->size, MAPFILE_WILLNEED);
+		else if (i && entry->offset > end)
+			romfs_plan_readgap(ctx, end, (u32)(entry->offset - end), &scratch);
+		if (entry->offset + entry->size > end)
+			end = entry->offset + entry->size;
+
+		if (ctx->tar)
+		{
+			romfs_tar_datafile(ctx, entry->offset, entry->size, path);
+			continue;
+		}
+
+		fputs("Saving ", settings_get_message_file(ctx->usersettings));
+		os_fputs(path, settings_get_message_file(ctx->usersettings));
+		fputs("...\n", settings_get_message_file(ctx->usersettings));
+		romfs_extract_datafile(ctx, entry->offset, entry->size, path);
+	}
+
+clean:
+	free(scratch);
+	free(ctx->plan);
+	free(ctx->planpaths.data);
+	ctx->plan = NULL;
+	ctx->plancount = 0;
+	ctx->plancapacity = 0;
+	memset(&ctx->planpaths, 0, sizeof(romfs_patharena));
 }
 
 
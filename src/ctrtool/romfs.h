@@ -7,8 +7,11 @@
 #include "oschar.h"
 #include "settings.h"
 #include "ivfc.h"
+#include "tar.h"
 
 #define ROMFS_MAXNAMESIZE	254		// limit set by ctrtool
+#define ROMFS_PLAN_MAXGAP	(64 * 1024)	// gaps up to this size are read through
+#define ROMFS_EXTRACT_CHUNK_SIZE	(4 * 1024 * 1024)	// larger files are split across workers
 
 typedef struct
 {
@@ -35,7 +38,7 @@ typedef struct
 	u8 siblingoffset[4];
 	u8 childoffset[4];
 	u8 fileoffset[4];
-	u8 weirdoffset[4]; // this one is weird. it always points to a dir entry, but seems unrelated to the romfs structure.
+	u8 hashsiblingoffset[4]; // next dir entry in the same hash bucket
 	u8 namesize[4];
 	u8 name[ROMFS_MAXNAMESIZE];
 } romfs_direntry;
@@ -46,7 +49,7 @@ typedef struct
 	u8 siblingoffset[4];
 	u8 dataoffset[8];
 	u8 datasize[8];
-	u8 weirdoffset[4]; // this one is also weird. it always points to a file entry, but seems unrelated to the romfs structure.
+	u8 hashsiblingoffset[4]; // next file entry in the same hash bucket
 	u8 namesize[4];
 	u8 name[ROMFS_MAXNAMESIZE];
 } romfs_fileentry;
@@ -54,7 +57,36 @@ typedef struct
 
 typedef struct
 {
-	FILE* file;
+	u64 offset;
+	u64 size;
+	u32 path; // offset into the plan's path arena
+} romfs_planentry;
+
+typedef struct
+{
+	oschar_t* data;
+	u32 length;
+	u32 capacity;
+} romfs_patharena;
+
+typedef struct
+{
+	u32 offset;
+	u32 depth;
+	u32 parentlength;
+} romfs_walkframe;
+
+typedef struct
+{
+	oschar_t* pattern;
+	int exclude;
+} romfs_filter;
+
+
+typedef struct
+{
+	const reader_context* reader;
+	u64 position;
 	oschar_t* extractdir;
 	settings* usersettings;
 	u8 counter[16];
@@ -67,6 +99,10 @@ typedef struct
 	u32 dirblocksize;
 	u8* fileblock;
 	u32 fileblocksize;
+	u8* dirhashtable;
+	u32 dirhashcount;
+	u8* filehashtable;
+	u32 filehashcount;
 	u32 datablockoffset;
 	u32 infoblockoffset;
 	romfs_direntry direntry;
@@ -74,10 +110,20 @@ typedef struct
 	ivfc_context ivfc;
 	ctr_aes_context aes;
 	int encrypted;
+	int verifyread;
+	u8* verifybuffer;
+	u64 verifyblock;
+	u32 checkedblocks;
+	u32 badblocks;
+	romfs_planentry* plan;
+	u32 plancount;
+	u32 plancapacity;
+	romfs_patharena planpaths;
+	tar_context* tar; // set while files are written to an archive instead of extracted
 } romfs_context;
 
 void romfs_init(romfs_context* ctx);
-void romfs_set_file(romfs_context* ctx, FILE* file);
+void romfs_set_reader(romfs_context* ctx, const reader_context* reader);
 void romfs_set_offset(romfs_context* ctx, u64 offset);
 void romfs_set_size(romfs_context* ctx, u64 size);
 void romfs_set_usersettings(romfs_context* ctx, settings* usersettings);
@@ -90,10 +136,19 @@ int  romfs_dirblock_read(romfs_context* ctx, u32 diroffset, u32 dirsize, void* b
 int  romfs_dirblock_readentry(romfs_context* ctx, u32 diroffset, romfs_direntry* entry);
 int  romfs_fileblock_read(romfs_context* ctx, u32 fileoffset, u32 filesize, void* buffer);
 int  romfs_fileblock_readentry(romfs_context* ctx, u32 fileoffset, romfs_fileentry* entry);
-void romfs_visit_dir(romfs_context* ctx, u32 diroffset, u32 depth, u32 actions, const oschar_t* rootpath);
-void romfs_visit_file(romfs_context* ctx, u32 fileoffset, u32 depth, u32 actions, const oschar_t* rootpath);
-void romfs_extract_datafile(romfs_context* ctx, u64 offset, u64 size, const oschar_t* path);
-void romfs_process(romfs_context* ctx, u32 actions);
+void romfs_walk(romfs_context* ctx, u32 actions, const oschar_t* rootpath);
+u32  romfs_lookup_dir(romfs_context* ctx, u32 parentoffset, const utf16char_t* name, u32 namelength);
+u32  romfs_lookup_dir_path(romfs_context* ctx, const char* path);
+u32  romfs_lookup_file(romfs_context* ctx, const char* path, romfs_fileentry* entry);
+int  romfs_extract_file(romfs_context* ctx, const char* path, const oschar_t* outpath);
+int  romfs_read_verified(romfs_context* ctx, u64 offset, u8* buffer, u32 size);
+int  romfs_plan_add(romfs_context* ctx, u64 offset, u64 size, const oschar_t* path, u32 pathlength);
+void romfs_plan_extract(romfs_context* ctx);
+int  romfs_write_datafile(romfs_context* ctx, u64 offset, u64 size, FILE* outfile);
+int  romfs_extract_datafile(romfs_context* ctx, u64 offset, u64 size, const oschar_t* path);
+int  romfs_tar_datafile(romfs_context* ctx, u64 offset, u64 size, const oschar_t* path);
+int romfs_process(romfs_context* ctx, u32 actions);
+int romfs_process_tree(romfs_context* ctx, u32 actions);
 void romfs_print(romfs_context* ctx);
 
 #endif // __ROMFS_H__
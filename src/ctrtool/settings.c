@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "settings.h"
+#include "worker.h"
 
 void settings_init(settings* usersettings)
 {
@@ -71,6 +72,78 @@ filepath* settings_get_romfs_dir_path(settings* usersettings)
 		return 0;
 }
 
+filepath* settings_get_romfs_file_path(settings* usersettings)
+{
+	if (usersettings)
+		return &usersettings->romfsfilepath;
+	else
+		return 0;
+}
+
+filepath* settings_get_romfs_out_path(settings* usersettings)
+{
+	if (usersettings)
+		return &usersettings->romfsoutpath;
+	else
+		return 0;
+}
+
+filepath* settings_get_index_path(settings* usersettings)
+{
+	if (usersettings)
+		return &usersettings->indexpath;
+	else
+		return 0;
+}
+
+filepath* settings_get_write_index_path(settings* usersettings)
+{
+	if (usersettings)
+		return &usersettings->writeindexpath;
+	else
+		return 0;
+}
+
+filepath* settings_get_mount_path(settings* usersettings)
+{
+	if (usersettings)
+		return &usersettings->mountpath;
+	else
+		return 0;
+}
+
+filepath* settings_get_romfs_tar_path(settings* usersettings)
+{
+	if (usersettings)
+		return &usersettings->romfstarpath;
+	else
+		return 0;
+}
+
+filepath* settings_get_exefs_tar_path(settings* usersettings)
+{
+	if (usersettings)
+		return &usersettings->exefstarpath;
+	else
+		return 0;
+}
+
+filepath* settings_get_thumbnail_path(settings* usersettings)
+{
+	if (usersettings)
+		return &usersettings->thumbnailpath;
+	else
+		return 0;
+}
+
+filepath* settings_get_thumbnail_dir_path(settings* usersettings)
+{
+	if (usersettings)
+		return &usersettings->thumbnaildirpath;
+	else
+		return 0;
+}
+
 filepath* settings_get_firm_dir_path(settings* usersettings)
 {
 	if (usersettings)
@@ -209,6 +282,34 @@ int settings_get_list_romfs_files(settings* usersettings)
 		return 0;
 }
 
+int settings_get_verify_read(settings* usersettings)
+{
+	if (usersettings)
+		return usersettings->verifyread;
+	else
+		return 0;
+}
+
+int settings_get_index_hashes(settings* usersettings)
+{
+	if (usersettings)
+		return usersettings->indexhashes;
+	else
+		return 0;
+}
+
+/*
+ * Progress and summary lines go to stderr while stdout carries file
+ * data, e.g. from --romfs-file or a tar stream.
+ */
+FILE* settings_get_message_file(settings* usersettings)
+{
+	if (usersettings && usersettings->stdoutdata)
+		return stderr;
+	else
+		return stdout;
+}
+
 int settings_get_cwav_loopcount(settings* usersettings)
 {
 	if (usersettings)
@@ -217,6 +318,51 @@ int settings_get_cwav_loopcount(settings* usersettings)
 		return 0;
 }
 
+u32 settings_get_thread_count(settings* usersettings)
+{
+	if (usersettings && usersettings->threadcount)
+		return usersettings->threadcount;
+	else
+		return worker_default_count();
+}
+
+/*
+ * Concurrent reads slow down spinning disks and network storage, so
+ * files are only extracted in parallel with an explicit --threads=N.
+ */
+u32 settings_get_extract_thread_count(settings* usersettings)
+{
+	if (usersettings && usersettings->threadcount)
+		return usersettings->threadcount;
+	else
+		return 1;
+}
+
+u32 settings_get_thumbnail_size(settings* usersettings)
+{
+	if (usersettings && usersettings->thumbnailsize)
+		return usersettings->thumbnailsize;
+	else
+		return SETTINGS_DEFAULT_THUMBNAIL_SIZE;
+}
+
+u32 settings_get_romfs_filter_count(settings* usersettings)
+{
+	if (usersettings)
+		return usersettings->romfsfiltercount;
+	else
+		return 0;
+}
+
+const char* settings_get_romfs_filter(settings* usersettings, u32 index, int* exclude)
+{
+	if (usersettings == 0 || index >= usersettings->romfsfiltercount)
+		return 0;
+
+	*exclude = usersettings->romfsfilter[index].exclude;
+	return usersettings->romfsfilter[index].pattern;
+}
+
 void settings_set_wav_path(settings* usersettings, const char* path)
 {
 	filepath_set(&usersettings->wavpath, path);
@@ -288,6 +434,51 @@ void settings_set_romfs_dir_path(settings* usersettings, const char* path)
 	filepath_set(&usersettings->romfsdirpath, path);
 }
 
+void settings_set_romfs_file_path(settings* usersettings, const char* path)
+{
+	filepath_set(&usersettings->romfsfilepath, path);
+}
+
+void settings_set_romfs_out_path(settings* usersettings, const char* path)
+{
+	filepath_set(&usersettings->romfsoutpath, path);
+}
+
+void settings_set_index_path(settings* usersettings, const char* path)
+{
+	filepath_set(&usersettings->indexpath, path);
+}
+
+void settings_set_write_index_path(settings* usersettings, const char* path)
+{
+	filepath_set(&usersettings->writeindexpath, path);
+}
+
+void settings_set_mount_path(settings* usersettings, const char* path)
+{
+	filepath_set(&usersettings->mountpath, path);
+}
+
+void settings_set_romfs_tar_path(settings* usersettings, const char* path)
+{
+	filepath_set(&usersettings->romfstarpath, path);
+}
+
+void settings_set_exefs_tar_path(settings* usersettings, const char* path)
+{
+	filepath_set(&usersettings->exefstarpath, path);
+}
+
+void settings_set_thumbnail_path(settings* usersettings, const char* path)
+{
+	filepath_set(&usersettings->thumbnailpath, path);
+}
+
+void settings_set_thumbnail_dir_path(settings* usersettings, const char* path)
+{
+	filepath_set(&usersettings->thumbnaildirpath, path);
+}
+
 void settings_set_plainrgn_path(settings* usersettings, const char* path)
 {
 	filepath_set(&usersettings->plainrgnpath, path);
@@ -308,7 +499,47 @@ void settings_set_list_romfs_files(settings* usersettings, int enable)
 	usersettings->listromfs = enable;
 }
 
+void settings_set_verify_read(settings* usersettings, int enable)
+{
+	usersettings->verifyread = enable;
+}
+
+void settings_set_index_hashes(settings* usersettings, int enable)
+{
+	usersettings->indexhashes = enable;
+}
+
+void settings_set_stdout_data(settings* usersettings, int enable)
+{
+	usersettings->stdoutdata = enable;
+}
+
 void settings_set_cwav_loopcount(settings* usersettings, u32 loopcount)
 {
 	usersettings->cwavloopcount = loopcount;
 }
+
+void settings_set_thread_count(settings* usersettings, u32 threadcount)
+{
+	usersettings->threadcount = threadcount;
+}
+
+void settings_set_thumbnail_size(settings* usersettings, u32 size)
+{
+	usersettings->thumbnailsize = size;
+}
+
+/*
+ * The pattern is not copied, it must stay valid as long as the settings
+ * (command line arguments do).
+ */
+int settings_add_romfs_filter(settings* usersettings, const char* pattern, int exclude)
+{
+	if (usersettings->romfsfiltercount >= SETTINGS_MAX_ROMFS_FILTERS)
+		return 0;
+
+	usersettings->romfsfilter[usersettings->romfsfiltercount].pattern = pattern;
+	usersettings->romfsfilter[usersettings->romfsfiltercount].exclude = exclude;
+	usersettings->romfsfiltercount++;
+	return 1;
+}
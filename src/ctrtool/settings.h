@@ -1,10 +1,20 @@
 #ifndef _SETTINGS_H_
 #define _SETTINGS_H_
 
+#include <stdio.h>
 #include "types.h"
 #include "keyset.h"
 #include "filepath.h"
 
+#define SETTINGS_MAX_ROMFS_FILTERS	64
+#define SETTINGS_DEFAULT_THUMBNAIL_SIZE	128	// freedesktop "normal" size
+
+typedef struct
+{
+	const char* pattern;
+	int exclude;
+} settings_romfsfilter;
+
 typedef struct
 {
 	keyset keys;
@@ -13,6 +23,15 @@ typedef struct
 	filepath firmdirpath;
 	filepath romfspath;
 	filepath romfsdirpath;
+	filepath romfsfilepath;
+	filepath romfsoutpath;
+	filepath indexpath;
+	filepath writeindexpath;
+	filepath mountpath;
+	filepath romfstarpath;
+	filepath exefstarpath;
+	filepath thumbnailpath;
+	filepath thumbnaildirpath;
 	filepath exheaderpath;
 	filepath logopath;
 	filepath plainrgnpath;
@@ -26,7 +45,14 @@ typedef struct
 	unsigned int mediaunitsize;
 	int ignoreprogramid;
 	int listromfs;
+	int verifyread;
+	int indexhashes;
+	int stdoutdata;
 	u32 cwavloopcount;
+	u32 threadcount;
+	u32 thumbnailsize;
+	settings_romfsfilter romfsfilter[SETTINGS_MAX_ROMFS_FILTERS];
+	u32 romfsfiltercount;
 } settings;
 
 void settings_init(settings* usersettings);
@@ -42,6 +68,15 @@ filepath* settings_get_content_path(settings* usersettings);
 filepath* settings_get_meta_path(settings* usersettings);
 filepath* settings_get_exefs_dir_path(settings* usersettings);
 filepath* settings_get_romfs_dir_path(settings* usersettings);
+filepath* settings_get_romfs_file_path(settings* usersettings);
+filepath* settings_get_romfs_out_path(settings* usersettings);
+filepath* settings_get_index_path(settings* usersettings);
+filepath* settings_get_write_index_path(settings* usersettings);
+filepath* settings_get_mount_path(settings* usersettings);
+filepath* settings_get_romfs_tar_path(settings* usersettings);
+filepath* settings_get_exefs_tar_path(settings* usersettings);
+filepath* settings_get_thumbnail_path(settings* usersettings);
+filepath* settings_get_thumbnail_dir_path(settings* usersettings);
 filepath* settings_get_firm_dir_path(settings* usersettings);
 filepath* settings_get_wav_path(settings* usersettings);
 filepath* settings_get_plainrgn_path(settings* usersettings);
@@ -56,7 +91,15 @@ unsigned char* settings_get_seed(settings* usersettings, u64 title_id);
 unsigned char* settings_get_title_key(settings* usersettings);
 int settings_get_ignore_programid(settings* usersettings);
 int settings_get_list_romfs_files(settings* usersettings);
+int settings_get_verify_read(settings* usersettings);
+int settings_get_index_hashes(settings* usersettings);
+FILE* settings_get_message_file(settings* usersettings);
 int settings_get_cwav_loopcount(settings* usersettings);
+u32 settings_get_thread_count(settings* usersettings);
+u32 settings_get_extract_thread_count(settings* usersettings);
+u32 settings_get_thumbnail_size(settings* usersettings);
+u32 settings_get_romfs_filter_count(settings* usersettings);
+const char* settings_get_romfs_filter(settings* usersettings, u32 index, int* exclude);
 
 void settings_set_lzss_path(settings* usersettings, const char* path);
 void settings_set_exefs_path(settings* usersettings, const char* path);
@@ -70,12 +113,27 @@ void settings_set_content_path(settings* usersettings, const char* path);
 void settings_set_meta_path(settings* usersettings, const char* path);
 void settings_set_exefs_dir_path(settings* usersettings, const char* path);
 void settings_set_romfs_dir_path(settings* usersettings, const char* path);
+void settings_set_romfs_file_path(settings* usersettings, const char* path);
+void settings_set_romfs_out_path(settings* usersettings, const char* path);
+void settings_set_index_path(settings* usersettings, const char* path);
+void settings_set_write_index_path(settings* usersettings, const char* path);
+void settings_set_mount_path(settings* usersettings, const char* path);
+void settings_set_romfs_tar_path(settings* usersettings, const char* path);
+void settings_set_exefs_tar_path(settings* usersettings, const char* path);
+void settings_set_thumbnail_path(settings* usersettings, const char* path);
+void settings_set_thumbnail_dir_path(settings* usersettings, const char* path);
 void settings_set_firm_dir_path(settings* usersettings, const char* path);
 void settings_set_wav_path(settings* usersettings, const char* path);
 void settings_set_plainrgn_path(settings* usersettings, const char* path);
 void settings_set_mediaunit_size(settings* usersettings, unsigned int size);
 void settings_set_ignore_programid(settings* usersettings, int enable);
 void settings_set_list_romfs_files(settings* usersettings, int enable);
+void settings_set_verify_read(settings* usersettings, int enable);
+void settings_set_index_hashes(settings* usersettings, int enable);
+void settings_set_stdout_data(settings* usersettings, int enable);
 void settings_set_cwav_loopcount(settings* usersettings, u32 loopcount);
+void settings_set_thread_count(settings* usersettings, u32 threadcount);
+void settings_set_thumbnail_size(settings* usersettings, u32 size);
+int  settings_add_romfs_filter(settings* usersettings, const char* pattern, int exclude);
 
 #endif // _SETTINGS_H_
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "sha256simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256SIMD_X86
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHANI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+static const u32 sha256_k[64] =
+{
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+
+int sha256simd_supported( void )
+{
+#ifdef SHA256SIMD_X86
+	static int supported = -1;
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int xcr0_lo, xcr0_hi;
+	int osavx = 0;
+
+	if (supported < 0)
+	{
+		supported = SHA256SIMD_NONE;
+
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+			return supported;
+
+		int ssse3 = (ecx & bit_SSSE3) != 0;
+		int sse41 = (ecx & bit_SSE4_1) != 0;
+
+		if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX))
+		{
+			__asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+			osavx = (xcr0_lo & 6) == 6;
+		}
+
+		if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		{
+			if ((ebx & bit_SHA) && ssse3 && sse41)
+				supported = SHA256SIMD_SHANI;
+			else if ((ebx & bit_AVX2) && osavx)
+				supported = SHA256SIMD_AVX2;
+		}
+	}
+
+	return supported;
+#else
+	return SHA256SIMD_NONE;
+#endif
+}
+
+#ifdef SHA256SIMD_X86
+
+/*
+ * One group of four rounds with the SHA extensions. The message words are
+ * kept in a four entry ring; msg1/msg2 expand the schedule for the groups
+ * ahead while the current group is being processed.
+ */
+#define SHANI_ROUNDS(i)															\
+{																				\
+	if ((i) < 4)																\
+		m[(i)&3] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + (i)*16)), bswap);	\
+	msg = _mm_add_epi32(m[(i)&3], _mm_loadu_si128((const __m128i*)(sha256_k + (i)*4)));	\
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg);						\
+	if ((i) >= 3 && (i) <= 14)													\
+	{																			\
+		tmp = _mm_alignr_epi8(m[(i)&3], m[((i)-1)&3], 4);						\
+		m[((i)+1)&3] = _mm_add_epi32(m[((i)+1)&3], tmp);						\
+		m[((i)+1)&3] = _mm_sha256msg2_epu32(m[((i)+1)&3], m[(i)&3]);			\
+	}																			\
+	msg = _mm_shuffle_epi32(msg, 0x0E);											\
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg);						\
+	if ((i) >= 1 && (i) <= 12)													\
+		m[((i)-1)&3] = _mm_sha256msg1_epu32(m[((i)-1)&3], m[(i)&3]);			\
+}
+
+SHANI_TARGET
+static void sha256_process_shani( u32 state[8],
+								  const u8* data,
+								  u32 blocks )
+{
+	const __m128i bswap = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh;
+	__m128i msg, tmp;
+	__m128i m[4];
+
+	// reorder the state into the ABEF/CDGH layout used by sha256rnds2
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while(blocks--)
+	{
+		abef = state0;
+		cdgh = state1;
+
+		SHANI_ROUNDS(0);  SHANI_ROUNDS(1);  SHANI_ROUNDS(2);  SHANI_ROUNDS(3);
+		SHANI_ROUNDS(4);  SHANI_ROUNDS(5);  SHANI_ROUNDS(6);  SHANI_ROUNDS(7);
+		SHANI_ROUNDS(8);  SHANI_ROUNDS(9);  SHANI_ROUNDS(10); SHANI_ROUNDS(11);
+		SHANI_ROUNDS(12); SHANI_ROUNDS(13); SHANI_ROUNDS(14); SHANI_ROUNDS(15);
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i*)&state[0], state0);
+	_mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+#define ROR32(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define SHA256_ROUND(a,b,c,d,e,f,g,h,wk)										\
+{																				\
+	u32 t1 = h + (ROR32(e,6) ^ ROR32(e,11) ^ ROR32(e,25)) + ((e & f) ^ (~e & g)) + (wk);	\
+	u32 t2 = (ROR32(a,2) ^ ROR32(a,13) ^ ROR32(a,22)) + ((a & b) ^ (a & c) ^ (b & c));	\
+	d += t1;																	\
+	h = t1 + t2;																\
+}
+
+static void sha256_rounds( u32 state[8],
+						   const u32 wk[64] )
+{
+	u32 a = state[0], b = state[1], c = state[2], d = state[3];
+	u32 e = state[4], f = state[5], g = state[6], h = state[7];
+	int i;
+
+	for(i=0; i<64; i+=8)
+	{
+		SHA256_ROUND(a, b, c, d, e, f, g, h, wk[i+0]);
+		SHA256_ROUND(h, a, b, c, d, e, f, g, wk[i+1]);
+		SHA256_ROUND(g, h, a, b, c, d, e, f, wk[i+2]);
+		SHA256_ROUND(f, g, h, a, b, c, d, e, wk[i+3]);
+		SHA256_ROUND(e, f, g, h, a, b, c, d, wk[i+4]);
+		SHA256_ROUND(d, e, f, g, h, a, b, c, wk[i+5]);
+		SHA256_ROUND(c, d, e, f, g, h, a, b, wk[i+6]);
+		SHA256_ROUND(b, c, d, e, f, g, h, a, wk[i+7]);
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+#define AVX2_ROR(x,n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define AVX2_SIGMA0(x) _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(x, 7), AVX2_ROR(x, 18)), _mm256_srli_epi32(x, 3))
+#define AVX2_SIGMA1(x) _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(x, 17), AVX2_ROR(x, 19)), _mm256_srli_epi32(x, 10))
+
+/*
+ * Without the SHA extensions the rounds stay scalar, but the message
+ * schedule of two blocks is expanded side by side, one block per 128-bit
+ * lane, four words at a time. W+K is precomputed for both blocks so the
+ * round loop only does loads.
+ */
+AVX2_TARGET
+static void sha256_process_avx2( u32 state[8],
+								 const u8* data,
+								 u32 blocks )
+{
+	const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+										  12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	u32 wk[2][64] __attribute__((aligned(32)));
+	__m256i x[4];
+	__m256i k, t, s;
+	const u8* second;
+	int i, j;
+
+	while(blocks)
+	{
+		// with an odd block count the last block is simply expanded twice
+		second = (blocks >= 2)? data + 64 : data;
+
+		for(i=0; i<4; i++)
+		{
+			x[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(data + i*16))),
+										   _mm_loadu_si128((const __m128i*)(second + i*16)), 1);
+			x[i] = _mm256_shuffle_epi8(x[i], bswap);
+		}
+
+		for(i=0; i<16; i++)
+		{
+			k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(sha256_k + i*4)));
+			t = _mm256_add_epi32(x[0], k);
+			_mm_store_si128((__m128i*)(wk[0] + i*4), _mm256_castsi256_si128(t));
+			_mm_store_si128((__m128i*)(wk[1] + i*4), _mm256_extracti128_si256(t, 1));
+
+			if (i >= 12)
+			{
+				x[0] = x[1]; x[1] = x[2]; x[2] = x[3];
+				continue;
+			}
+
+			// W[t-16] + s0(W[t-15]) + W[t-7]
+			t = _mm256_add_epi32(x[0], AVX2_SIGMA0(_mm256_alignr_epi8(x[1], x[0], 4)));
+			t = _mm256_add_epi32(t, _mm256_alignr_epi8(x[3], x[2], 4));
+
+			// s1(W[t-2]) for the low two words, then for the high two words
+			s = AVX2_SIGMA1(_mm256_shuffle_epi32(x[3], 0xFE));
+			t = _mm256_add_epi32(t, _mm256_blend_epi32(_mm256_setzero_si256(), s, 0x33));
+			s = AVX2_SIGMA1(_mm256_shuffle_epi32(t, 0x40));
+			t = _mm256_add_epi32(t, _mm256_blend_epi32(_mm256_setzero_si256(), s, 0xCC));
+
+			x[0] = x[1]; x[1] = x[2]; x[2] = x[3]; x[3] = t;
+		}
+
+		for(j=0; j<2 && blocks; j++)
+		{
+			sha256_rounds(state, wk[j]);
+			data += 64;
+			blocks--;
+		}
+	}
+}
+
+#define AVX2_BSIG0(x) _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(x, 2), AVX2_ROR(x, 13)), AVX2_ROR(x, 22))
+#define AVX2_BSIG1(x) _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(x, 6), AVX2_ROR(x, 11)), AVX2_ROR(x, 25))
+
+AVX2_TARGET
+static inline void sha256_transpose8( __m256i r[8] )
+{
+	__m256i t[8], u[8];
+	int i;
+
+	for(i=0; i<8; i+=2)
+	{
+		t[i+0] = _mm256_unpacklo_epi32(r[i], r[i+1]);
+		t[i+1] = _mm256_unpackhi_epi32(r[i], r[i+1]);
+	}
+
+	for(i=0; i<8; i+=4)
+	{
+		u[i+0] = _mm256_unpacklo_epi64(t[i+0], t[i+2]);
+		u[i+1] = _mm256_unpackhi_epi64(t[i+0], t[i+2]);
+		u[i+2] = _mm256_unpacklo_epi64(t[i+1], t[i+3]);
+		u[i+3] = _mm256_unpackhi_epi64(t[i+1], t[i+3]);
+	}
+
+	for(i=0; i<4; i++)
+	{
+		r[i+0] = _mm256_permute2x128_si256(u[i], u[i+4], 0x20);
+		r[i+4] = _mm256_permute2x128_si256(u[i], u[i+4], 0x31);
+	}
+}
+
+AVX2_TARGET
+static inline void sha256_compress_x8( __m256i state[8],
+									   __m256i w[16] )
+{
+	__m256i a = state[0], b = state[1], c = state[2], d = state[3];
+	__m256i e = state[4], f = state[5], g = state[6], h = state[7];
+	__m256i t1, t2;
+	int t;
+
+	for(t=0; t<64; t++)
+	{
+		if (t >= 16)
+		{
+			w[t&15] = _mm256_add_epi32(w[t&15], AVX2_SIGMA1(w[(t-2)&15]));
+			w[t&15] = _mm256_add_epi32(w[t&15], w[(t-7)&15]);
+			w[t&15] = _mm256_add_epi32(w[t&15], AVX2_SIGMA0(w[(t-15)&15]));
+		}
+
+		t1 = _mm256_add_epi32(h, AVX2_BSIG1(e));
+		t1 = _mm256_add_epi32(t1, _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)));
+		t1 = _mm256_add_epi32(t1, _mm256_set1_epi32((int)sha256_k[t]));
+		t1 = _mm256_add_epi32(t1, w[t&15]);
+		t2 = _mm256_add_epi32(AVX2_BSIG0(a), _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b))));
+
+		h = g; g = f; f = e;
+		e = _mm256_add_epi32(d, t1);
+		d = c; c = b; b = a;
+		a = _mm256_add_epi32(t1, t2);
+	}
+
+	state[0] = _mm256_add_epi32(state[0], a); state[1] = _mm256_add_epi32(state[1], b);
+	state[2] = _mm256_add_epi32(state[2], c); state[3] = _mm256_add_epi32(state[3], d);
+	state[4] = _mm256_add_epi32(state[4], e); state[5] = _mm256_add_epi32(state[5], f);
+	state[6] = _mm256_add_epi32(state[6], g); state[7] = _mm256_add_epi32(state[7], h);
+}
+
+/*
+ * Hash eight equally sized messages at once, one message per 32-bit lane.
+ * The messages must be a multiple of 64 bytes, so the final padding block
+ * is the same for every lane.
+ */
+AVX2_TARGET
+static void sha256_many_avx2( const u8* data,
+							  u32 blocksize,
+							  u8* hashes )
+{
+	static const u32 h0[8] =
+	{
+		0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+	};
+	const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+										  12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	u64 bits = (u64)blocksize * 8;
+	__m256i state[8];
+	__m256i w[16];
+	u32 offset;
+	int i;
+
+	for(i=0; i<8; i++)
+		state[i] = _mm256_set1_epi32((int)h0[i]);
+
+	for(offset=0; offset<blocksize; offset+=64)
+	{
+		for(i=0; i<8; i++)
+		{
+			w[i+0] = _mm256_loadu_si256((const __m256i*)(data + (u64)i*blocksize + offset));
+			w[i+8] = _mm256_loadu_si256((const __m256i*)(data + (u64)i*blocksize + offset + 32));
+		}
+
+		sha256_transpose8(w);
+		sha256_transpose8(w + 8);
+
+		for(i=0; i<16; i++)
+			w[i] = _mm256_shuffle_epi8(w[i], bswap);
+
+		sha256_compress_x8(state, w);
+	}
+
+	w[0] = _mm256_set1_epi32((int)0x80000000);
+	for(i=1; i<14; i++)
+		w[i] = _mm256_setzero_si256();
+	w[14] = _mm256_set1_epi32((int)(bits >> 32));
+	w[15] = _mm256_set1_epi32((int)bits);
+	sha256_compress_x8(state, w);
+
+	sha256_transpose8(state);
+	for(i=0; i<8; i++)
+		_mm256_storeu_si256((__m256i*)(hashes + i*32), _mm256_shuffle_epi8(state[i], bswap));
+}
+#endif
+
+void sha256simd_process( u32 state[8],
+						 const u8* data,
+						 u32 blocks )
+{
+#ifdef SHA256SIMD_X86
+	switch(sha256simd_supported())
+	{
+		case SHA256SIMD_SHANI: sha256_process_shani(state, data, blocks); break;
+		case SHA256SIMD_AVX2: sha256_process_avx2(state, data, blocks); break;
+	}
+#endif
+}
+
+/*
+ * Hash count messages of blocksize bytes each, stored back to back, into
+ * hashes. Returns how many leading messages were hashed, which may be
+ * fewer than count; the caller finishes the rest.
+ */
+u32 sha256simd_many( const u8* data,
+					 u32 count,
+					 u32 blocksize,
+					 u8* hashes )
+{
+	u32 done = 0;
+
+#ifdef SHA256SIMD_X86
+	// SHA-NI on a single stream is faster than eight AVX2 lanes
+	if (sha256simd_supported() != SHA256SIMD_AVX2 || (blocksize % 64) != 0)
+		return 0;
+
+	while(count - done >= 8)
+	{
+		sha256_many_avx2(data + (u64)done*blocksize, blocksize, hashes + done*32);
+		done += 8;
+	}
+#endif
+
+	return done;
+}
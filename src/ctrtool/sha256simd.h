@@ -0,0 +1,32 @@
+#ifndef _SHA256SIMD_H_
+#define _SHA256SIMD_H_
+
+#include "types.h"
+
+typedef enum
+{
+	SHA256SIMD_NONE = 0,
+	SHA256SIMD_AVX2,
+	SHA256SIMD_SHANI,
+} sha256simd_types;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int			sha256simd_supported( void );
+
+void		sha256simd_process( u32 state[8],
+								const u8* data,
+								u32 blocks );
+
+u32			sha256simd_many( const u8* data,
+							 u32 count,
+							 u32 blocksize,
+							 u8* hashes );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SHA256SIMD_H_
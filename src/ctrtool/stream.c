@@ -17,11 +17,11 @@ void stream_out_init(stream_out_context* ctx)
 	memset(ctx, 0, sizeof(stream_out_context));
 }
 
-void stream_in_allocate(stream_in_context* ctx, u32 buffersize, FILE* file)
+void stream_in_allocate(stream_in_context* ctx, u32 buffersize, const reader_context* reader)
 {
 	ctx->inbuffer = malloc(buffersize);
 	ctx->inbuffersize = buffersize;
-	ctx->infile = file;
+	ctx->reader = reader;
 	ctx->infileposition = 0;
 }
 
@@ -48,7 +48,7 @@ int stream_in_byte(stream_in_context* ctx, u8* byte)
 {
 	if (ctx->inbufferpos >= ctx->inbufferavailable)
 	{
-		size_t readbytes = fread(ctx->inbuffer, 1, ctx->inbuffersize, ctx->infile);
+		size_t readbytes = reader_read_at(ctx->reader, ctx->infileposition, ctx->inbuffer, ctx->inbuffersize);
 		if (readbytes <= 0)
 			return 0;
 
@@ -61,19 +61,13 @@ int stream_in_byte(stream_in_context* ctx, u8* byte)
 	return 1;
 }
 
-void stream_in_seek(stream_in_context* ctx, u32 position)
+void stream_in_seek(stream_in_context* ctx, u64 position)
 {
-	fseek(ctx->infile, position, SEEK_SET);
 	ctx->infileposition = position;
 	ctx->inbufferpos = 0;
 	ctx->inbufferavailable = 0;
 }
 
-void stream_in_reseek(stream_in_context* ctx)
-{
-	fseek(ctx->infile, ctx->infileposition, SEEK_SET);
-}
-
 
 void stream_out_seek(stream_out_context* ctx, u32 position)
 {
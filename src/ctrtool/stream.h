@@ -3,11 +3,12 @@
 
 #include <stdio.h>
 #include "types.h"
+#include "reader.h"
 
 typedef struct
 {
-	FILE* infile;
-	u32 infileposition;
+	const reader_context* reader;
+	u64 infileposition;
 	u8* inbuffer;
 	u32 inbuffersize;
 	u32 inbufferavailable;
@@ -24,7 +25,7 @@ typedef struct
 
 // create/destroy
 void stream_in_init(stream_in_context* ctx);
-void stream_in_allocate(stream_in_context* ctx, u32 buffersize, FILE* file);
+void stream_in_allocate(stream_in_context* ctx, u32 buffersize, const reader_context* reader);
 void stream_in_destroy(stream_in_context* ctx);
 void stream_out_init(stream_out_context* ctx);
 void stream_out_allocate(stream_out_context* ctx, u32 buffersize, FILE* file);
@@ -32,8 +33,7 @@ void stream_out_destroy(stream_out_context* ctx);
 
 // read/write operations
 int  stream_in_byte(stream_in_context* ctx, u8* byte);
-void stream_in_seek(stream_in_context* ctx, u32 position);
-void stream_in_reseek(stream_in_context* ctx);
+void stream_in_seek(stream_in_context* ctx, u64 position);
 
 int  stream_out_byte(stream_out_context* ctx, u8 byte);
 int  stream_out_buffer(stream_out_context* ctx, const void* buffer, u32 size);
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "types.h"
+#include "tar.h"
+
+#define TAR_MAX_OCTAL_SIZE	0x1FFFFFFFFULL	// largest size in 11 octal digits
+#define TAR_PAX_NAME		"././@PaxHeader"
+
+/*
+ * Archive names are UTF-8 with '/' separators and no leading separator,
+ * whatever the native path encoding is.
+ */
+static char* tar_convert_name(const oschar_t* name, int isdir)
+{
+	char* result;
+	size_t length;
+	size_t i;
+
+	while(*name == '/' || *name == OS_PATH_SEPARATOR)
+		name++;
+
+#ifdef _WIN32
+	length = WideCharToMultiByte(CP_UTF8, 0, name, -1, NULL, 0, NULL, NULL);
+	result = malloc(length + 1);
+	if (result == NULL)
+		return NULL;
+	WideCharToMultiByte(CP_UTF8, 0, name, -1, result, (int)length, NULL, NULL);
+	length = strlen(result);
+#else
+	length = strlen(name);
+	result = malloc(length + 2);
+	if (result == NULL)
+		return NULL;
+	memcpy(result, name, length + 1);
+#endif
+
+	for(i=0; i<length; i++)
+		if (result[i] == OS_PATH_SEPARATOR)
+			result[i] = '/';
+
+	if (isdir)
+	{
+		result[length] = '/';
+		result[length+1] = 0;
+	}
+
+	return result;
+}
+
+static void tar_octal(u8* field, u32 fieldsize, u64 value)
+{
+	// fieldsize-1 digits and a terminating NUL
+	field[fieldsize-1] = 0;
+	while(fieldsize-- > 1)
+	{
+		field[fieldsize-1] = '0' + (value & 7);
+		value >>= 3;
+	}
+}
+
+static int tar_write(tar_context* ctx, const void* data, size_t size)
+{
+	if (ctx->error || size != fwrite(data, 1, size, ctx->file))
+	{
+		ctx->error = 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+static int tar_pad(tar_context* ctx, u64 size)
+{
+	static const u8 zeroes[TAR_BLOCK_SIZE];
+	u32 remainder = (u32)(size % TAR_BLOCK_SIZE);
+
+	if (remainder == 0)
+		return 1;
+
+	return tar_write(ctx, zeroes, TAR_BLOCK_SIZE - remainder);
+}
+
+static int tar_write_header(tar_context* ctx, const char* name, u32 mode, u64 size, u8 typeflag)
+{
+	tar_header header;
+	u32 checksum = 0;
+	size_t namelength = strlen(name);
+	u32 i;
+
+	// a name of exactly 100 bytes is stored without a terminator
+	if (namelength > sizeof(header.name))
+		namelength = sizeof(header.name);
+
+	memset(&header, 0, sizeof(tar_header));
+	memcpy(header.name, name, namelength);
+	tar_octal(header.mode, sizeof(header.mode), mode);
+	tar_octal(header.uid, sizeof(header.uid), 0);
+	tar_octal(header.gid, sizeof(header.gid), 0);
+	tar_octal(header.size, sizeof(header.size), size > TAR_MAX_OCTAL_SIZE? 0 : size);
+	tar_octal(header.mtime, sizeof(header.mtime), ctx->mtime);
+	header.typeflag = typeflag;
+	memcpy(header.magic, "ustar", 6);
+	memcpy(header.version, "00", 2);
+
+	// the checksum is computed with its own field set to spaces
+	memset(header.checksum, ' ', sizeof(header.checksum));
+	for(i=0; i<sizeof(tar_header); i++)
+		checksum += ((u8*)&header)[i];
+	tar_octal(header.checksum, 7, checksum);
+	header.checksum[7] = ' ';
+
+	return tar_write(ctx, &header, sizeof(tar_header));
+}
+
+static u32 tar_pax_record(char* buffer, const char* keyword, const char* value)
+{
+	u32 length = (u32)(strlen(keyword) + strlen(value) + 3);
+	u32 digits = 1;
+	u32 total;
+
+	// the length prefix counts its own digits
+	while(1)
+	{
+		u32 limit = 10;
+		u32 i;
+
+		for(i=1; i<digits; i++)
+			limit *= 10;
+		total = length + digits;
+		if (total < limit)
+			break;
+		digits++;
+	}
+
+	if (buffer)
+		sprintf(buffer, "%u %s=%s\n", total, keyword, value);
+	return total;
+}
+
+static int tar_needs_pax(const char* name, u64 size)
+{
+	const u8* c;
+
+	if (strlen(name) > 100 || size > TAR_MAX_OCTAL_SIZE)
+		return 1;
+
+	for(c=(const u8*)name; *c; c++)
+		if (*c >= 0x80)
+			return 1;
+
+	return 0;
+}
+
+static int tar_write_entry(tar_context* ctx, const char* name, u32 mode, u64 size, u8 typeflag)
+{
+	char sizestring[24];
+	char* records;
+	u32 length;
+	int result;
+
+	if (!tar_needs_pax(name, size))
+		return tar_write_header(ctx, name, mode, size, typeflag);
+
+	sprintf(sizestring, "%llu", (unsigned long long)size);
+	length = tar_pax_record(NULL, "path", name);
+	if (size > TAR_MAX_OCTAL_SIZE)
+		length += tar_pax_record(NULL, "size", sizestring);
+
+	records = malloc(length + 1);
+	if (records == NULL)
+	{
+		ctx->error = 1;
+		return 0;
+	}
+
+	length = tar_pax_record(records, "path", name);
+	if (size > TAR_MAX_OCTAL_SIZE)
+		length += tar_pax_record(records + length, "size", sizestring);
+
+	result = tar_write_header(ctx, TAR_PAX_NAME, 0644, length, 'x') &&
+			 tar_write(ctx, records, length) &&
+			 tar_pad(ctx, length) &&
+			 tar_write_header(ctx, name, mode, size, typeflag);
+
+	free(records);
+	return result;
+}
+
+/*
+ * Open path for writing, or stdout for "-". mtime is stored for every
+ * entry, so the same input always gives the same archive.
+ */
+int tar_open(tar_context* ctx, const char* path, u64 mtime)
+{
+	memset(ctx, 0, sizeof(tar_context));
+	ctx->mtime = mtime;
+
+	if (strcmp(path, "-") == 0)
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		ctx->file = stdout;
+		ctx->isstdout = 1;
+	}
+	else
+	{
+		ctx->file = fopen(path, "wb");
+	}
+
+	if (ctx->file == NULL)
+	{
+		fprintf(stderr, "Error, could not create archive %s\n", path);
+		return 0;
+	}
+
+	return 1;
+}
+
+int tar_add_dir(tar_context* ctx, const oschar_t* name)
+{
+	char* converted = tar_convert_name(name, 1);
+	int result;
+
+	if (converted == NULL)
+		return 0;
+
+	result = tar_write_entry(ctx, converted, 0755, 0, '5');
+	free(converted);
+	return result;
+}
+
+/*
+ * Write the header of a regular file. Exactly size bytes of data must
+ * follow on ctx->file before tar_end_file.
+ */
+int tar_begin_file(tar_context* ctx, const oschar_t* name, u64 size)
+{
+	char* converted = tar_convert_name(name, 0);
+	int result;
+
+	if (converted == NULL)
+		return 0;
+
+	ctx->filesize = size;
+	result = tar_write_entry(ctx, converted, 0644, size, '0');
+	free(converted);
+	return result;
+}
+
+int tar_end_file(tar_context* ctx)
+{
+	return tar_pad(ctx, ctx->filesize);
+}
+
+/*
+ * Finish the archive with two zero blocks. Returns 0 if any write failed.
+ */
+int tar_close(tar_context* ctx)
+{
+	static const u8 zeroes[TAR_BLOCK_SIZE * 2];
+	int result;
+
+	if (ctx->file == NULL)
+		return 0;
+
+	tar_write(ctx, zeroes, sizeof(zeroes));
+	if (fflush(ctx->file) != 0)
+		ctx->error = 1;
+	if (!ctx->isstdout)
+		fclose(ctx->file);
+	ctx->file = NULL;
+
+	result = !ctx->error;
+	if (!result)
+		fprintf(stderr, "Error writing archive\n");
+	return result;
+}
@@ -0,0 +1,59 @@
+#ifndef _TAR_H_
+#define _TAR_H_
+
+#include <stdio.h>
+#include "types.h"
+#include "oschar.h"
+
+#define TAR_BLOCK_SIZE 512
+
+typedef struct
+{
+	u8 name[100];
+	u8 mode[8];
+	u8 uid[8];
+	u8 gid[8];
+	u8 size[12];
+	u8 mtime[12];
+	u8 checksum[8];
+	u8 typeflag;
+	u8 linkname[100];
+	u8 magic[6];
+	u8 version[2];
+	u8 uname[32];
+	u8 gname[32];
+	u8 devmajor[8];
+	u8 devminor[8];
+	u8 prefix[155];
+	u8 padding[12];
+} tar_header;
+
+/*
+ * Writes a POSIX.1-2001 (pax) archive sequentially, so it can go to a
+ * pipe. Names that do not fit a ustar header, or are not plain ASCII,
+ * and sizes of 8 GiB and up get a pax extended header.
+ */
+typedef struct
+{
+	FILE* file;
+	int isstdout;
+	u64 mtime;
+	u64 filesize;
+	int error;
+} tar_context;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int  tar_open(tar_context* ctx, const char* path, u64 mtime);
+int  tar_add_dir(tar_context* ctx, const oschar_t* name);
+int  tar_begin_file(tar_context* ctx, const oschar_t* name, u64 size);
+int  tar_end_file(tar_context* ctx);
+int  tar_close(tar_context* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _TAR_H_
@@ -0,0 +1,799 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#endif
+
+#include "types.h"
+#include "utils.h"
+#include "ctr.h"
+#include "ncch.h"
+#include "ncsd.h"
+#include "exefs.h"
+#include "cia.h"
+#include "thumbnail.h"
+#include "worker.h"
+#include "md5.h"
+
+/*
+ * Only the NCCH header, the exheader (to tell whether the NCCH is
+ * encrypted), the ExeFS header and the icon section are read.
+ */
+static int thumbnail_read_ncch(ncch_context* ncch, u32 actions, u8 smdh[SMDH_SIZE])
+{
+	int index;
+
+	if (!ncch_setup(ncch, actions))
+		return 0;
+
+	if (ncch->encrypted == NCCHCRYPTO_BROKEN)
+	{
+		fprintf(stderr, "Error, NCCH encryption broken.\n");
+		return 0;
+	}
+
+	if (ncch_get_exefs_size(ncch) == 0)
+		return THUMBNAIL_ICON_NONE;
+
+	exefs_read_header(&ncch->exefs, actions);
+	index = exefs_find_section(&ncch->exefs, "icon");
+	if (index < 0)
+		return THUMBNAIL_ICON_NONE;
+
+	return exefs_read_section(&ncch->exefs, index, 0, smdh, SMDH_SIZE);
+}
+
+/*
+ * A CIA carries the SMDH in its plaintext meta section, so only the CIA
+ * header and the icon itself are read: no ticket, no title key and no
+ * content decryption.
+ */
+static int thumbnail_read_cia(const reader_context* reader, settings* usersettings, u64 filesize, u8 smdh[SMDH_SIZE])
+{
+	cia_context* cia = malloc(sizeof(cia_context));
+	int result = 0;
+
+	if (cia == NULL)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		return 0;
+	}
+
+	cia_init(cia);
+	cia_set_reader(cia, reader);
+	cia_set_size(cia, filesize);
+	cia_set_usersettings(cia, usersettings);
+	if (!cia_read_header(cia))
+		goto clean;
+
+	if (cia->sizemeta < CIA_META_ICON_OFFSET + SMDH_SIZE)
+	{
+		result = THUMBNAIL_ICON_NONE;
+		goto clean;
+	}
+	if (filesize && cia->offsetmeta + CIA_META_ICON_OFFSET + SMDH_SIZE > filesize)
+		goto clean;
+
+	result = (reader_read_at(reader, cia->offsetmeta + CIA_META_ICON_OFFSET, smdh, SMDH_SIZE) == SMDH_SIZE);
+
+clean:
+	free(cia);
+	return result;
+}
+
+/*
+ * Find the SMDH of an image and read it into smdh. Returns one of the
+ * THUMBNAIL_ICON_* results.
+ */
+int thumbnail_read_icon(const reader_context* reader, u32 filetype, u32 ncchindex, settings* usersettings, u32 actions, u8 smdh[SMDH_SIZE])
+{
+	ncsd_context* ncsd = calloc(1, sizeof(ncsd_context));
+	ncch_context* ncch;
+	exefs_context exefs;
+	struct stat imagestat;
+	int index;
+	int result = 0;
+
+	if (ncsd == NULL)
+	{
+		fprintf(stderr, "Error allocating memory\n");
+		return 0;
+	}
+
+	ncch = &ncsd->ncch;
+	memset(&imagestat, 0, sizeof(imagestat));
+	fstat(fileno(reader->file), &imagestat);
+	actions &= ~(InfoFlag | ExtractFlag | VerifyFlag | ShowKeysFlag);
+
+	switch(filetype)
+	{
+		case FILETYPE_CCI:
+			ncsd_init(ncsd);
+			ncsd_set_reader(ncsd, reader);
+			ncsd_set_ncch_index(ncsd, ncchindex);
+			ncsd_set_usersettings(ncsd, usersettings);
+			if (ncsd_setup(ncsd))
+				result = thumbnail_read_ncch(ncch, actions, smdh);
+		break;
+
+		case FILETYPE_CXI:
+			ncch_init(ncch);
+			ncch_set_reader(ncch, reader);
+			ncch_set_size(ncch, imagestat.st_size);
+			ncch_set_usersettings(ncch, usersettings);
+			result = thumbnail_read_ncch(ncch, actions, smdh);
+		break;
+
+		case FILETYPE_EXEFS:
+			exefs_init(&exefs);
+			exefs_set_reader(&exefs, reader);
+			exefs_set_size(&exefs, imagestat.st_size);
+			exefs_read_header(&exefs, actions);
+			index = exefs_find_section(&exefs, "icon");
+			if (index >= 0)
+				result = exefs_read_section(&exefs, index, 0, smdh, SMDH_SIZE);
+			else
+				result = THUMBNAIL_ICON_NONE;
+		break;
+
+		case FILETYPE_CIA:
+			result = thumbnail_read_cia(reader, usersettings, imagestat.st_size, smdh);
+		break;
+
+		default:
+			fprintf(stderr, "Error, thumbnails need an NCSD, NCCH, CIA or ExeFS file\n");
+			free(ncsd);
+			return THUMBNAIL_ICON_ERROR;
+	}
+
+	free(ncsd);
+
+	if (result == THUMBNAIL_ICON_FOUND && memcmp(smdh, "SMDH", 4) != 0)
+		result = THUMBNAIL_ICON_ERROR;
+	if (result == THUMBNAIL_ICON_ERROR)
+		fprintf(stderr, "Error, could not read icon\n");
+	return result;
+}
+
+/*
+ * The large icon is stored as 8x8 tiles, and the pixels of a tile in
+ * Morton (Z) order: x and y are the even and odd bits of the index.
+ */
+static void thumbnail_decode_icon(const u8* icon, u8* rgb)
+{
+	u32 tilesperrow = SMDH_ICON_LARGE_DIMENSION / 8;
+	u32 i;
+
+	for(i=0; i<SMDH_ICON_LARGE_DIMENSION * SMDH_ICON_LARGE_DIMENSION; i++)
+	{
+		u32 tile = i / 64;
+		u32 within = i % 64;
+		u32 x = (tile % tilesperrow) * 8 + ((within & 1) | ((within >> 1) & 2) | ((within >> 2) & 4));
+		u32 y = (tile / tilesperrow) * 8 + (((within >> 1) & 1) | ((within >> 2) & 2) | ((within >> 3) & 4));
+		u32 color = getle16(icon + i * 2);
+		u32 r = (color >> 11) & 0x1f;
+		u32 g = (color >> 5) & 0x3f;
+		u32 b = color & 0x1f;
+		u8* pixel = rgb + (y * SMDH_ICON_LARGE_DIMENSION + x) * 3;
+
+		// replicate the top bits so white stays 0xff
+		pixel[0] = (r << 3) | (r >> 2);
+		pixel[1] = (g << 2) | (g >> 4);
+		pixel[2] = (b << 3) | (b >> 2);
+	}
+}
+
+/*
+ * Resample one axis with a tent filter, which interpolates linearly when
+ * enlarging and averages the covered area when shrinking. Element c of
+ * position p on line l is at l*linestride + p*posstride + c.
+ */
+static void thumbnail_resample(const float* input, float* output, u32 insize, u32 outsize, u32 lines,
+							   u32 inlinestride, u32 inposstride, u32 outlinestride, u32 outposstride)
+{
+	float scale = (float)insize / outsize;
+	float support = scale > 1? scale : 1;
+	u32 o;
+	u32 l;
+	u32 c;
+
+	for(o=0; o<outsize; o++)
+	{
+		float center = (o + 0.5f) * scale - 0.5f;
+		int first = (int)(center - support) - 1;
+		int last = (int)(center + support) + 1;
+
+		for(l=0; l<lines; l++)
+		{
+			float sum[3] = { 0, 0, 0 };
+			float total = 0;
+			int i;
+
+			for(i=first; i<=last; i++)
+			{
+				float distance = i > center? i - center : center - i;
+				float weight = 1 - distance / support;
+				int clamped = i < 0? 0 : (i >= (int)insize? (int)insize - 1 : i);
+
+				if (weight <= 0)
+					continue;
+
+				for(c=0; c<3; c++)
+					sum[c] += weight * input[l * inlinestride + clamped * inposstride + c];
+				total += weight;
+			}
+
+			for(c=0; c<3; c++)
+				output[l * outlinestride + o * outposstride + c] = sum[c] / total;
+		}
+	}
+}
+
+static int thumbnail_resize(const u8* input, u32 insize, u8* output, u32 outsize)
+{
+	float* source = malloc(insize * insize * 3 * sizeof(float));
+	float* wide = malloc(outsize * insize * 3 * sizeof(float));
+	float* result = malloc(outsize * outsize * 3 * sizeof(float));
+	u32 i;
+
+	if (source == NULL || wide == NULL || result == NULL)
+	{
+		free(source);
+		free(wide);
+		free(result);
+		return 0;
+	}
+
+	for(i=0; i<insize * insize * 3; i++)
+		source[i] = input[i];
+
+	// rows first, then columns of the widened image
+	thumbnail_resample(source, wide, insize, outsize, insize, insize * 3, 3, outsize * 3, 3);
+	thumbnail_resample(wide, result, insize, outsize, outsize, 3, outsize * 3, 3, outsize * 3);
+
+	for(i=0; i<outsize * outsize * 3; i++)
+		output[i] = (u8)(result[i] + 0.5f);
+
+	free(source);
+	free(wide);
+	free(result);
+	return 1;
+}
+
+/*
+ * Write the large icon of smdh to file as a size x size PNG. Returns 1
+ * on success.
+ */
+int thumbnail_write(FILE* file, const u8 smdh[SMDH_SIZE], u32 size, const png_text* text, u32 textcount)
+{
+	u8 icon[SMDH_ICON_LARGE_DIMENSION * SMDH_ICON_LARGE_DIMENSION * 3];
+	u8* resized = NULL;
+	const u8* image = icon;
+	int result = 0;
+
+	thumbnail_decode_icon(smdh + SMDH_ICON_LARGE_OFFSET, icon);
+
+	if (size != SMDH_ICON_LARGE_DIMENSION)
+	{
+		resized = malloc(size * size * 3);
+		if (resized == NULL || !thumbnail_resize(icon, SMDH_ICON_LARGE_DIMENSION, resized, size))
+		{
+			fprintf(stderr, "Error allocating memory\n");
+			goto clean;
+		}
+		image = resized;
+	}
+
+	result = png_write(file, image, size, size, text, textcount);
+
+clean:
+	free(resized);
+	return result;
+}
+
+/*
+ * Same as thumbnail_write, to path or to stdout for "-".
+ */
+int thumbnail_save(const u8 smdh[SMDH_SIZE], u32 size, const char* path)
+{
+	FILE* file;
+	int result;
+
+	if (strcmp(path, "-") == 0)
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		file = stdout;
+	}
+	else
+	{
+		file = fopen(path, "wb");
+	}
+
+	if (file == NULL)
+	{
+		fprintf(stderr, "Error, failed to create file %s\n", path);
+		return 0;
+	}
+
+	result = thumbnail_write(file, smdh, size, NULL, 0);
+	if (fflush(file) != 0)
+		result = 0;
+	if (file != stdout && fclose(file) != 0)
+		result = 0;
+	if (!result)
+		fprintf(stderr, "Error writing %s\n", path);
+	return result;
+}
+
+int thumbnail_run(const reader_context* reader, u32 filetype, u32 ncchindex, settings* usersettings, u32 actions, const char* path, u32 size)
+{
+	u8 smdh[SMDH_SIZE];
+	int result;
+
+	if (size == 0 || size > THUMBNAIL_MAX_SIZE)
+	{
+		fprintf(stderr, "Error, thumbnail size must be between 1 and %d\n", THUMBNAIL_MAX_SIZE);
+		return 0;
+	}
+
+	result = thumbnail_read_icon(reader, filetype, ncchindex, usersettings, actions, smdh);
+	if (result == THUMBNAIL_ICON_NONE)
+		fprintf(stderr, "Error, no icon found\n");
+	if (result != THUMBNAIL_ICON_FOUND)
+		return 0;
+
+	return thumbnail_save(smdh, size, path);
+}
+
+#ifndef _WIN32
+
+enum
+{
+	THUMBNAIL_FAILED = 0,
+	THUMBNAIL_WRITTEN,
+	THUMBNAIL_CURRENT,
+	THUMBNAIL_SKIPPED,
+};
+
+typedef struct
+{
+	settings* usersettings;
+	u32 actions;
+	char cachedir[PATH_MAX];
+	char** paths;
+	u32 pathcount;
+	u32 pathcapacity;
+	u8* status;
+} thumbnail_batch;
+
+static const struct
+{
+	const char* name;
+	u32 size;
+} thumbnail_flavors[] =
+{
+	{ "normal", 128 },
+	{ "large", 256 },
+};
+
+#define THUMBNAIL_FLAVOR_COUNT (sizeof(thumbnail_flavors) / sizeof(thumbnail_flavors[0]))
+#define THUMBNAIL_FAIL_DIR "fail/ctrtool"
+
+/*
+ * Create path and any missing parents, private to the user as the
+ * thumbnail spec asks.
+ */
+static int thumbnail_makedirs(char* path)
+{
+	char* c;
+
+	for(c=path+1; *c; c++)
+	{
+		if (*c != '/')
+			continue;
+		*c = 0;
+		if (mkdir(path, 0700) != 0 && errno != EEXIST)
+		{
+			*c = '/';
+			return 0;
+		}
+		*c = '/';
+	}
+
+	return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+static int thumbnail_cache_dir(char* path, u32 size)
+{
+	const char* cachehome = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+
+	if (cachehome && cachehome[0] == '/')
+		snprintf(path, size, "%s/thumbnails", cachehome);
+	else if (home && home[0])
+		snprintf(path, size, "%s/.cache/thumbnails", home);
+	else
+		return 0;
+
+	return 1;
+}
+
+/*
+ * The cache key is the MD5 of the file URI, so the escaping has to match
+ * what GLib produces for file names: everything but unreserved characters
+ * and !$&'()*+,:=@/ is percent encoded.
+ */
+static char* thumbnail_uri(const char* path)
+{
+	static const char safe[] = "!$&'()*+,-./:=@_~";
+	char* absolute = realpath(path, NULL);
+	char* uri;
+	char* out;
+	const u8* c;
+
+	if (absolute == NULL)
+		return NULL;
+
+	uri = malloc(strlen("file://") + strlen(absolute) * 3 + 1);
+	if (uri == NULL)
+	{
+		free(absolute);
+		return NULL;
+	}
+
+	out = uri + sprintf(uri, "file://");
+	for(c=(const u8*)absolute; *c; c++)
+	{
+		if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || strchr(safe, *c))
+			*out++ = *c;
+		else
+			out += sprintf(out, "%%%02X", *c);
+	}
+	*out = 0;
+
+	free(absolute);
+	return uri;
+}
+
+static int thumbnail_is_current(const char* target, const char* uri, const char* mtime)
+{
+	char value[PATH_MAX * 3 + 16];
+	FILE* file = fopen(target, "rb");
+	int result = 0;
+
+	if (file == NULL)
+		return 0;
+
+	if (png_read_text(file, "Thumb::MTime", value, sizeof(value)) && strcmp(value, mtime) == 0)
+	{
+		rewind(file);
+		result = png_read_text(file, "Thumb::URI", value, sizeof(value)) && strcmp(value, uri) == 0;
+	}
+
+	fclose(file);
+	return result;
+}
+
+/*
+ * Write to a temporary file next to target and rename it over, so a
+ * file manager never sees a partial thumbnail. Without an smdh a 1x1
+ * image is written, which is all a failure marker needs.
+ */
+static int thumbnail_store(const char* target, const u8 smdh[SMDH_SIZE], u32 size, const png_text* text, u32 textcount)
+{
+	char temp[PATH_MAX + 72];
+	size_t length = strlen(target);
+	FILE* file;
+	int fd;
+	int result;
+
+	if (length + sizeof(".XXXXXX") > sizeof(temp))
+		return 0;
+	memcpy(temp, target, length);
+	memcpy(temp + length, ".XXXXXX", sizeof(".XXXXXX"));
+	fd = mkstemp(temp);
+	if (fd < 0)
+		return 0;
+
+	file = fdopen(fd, "wb");
+	if (file == NULL)
+	{
+		close(fd);
+		unlink(temp);
+		return 0;
+	}
+
+	if (smdh)
+		result = thumbnail_write(file, smdh, size, text, textcount);
+	else
+		result = png_write(file, (const u8*)"\0\0\0", 1, 1, text, textcount);
+	if (fclose(file) != 0)
+		result = 0;
+	if (result && rename(temp, target) != 0)
+		result = 0;
+	if (!result)
+		unlink(temp);
+	return result;
+}
+
+static u32 thumbnail_file_type(const reader_context* reader)
+{
+	u8 magic[4];
+
+	if (4 == reader_read_at(reader, 0, magic, 4) && getle32(magic) == 0x2020)
+		return FILETYPE_CIA;
+	if (4 == reader_read_at(reader, 0x100, magic, 4))
+	{
+		if (getle32(magic) == MAGIC_NCCH)
+			return FILETYPE_CXI;
+		if (getle32(magic) == MAGIC_NCSD)
+			return FILETYPE_CCI;
+	}
+
+	return FILETYPE_UNKNOWN;
+}
+
+static void thumbnail_batch_file(void* arg, u32 index)
+{
+	thumbnail_batch* batch = (thumbnail_batch*) arg;
+	const char* path = batch->paths[index];
+	char targets[THUMBNAIL_FLAVOR_COUNT][PATH_MAX + 64];
+	char failtarget[PATH_MAX + 64];
+	char mtime[24];
+	char filesize[24];
+	char name[33];
+	u8 digest[16];
+	u8 smdh[SMDH_SIZE];
+	png_text text[4];
+	struct stat imagestat;
+	reader_context reader;
+	FILE* file = NULL;
+	char* uri = NULL;
+	u32 needed = 0;
+	u32 filetype;
+	int iconresult;
+	u32 i;
+
+	batch->status[index] = THUMBNAIL_FAILED;
+
+	if (stat(path, &imagestat) != 0 || (uri = thumbnail_uri(path)) == NULL)
+		goto clean;
+
+	md5((const u8*)uri, (u32)strlen(uri), digest);
+	for(i=0; i<16; i++)
+		sprintf(name + i * 2, "%02x", digest[i]);
+	snprintf(mtime, sizeof(mtime), "%lld", (long long)imagestat.st_mtime);
+	snprintf(filesize, sizeof(filesize), "%lld", (long long)imagestat.st_size);
+
+	// files without an icon are marked once and then left alone until they change
+	snprintf(failtarget, sizeof(failtarget), "%s/%s/%s.png", batch->cachedir, THUMBNAIL_FAIL_DIR, name);
+	if (thumbnail_is_current(failtarget, uri, mtime))
+	{
+		batch->status[index] = THUMBNAIL_SKIPPED;
+		goto clean;
+	}
+
+	for(i=0; i<THUMBNAIL_FLAVOR_COUNT; i++)
+	{
+		snprintf(targets[i], sizeof(targets[i]), "%s/%s/%s.png", batch->cachedir, thumbnail_flavors[i].name, name);
+		if (!thumbnail_is_current(targets[i], uri, mtime))
+			needed |= 1 << i;
+	}
+
+	if (needed == 0)
+	{
+		batch->status[index] = THUMBNAIL_CURRENT;
+		goto clean;
+	}
+
+	file = fopen(path, "rb");
+	if (file == NULL)
+		goto clean;
+
+	reader_init(&reader, file, NULL);
+	filetype = thumbnail_file_type(&reader);
+	if (filetype == FILETYPE_UNKNOWN)
+	{
+		batch->status[index] = THUMBNAIL_SKIPPED;
+		goto clean;
+	}
+
+	iconresult = thumbnail_read_icon(&reader, filetype, 0, batch->usersettings, batch->actions, smdh);
+	if (iconresult == THUMBNAIL_ICON_ERROR)
+		goto clean;
+
+	text[0].keyword = "Thumb::URI";
+	text[0].text = uri;
+	text[1].keyword = "Thumb::MTime";
+	text[1].text = mtime;
+
+	if (iconresult == THUMBNAIL_ICON_NONE)
+	{
+		if (thumbnail_store(failtarget, NULL, 1, text, 2))
+			batch->status[index] = THUMBNAIL_SKIPPED;
+		goto clean;
+	}
+
+	text[2].keyword = "Thumb::Size";
+	text[2].text = filesize;
+	text[3].keyword = "Software";
+	text[3].text = "ctrtool";
+
+	for(i=0; i<THUMBNAIL_FLAVOR_COUNT; i++)
+		if ((needed & (1 << i)) && !thumbnail_store(targets[i], smdh, thumbnail_flavors[i].size, text, 4))
+			goto clean;
+
+	batch->status[index] = THUMBNAIL_WRITTEN;
+
+clean:
+	if (batch->status[index] == THUMBNAIL_FAILED)
+		fprintf(stderr, "Error, could not create thumbnail for %s\n", path);
+	if (file)
+		fclose(file);
+	free(uri);
+}
+
+static int thumbnail_add_path(thumbnail_batch* batch, char* path)
+{
+	if (batch->pathcount == batch->pathcapacity)
+	{
+		u32 capacity = batch->pathcapacity? batch->pathcapacity * 2 : 256;
+		char** paths = realloc(batch->paths, capacity * sizeof(char*));
+
+		if (paths == NULL)
+			return 0;
+		batch->paths = paths;
+		batch->pathcapacity = capacity;
+	}
+
+	batch->paths[batch->pathcount++] = path;
+	return 1;
+}
+
+/*
+ * Collect the regular files below dir. Hidden entries are skipped, and
+ * symlinked directories are not followed so a link cannot loop.
+ */
+static int thumbnail_collect(thumbnail_batch* batch, const char* dir)
+{
+	DIR* handle = opendir(dir);
+	struct dirent* entry;
+	struct stat entrystat;
+	int result = 1;
+
+	if (handle == NULL)
+	{
+		fprintf(stderr, "Error, could not open directory %s\n", dir);
+		return 0;
+	}
+
+	while(result && (entry = readdir(handle)) != NULL)
+	{
+		char* path;
+
+		if (entry->d_name[0] == '.')
+			continue;
+
+		path = malloc(strlen(dir) + strlen(entry->d_name) + 2);
+		if (path == NULL)
+		{
+			result = 0;
+			break;
+		}
+		sprintf(path, "%s/%s", dir, entry->d_name);
+
+		if (lstat(path, &entrystat) == 0 && S_ISDIR(entrystat.st_mode))
+		{
+			thumbnail_collect(batch, path);
+			free(path);
+		}
+		else if (stat(path, &entrystat) == 0 && S_ISREG(entrystat.st_mode))
+		{
+			if (!thumbnail_add_path(batch, path))
+			{
+				free(path);
+				result = 0;
+			}
+		}
+		else
+		{
+			free(path);
+		}
+	}
+
+	closedir(handle);
+	return result;
+}
+
+static int thumbnail_compare_paths(const void* a, const void* b)
+{
+	return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/*
+ * Thumbnail every NCSD/NCCH/CIA file below dir into the freedesktop
+ * thumbnail cache, in the normal and large sizes. A thumbnail whose
+ * Thumb::URI and Thumb::MTime still match the file is left alone.
+ */
+int thumbnail_batch_run(const char* dir, settings* usersettings, u32 actions)
+{
+	thumbnail_batch batch;
+	u32 counts[4] = { 0, 0, 0, 0 };
+	int result = 0;
+	u32 i;
+
+	memset(&batch, 0, sizeof(thumbnail_batch));
+	batch.usersettings = usersettings;
+	batch.actions = actions;
+
+	if (!thumbnail_cache_dir(batch.cachedir, sizeof(batch.cachedir)))
+	{
+		fprintf(stderr, "Error, neither XDG_CACHE_HOME nor HOME is set\n");
+		return 0;
+	}
+
+	// the last directory holds the failure markers
+	for(i=0; i<=THUMBNAIL_FLAVOR_COUNT; i++)
+	{
+		char subdir[PATH_MAX + 16];
+
+		snprintf(subdir, sizeof(subdir), "%s/%s", batch.cachedir, i < THUMBNAIL_FLAVOR_COUNT? thumbnail_flavors[i].name : THUMBNAIL_FAIL_DIR);
+		if (!thumbnail_makedirs(subdir))
+		{
+			fprintf(stderr, "Error, could not create %s\n", subdir);
+			return 0;
+		}
+	}
+
+	if (!thumbnail_collect(&batch, dir))
+		goto clean;
+
+	if (batch.pathcount)
+	{
+		qsort(batch.paths, batch.pathcount, sizeof(char*), thumbnail_compare_paths);
+		batch.status = calloc(batch.pathcount, 1);
+		if (batch.status == NULL)
+		{
+			fprintf(stderr, "Error allocating memory\n");
+			goto clean;
+		}
+
+		// the keyset is loaded once and shared, every job only reads it
+		worker_run(settings_get_thread_count(usersettings), batch.pathcount, thumbnail_batch_file, &batch);
+	}
+
+	for(i=0; i<batch.pathcount; i++)
+		counts[batch.status[i]]++;
+
+	fprintf(stdout, "Thumbnails:             %u written, %u up to date, %u failed, %u skipped\n",
+			counts[THUMBNAIL_WRITTEN], counts[THUMBNAIL_CURRENT], counts[THUMBNAIL_FAILED], counts[THUMBNAIL_SKIPPED]);
+	result = counts[THUMBNAIL_FAILED] == 0;
+
+clean:
+	for(i=0; i<batch.pathcount; i++)
+		free(batch.paths[i]);
+	free(batch.paths);
+	free(batch.status);
+	return result;
+}
+
+#else
+
+int thumbnail_batch_run(const char* dir, settings* usersettings, u32 actions)
+{
+	fprintf(stderr, "Error, --thumbnail-dir needs a freedesktop thumbnail cache and is not supported on Windows\n");
+	return 0;
+}
+
+#endif // _WIN32
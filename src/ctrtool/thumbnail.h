@@ -0,0 +1,29 @@
+#ifndef _THUMBNAIL_H_
+#define _THUMBNAIL_H_
+
+#include <stdio.h>
+#include "types.h"
+#include "settings.h"
+#include "reader.h"
+#include "png.h"
+
+#define SMDH_SIZE					0x36C0
+#define SMDH_ICON_LARGE_OFFSET		0x24C0
+#define SMDH_ICON_LARGE_DIMENSION	48		// 48x48 RGB565 in 8x8 tiles
+#define THUMBNAIL_MAX_SIZE			1024
+
+// results of thumbnail_read_icon
+enum
+{
+	THUMBNAIL_ICON_ERROR = 0,
+	THUMBNAIL_ICON_FOUND,
+	THUMBNAIL_ICON_NONE,		// a valid image without an icon, e.g. a system title
+};
+
+int thumbnail_read_icon(const reader_context* reader, u32 filetype, u32 ncchindex, settings* usersettings, u32 actions, u8 smdh[SMDH_SIZE]);
+int thumbnail_write(FILE* file, const u8 smdh[SMDH_SIZE], u32 size, const png_text* text, u32 textcount);
+int thumbnail_save(const u8 smdh[SMDH_SIZE], u32 size, const char* path);
+int thumbnail_run(const reader_context* reader, u32 filetype, u32 ncchindex, settings* usersettings, u32 actions, const char* path, u32 size);
+int thumbnail_batch_run(const char* dir, settings* usersettings, u32 actions);
+
+#endif // _THUMBNAIL_H_
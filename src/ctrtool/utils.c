@@ -1,8 +1,13 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 #ifdef _WIN32
 #include <direct.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
 #endif
 #include "utils.h"
 
@@ -236,4 +241,55 @@ u64 _fsize(const char *filename)
 	else
 		return st.st_size;
 #endif
-}
\ No newline at end of file
+}
+
+/*
+ * Read from an absolute offset, so several threads can read the same
+ * file at once. Returns the number of bytes read. With pread the stream
+ * position is untouched; on Windows ReadFile moves the file pointer of
+ * the handle, so stream reads on the same file must seek first.
+ */
+size_t fpread(FILE* file, void* buffer, size_t size, u64 offset)
+{
+	u8* out = (u8*) buffer;
+	size_t total = 0;
+
+#ifdef _WIN32
+	HANDLE handle = (HANDLE) _get_osfhandle(_fileno(file));
+
+	while(total < size)
+	{
+		OVERLAPPED overlapped;
+		DWORD chunk = (size - total > 0x40000000)? 0x40000000 : (DWORD)(size - total);
+		DWORD read = 0;
+
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = (DWORD) offset;
+		overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+		if (!ReadFile(handle, out + total, chunk, &read, &overlapped) || read == 0)
+			break;
+
+		total += read;
+		offset += read;
+	}
+#else
+	int fd = fileno(file);
+
+	while(total < size)
+	{
+#ifdef __linux__
+		ssize_t read = pread64(fd, out + total, size - total, (off64_t) offset);
+#else
+		ssize_t read = pread(fd, out + total, size - total, (off_t) offset);
+#endif
+		if (read <= 0)
+			break;
+
+		total += read;
+		offset += read;
+	}
+#endif
+
+	return total;
+}
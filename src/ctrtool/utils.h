@@ -40,6 +40,7 @@ int key_load(char *name, u8 *out_buf);
 int makedir(const char* dir);
 
 u64 _fsize(const char *filename);
+size_t fpread(FILE* file, void* buffer, size_t size, u64 offset);
 
 #ifdef _MSC_VER
 inline int fseeko64(FILE *__stream, long long __off, int __whence)
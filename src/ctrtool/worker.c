@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "types.h"
+#include "worker.h"
+
+typedef struct
+{
+	worker_func func;
+	void* arg;
+	u32 jobcount;
+	u32 nextjob;
+	pthread_mutex_t lock;
+} worker_queue;
+
+
+u32 worker_default_count(void)
+{
+	long count;
+
+#ifdef _WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	count = info.dwNumberOfProcessors;
+#else
+	count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	if (count < 1)
+		count = 1;
+	if (count > WORKER_MAX_THREADS)
+		count = WORKER_MAX_THREADS;
+
+	return (u32) count;
+}
+
+static void* worker_main(void* param)
+{
+	worker_queue* queue = (worker_queue*) param;
+	u32 job;
+
+	while(1)
+	{
+		pthread_mutex_lock(&queue->lock);
+		job = queue->nextjob;
+		if (job < queue->jobcount)
+			queue->nextjob++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (job >= queue->jobcount)
+			break;
+
+		queue->func(queue->arg, job);
+	}
+
+	return NULL;
+}
+
+/*
+ * Run jobs 0..jobcount-1 on up to threadcount threads, the calling thread
+ * included. Jobs are handed out in ascending order, and the call returns
+ * once every job has finished.
+ */
+void worker_run(u32 threadcount, u32 jobcount, worker_func func, void* arg)
+{
+	pthread_t threads[WORKER_MAX_THREADS];
+	worker_queue queue;
+	u32 started = 0;
+	u32 i;
+
+	if (threadcount > jobcount)
+		threadcount = jobcount;
+	if (threadcount > WORKER_MAX_THREADS)
+		threadcount = WORKER_MAX_THREADS;
+
+	if (threadcount <= 1)
+	{
+		for(i=0; i<jobcount; i++)
+			func(arg, i);
+		return;
+	}
+
+	memset(&queue, 0, sizeof(worker_queue));
+	queue.func = func;
+	queue.arg = arg;
+	queue.jobcount = jobcount;
+	pthread_mutex_init(&queue.lock, NULL);
+
+	for(i=0; i<threadcount-1; i++)
+	{
+		if (pthread_create(&threads[started], NULL, worker_main, &queue) != 0)
+			break;
+		started++;
+	}
+
+	worker_main(&queue);
+
+	for(i=0; i<started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&queue.lock);
+}
@@ -0,0 +1,21 @@
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+#include "types.h"
+
+#define WORKER_MAX_THREADS 256
+
+typedef void (*worker_func)(void* arg, u32 index);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+u32 worker_default_count(void);
+void worker_run(u32 threadcount, u32 jobcount, worker_func func, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _WORKER_H_